@@ -48,6 +48,7 @@
 #include "../tinyexpr.h"
 #include <array>
 #include <regex>
+#include <thread>
 #include <catch2/catch_test_macros.hpp>
 #include <catch2/matchers/catch_matchers_floating_point.hpp>
 #include <catch2/benchmark/catch_benchmark_all.hpp>
@@ -682,6 +683,19 @@ TEST_CASE("Main tests", "[main]")
         CHECK(tep.evaluate("average(1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22)") == 11.5);
         CHECK(tep.evaluate("average(1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23)") == 12);
         CHECK(tep.evaluate("average(1,2,3,4,5,6,7,8,9,10,11,12,13,14,15,16,17,18,19,20,21,22,23,24)") == 12.5);
+        // more than 24 arguments
+        std::string manyArgs{ "1" };
+        for (int i = 2; i <= 100; ++i)
+            {
+            manyArgs += "," + std::to_string(i);
+            }
+        CHECK(tep.evaluate("sum(" + manyArgs + ")") == 5050);
+        CHECK(tep.evaluate("average(" + manyArgs + ")") == 50.5);
+        CHECK(tep.evaluate("max(" + manyArgs + ")") == 100);
+        CHECK(tep.evaluate("min(" + manyArgs + ")") == 1);
+        CHECK(tep.evaluate("and(" + manyArgs + ", 0)") == 0);
+        CHECK(tep.evaluate("or(" + manyArgs + ")") == 1);
+        CHECK(tep.evaluate("ifs(0,1, 0,2, 0,3, 0,4, 0,5, 0,6, 0,7, 0,8, 0,9, 0,10, 0,11, 0,12, 1,13)") == 13);
         }
     }
 
@@ -1956,6 +1970,23 @@ TEST_CASE("Precedence", "[precedence]")
     CHECK_THAT(27, // this is what Excel does
         Catch::Matchers::WithinRel(
             WITHIN_TYPE_CAST(tep.evaluate("5 ** 2 + 2"))));
+
+    // each level binds more tightly than the one before it
+    CHECK(tep.evaluate("1 || 0 && 0") == 1);
+    CHECK(tep.evaluate("0 = 1 < 0") == 1);
+    CHECK(tep.evaluate("0 <> 1 >= 2") == 0);
+#ifndef TE_FLOAT
+    CHECK(tep.evaluate("1 << 2 < 3") == 0);
+#endif
+    CHECK(tep.evaluate("2 < 1 + 2") == 1);
+    CHECK(tep.evaluate("1 + 2 * 3 % 4") == 3);
+    // and operators of the same level group from the left
+    CHECK(tep.evaluate("3 - 2 - 1") == 0);
+    CHECK(tep.evaluate("12 / 3 / 2") == 2);
+    CHECK(tep.evaluate("1 < 2 < 1") == 0);
+    // a function that takes one argument without parentheses only takes its nearest operand
+    CHECK(tep.evaluate("sqrt 16 * 2") == 8);
+    CHECK(tep.evaluate("abs -2 + 1") == 3);
     }
 
 TEST_CASE("Round", "[round]")
@@ -3134,6 +3165,49 @@ TEST_CASE("Lambdas", "[lambdas]")
     CHECK(tep.evaluate("MYSUM(5, 6)") == 11);
     }
 
+TEST_CASE("Variadic functions", "[variadic]")
+    {
+    te_type x{ 2 };
+    te_parser tep;
+    tep.set_variables_and_functions({
+        { "x", &x },
+        { "product",
+            static_cast<te_funv>([](const te_type* vals, size_t count) noexcept
+                {
+                te_type result{ 1 };
+                for (size_t i = 0; i < count; ++i)
+                    {
+                    result *= vals[i];
+                    }
+                return result;
+                }),
+            TE_PURE },
+        { "argcount",
+            static_cast<te_funv>([](const te_type*, size_t count) noexcept
+                { return static_cast<te_type>(count); }) }
+        });
+
+    CHECK(tep.evaluate("product(2, 3, 4)") == 24);
+    CHECK(tep.evaluate("product(x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x, x)") == 67108864);
+    // only the arguments that were passed are counted
+    CHECK(tep.evaluate("argcount(x)") == 1);
+    CHECK(tep.evaluate("argcount(x, 5, x*2)") == 3);
+    CHECK(tep.evaluate("product(argcount(1, 2), sum(x, 1))") == 6);
+    // needs at least one argument, and the parentheses
+    CHECK(std::isnan(tep.evaluate("argcount()")));
+    CHECK_FALSE(tep.success());
+    CHECK(std::isnan(tep.evaluate("argcount")));
+    CHECK_FALSE(tep.success());
+    CHECK(std::isnan(tep.evaluate("product(2, 3")));
+    CHECK_FALSE(tep.success());
+
+    const std::vector<te_type> xs{ 1, 2, 3 };
+    std::vector<te_type> results(xs.size());
+    tep.compile("product(x, x, 2)");
+    CHECK(tep.evaluate_batch({ {"x", xs} }, results));
+    CHECK(results == std::vector<te_type>{ 2, 8, 18 });
+    }
+
 TEST_CASE("Random", "[random]")
     {
     te_parser tep;
@@ -4062,6 +4136,42 @@ COMBIN(15,
             R"(21 / /* division */ 7 // division)"));
         CHECK(3 == tep.evaluate());
         }
+
+    SECTION("Error positions")
+        {
+        // positions are in the expression without its comments
+        CHECK_FALSE(tep.compile("=/*first*/5 + /*second*/ 2 + )"));
+        CHECK(tep.get_expression() == "5 +  2 + )");
+        CHECK(tep.get_last_error_position() == 9);
+        CHECK(tep.get_expression()[tep.get_last_error_position()] == ')');
+        CHECK_FALSE(tep.compile("5 + /*first*/ 2 /*second"));
+        CHECK(tep.get_last_error_position() == 7);
+        CHECK(tep.get_expression() == "5 +  2 /*second");
+        // comments don't separate tokens (the text around them is joined, as it's stored)
+        CHECK(tep.evaluate("1/**/2") == 12);
+        CHECK(tep.get_expression() == "12");
+        CHECK(tep.evaluate("=2 */**/* 3 /* cubed */") == 8);
+        CHECK(tep.get_expression() == "2 ** 3 ");
+        CHECK_FALSE(tep.compile("1/**/2 +/*first*/ 3 + )"));
+        CHECK(tep.get_expression() == "12 + 3 + )");
+        CHECK(tep.get_last_error_position() == 9);
+        }
+
+    SECTION("Long formulas")
+        {
+        std::string formula;
+        std::string expected;
+        for (size_t i = 0; i < 10'000; ++i)
+            {
+            formula += "1 + // line " + std::to_string(i) + "\n";
+            expected += "1 + \n";
+            }
+        formula += "0 /* end */";
+        expected += "0 ";
+        CHECK(tep.compile(formula));
+        CHECK(tep.evaluate() == 10'000);
+        CHECK(tep.get_expression() == expected);
+        }
     }
 
 // Financial functions
@@ -4119,6 +4229,1425 @@ TEST_CASE("DB", "[finance]")
     CHECK(std::isnan(tep.evaluate("DB(1000000,100000,6,8)")));
     }
 
+TEST_CASE("Bytecode", "[bytecode]")
+    {
+    te_type a{ 3 }, b{ 4 }, c{ 5 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"a", &a}, {"b", &b}, {"c", &c} });
+
+    SECTION("Fused instructions")
+        {
+        CHECK(tep.evaluate("a+5") == 8);
+        CHECK(tep.evaluate("5+a") == 8);
+        CHECK(tep.evaluate("a*5") == 15);
+        CHECK(tep.evaluate("5*a") == 15);
+        CHECK(tep.evaluate("a*b+c") == 17);
+        CHECK(tep.evaluate("c+a*b") == 17);
+        CHECK(tep.evaluate("(a+b)+5") == 12);
+        CHECK(tep.evaluate("(a+b)-5") == 2);
+        CHECK(tep.evaluate("(a+b)*5") == 35);
+        CHECK(tep.evaluate("(a+b)+c") == 12);
+        CHECK(tep.evaluate("(a+b)-c") == 2);
+        CHECK(tep.evaluate("(a+b)*c") == 35);
+        CHECK(tep.evaluate("-(a+b)") == -7);
+        CHECK(tep.evaluate("(a+b)/c") == Approx(1.4));
+        }
+
+    SECTION("Reevaluate")
+        {
+        tep.compile("a*b+c*(a-b)");
+        CHECK(tep.evaluate() == 7);
+        a = 10;
+        CHECK(tep.evaluate() == 70);
+        b = 0;
+        CHECK(tep.evaluate() == 50);
+        }
+
+    SECTION("Errors")
+        {
+        tep.compile("a/(b-4)");
+        CHECK(std::isnan(tep.evaluate()));
+        CHECK_FALSE(tep.success());
+        CHECK(tep.get_last_error_message() == "Division by zero.");
+        b = 5;
+        CHECK(tep.evaluate() == 3);
+        }
+
+    SECTION("Deep stack")
+        {
+        std::string expr{ "a" };
+        for (size_t i = 0; i < 200; ++i)
+            {
+            expr = "b+(" + expr + ")*1";
+            }
+        CHECK(tep.evaluate(expr) == 803);
+        expr = "a";
+        for (size_t i = 0; i < 200; ++i)
+            {
+            expr = "sum(a, b, c, " + expr + ")";
+            }
+        CHECK(tep.evaluate(expr) == 2403);
+        }
+
+    SECTION("Node arena")
+        {
+        // a tree spanning many blocks of nodes, which are reused between compiles
+        std::string expr{ "a" };
+        for (size_t i = 0; i < 1000; ++i)
+            {
+            expr += "+b*" + std::to_string(i % 7);
+            }
+        CHECK(tep.evaluate(expr) == 11991);
+        CHECK(tep.evaluate("a+b") == 7);
+        CHECK(tep.evaluate(expr) == 11991);
+        // nodes are released when parsing or constant folding fails
+        CHECK(std::isnan(tep.evaluate(expr + "+b*(1/0)")));
+        CHECK_FALSE(tep.success());
+        CHECK(std::isnan(tep.evaluate(expr + "+")));
+        CHECK_FALSE(tep.success());
+        CHECK(tep.evaluate(expr) == 11991);
+        // arguments of nested and variadic calls are stored apart from their nodes
+        CHECK(tep.evaluate("sum(a, max(b, 1, 2), if(a, -b, 1), (2**-2)**-1)") == 7);
+        CHECK(tep.evaluate("(0-a)**-b") == Approx(1 / 81.0));
+        }
+    }
+
+TEST_CASE("Batch evaluation", "[batch]")
+    {
+    te_type x{ 0 }, y{ 0 }, z{ 10 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"x", &x}, {"y", &y}, {"z", &z} });
+
+    std::vector<te_type> xs(1'000), ys(1'000), results(1'000);
+    for (size_t i = 0; i < xs.size(); ++i)
+        {
+        xs[i] = static_cast<te_type>(i);
+        ys[i] = static_cast<te_type>(i % 7) + 1;
+        }
+
+    SECTION("Matches evaluate")
+        {
+        for (const auto* expr : { "x*y+z", "x+5", "sqrt(x)/y - z", "-x*2", "z*(x-y)", "pow(y, 2) + x%3",
+                                  "sum(x, y, z)", "if(x > 500, x, y)", "clamp(x, 10, 20) * y" })
+            {
+            CHECK(tep.compile(expr));
+            CHECK(tep.evaluate_batch({ {"x", xs}, {"y", ys} }, results));
+            for (size_t i = 0; i < xs.size(); ++i)
+                {
+                x = xs[i];
+                y = ys[i];
+                CHECK_THAT(results[i], Catch::Matchers::WithinRel(WITHIN_TYPE_CAST(tep.evaluate())));
+                }
+            }
+        }
+
+    SECTION("Bound values")
+        {
+        // z has no column, so its bound value is used; x isn't used in the expression
+        tep.compile("y*z");
+        CHECK(tep.evaluate_batch({ {"x", xs}, {"y", ys} }, results));
+        CHECK(results[0] == 10);
+        CHECK(results[6] == 70);
+        CHECK(results[7] == 10);
+        }
+
+    SECTION("Failed rows")
+        {
+        tep.compile("y/(x-3)");
+        CHECK_FALSE(tep.evaluate_batch({ {"x", xs}, {"y", ys} }, results));
+        CHECK(tep.get_last_error_message() == "Division by zero.");
+        CHECK(std::isnan(results[3]));
+        CHECK(results[2] == -3);
+        CHECK(results[4] == 5);
+        CHECK(results[999] == static_cast<te_type>(999 % 7 + 1) / 996);
+        }
+
+    SECTION("Vectorized builtins")
+        {
+        // special values are mixed in with ordinary ones, so that every group of lanes has to
+        // match the scalar functions (NaN, infinities, negatives, huge arguments, etc.)
+        const std::vector<te_type> specials{ 0.0, -0.0, 1.0, -1.0, 0.5, -2.5, 1e-310, -1e-310, 3.14159265358979,
+                                             100.0, -745.5, 709.5, 1e6, -1e6, static_cast<te_type>(1e300),
+                                             te_parser::te_nan,
+                                             std::numeric_limits<te_type>::infinity(),
+                                             -std::numeric_limits<te_type>::infinity() };
+        std::vector<te_type> vals(997);
+        for (size_t i = 0; i < vals.size(); ++i)
+            {
+            vals[i] = (i % 5 == 0) ? specials[(i / 5) % specials.size()] :
+                static_cast<te_type>(static_cast<double>(i) - 500) / 7;
+            }
+        std::vector<te_type> vals2(vals.rbegin(), vals.rend());
+        std::vector<te_type> vectorized(vals.size());
+        // bit-identical to the scalar functions by default
+        CHECK_FALSE(tep.is_approximate_batch_math_enabled());
+        for (const auto* expr : { "sin(x)", "cos(x)", "exp(x)", "ln(x)", "abs(x)", "sqrt(abs(x))",
+                                  "x = y", "x <> y", "x < y", "x <= y", "x > y", "x >= y" })
+            {
+            CHECK(tep.compile(expr));
+            CHECK(tep.evaluate_batch({ {"x", vals}, {"y", vals2} }, vectorized));
+            for (size_t i = 0; i < vals.size(); ++i)
+                {
+                x = vals[i];
+                y = vals2[i];
+                const auto expected = tep.evaluate();
+                if (std::isnan(expected))
+                    { CHECK(std::isnan(vectorized[i])); }
+                else
+                    { CHECK(vectorized[i] == expected); }
+                }
+            }
+
+        // within 1 ulp when approximations are allowed
+        tep.set_approximate_batch_math_enabled(true);
+        CHECK(tep.is_approximate_batch_math_enabled());
+        for (const auto* expr : { "sin(x)", "cos(x)", "exp(x)", "ln(x)" })
+            {
+            CHECK(tep.compile(expr));
+            CHECK(tep.evaluate_batch({ {"x", vals} }, vectorized));
+            for (size_t i = 0; i < vals.size(); ++i)
+                {
+                x = vals[i];
+                const auto expected = tep.evaluate();
+                if (std::isnan(expected))
+                    { CHECK(std::isnan(vectorized[i])); }
+                else
+                    {
+                    CHECK(vectorized[i] >= std::nextafter(expected, -std::numeric_limits<te_type>::infinity()));
+                    CHECK(vectorized[i] <= std::nextafter(expected, std::numeric_limits<te_type>::infinity()));
+                    }
+                }
+            }
+        tep.set_approximate_batch_math_enabled(false);
+
+        // negatives are an error for sqrt, but NaN (not an error) for ln
+        tep.compile("sqrt(x)");
+        CHECK_FALSE(tep.evaluate_batch({ {"x", vals} }, vectorized));
+        CHECK(tep.get_last_error_message() == "Negative value passed to SQRT.");
+        CHECK(std::isnan(vectorized[1]));
+        CHECK(vectorized[601] == std::sqrt(vals[601]));
+        CHECK(vectorized[996] == std::sqrt(vals[996]));
+        tep.compile("ln(x)");
+        CHECK(tep.evaluate_batch({ {"x", vals} }, vectorized));
+        CHECK(std::isnan(vectorized[1]));
+        }
+
+    SECTION("Bad columns")
+        {
+        tep.compile("x+y");
+        CHECK_THROWS(tep.evaluate_batch({ {"w", xs} }, results));
+        CHECK_THROWS(tep.evaluate_batch({ {"x", std::span<const te_type>(xs).first(10)} }, results));
+        std::vector<te_type> none;
+        CHECK(tep.evaluate_batch({ {"x", xs} }, none));
+        }
+    }
+
+TEST_CASE("Compiled expressions", "[compiled]")
+    {
+    te_type x{ 3 }, y{ 4 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"x", &x}, {"y", &y} });
+
+    SECTION("Outlives the parser's state")
+        {
+        CHECK(tep.compile("sqrt(x**2 + y**2) /* hypotenuse */"));
+        const auto hypotenuse = tep.share_compiled_expression();
+        REQUIRE(hypotenuse != nullptr);
+        CHECK(hypotenuse->get_expression() == "sqrt(x**2 + y**2) ");
+        CHECK(hypotenuse->evaluate() == 5);
+
+        // compiling something else (or failing to) leaves the first one alone
+        CHECK(tep.compile("x*y"));
+        CHECK(tep.share_compiled_expression() != hypotenuse);
+        CHECK_FALSE(tep.compile("x*"));
+        CHECK(tep.share_compiled_expression() == nullptr);
+        x = 6;
+        y = 8;
+        CHECK(hypotenuse->evaluate() == 10);
+        }
+
+    SECTION("Errors")
+        {
+        CHECK(tep.compile("x/(y-4)"));
+        const auto divide = tep.share_compiled_expression();
+        std::string errorMessage{ "previous message" };
+        CHECK(std::isnan(divide->evaluate()));
+        CHECK(std::isnan(divide->evaluate(errorMessage)));
+        CHECK(errorMessage == "Division by zero.");
+        // the parser isn't affected by the compiled expression failing
+        CHECK(tep.success());
+        CHECK(tep.get_last_error_message().empty());
+        y = 5;
+        CHECK(divide->evaluate(errorMessage) == 3);
+        CHECK(errorMessage.empty());
+        }
+
+    SECTION("Frames")
+        {
+        te_type z{ 100 };
+        tep.set_variables_and_functions({ {"x", &x}, {"y", &y}, {"z", &z} });
+        CHECK(tep.compile("y*2 + x - y"));
+        const auto compiled = tep.share_compiled_expression();
+        // slots are dense and only given to the variables that are used
+        CHECK(compiled->get_slot_count() == 2);
+        const auto ySlot = compiled->find_slot("Y");
+        const auto xSlot = compiled->find_slot("x");
+        CHECK(ySlot == 0);
+        CHECK(xSlot == 1);
+        CHECK(compiled->find_slot("z") == -1);
+        CHECK(compiled->find_slot("w") == -1);
+
+        auto frame = compiled->make_frame();
+        CHECK(frame == std::vector<te_type>{ 4, 3 });
+        CHECK(compiled->evaluate(frame) == 7);
+        // each record is independent of the bound variables (and each other)
+        const std::vector<std::array<te_type, 2>> records{ { 1, 2 }, { 10, 20 }, { -5, 5 } };
+        for (const auto& record : records)
+            {
+            CHECK(compiled->evaluate(record) == (record[0] * 2) + record[1] - record[0]);
+            }
+        CHECK(x == 3);
+        CHECK(y == 4);
+
+        std::string errorMessage;
+        CHECK(tep.compile("x/y"));
+        const auto divide = tep.share_compiled_expression();
+        CHECK(std::isnan(divide->evaluate(std::array<te_type, 2>{ 1, 0 }, errorMessage)));
+        CHECK(errorMessage == "Division by zero.");
+        CHECK_THROWS(divide->evaluate(std::array<te_type, 1>{ 1 }));
+        }
+
+    SECTION("Concurrent evaluation")
+        {
+        CHECK(tep.compile("x*y + 1/y"));
+        const auto compiled = tep.share_compiled_expression();
+
+        constexpr size_t threadCount{ 8 };
+        std::vector<std::vector<te_type>> results(threadCount);
+        std::vector<char> failed(threadCount);
+        std::vector<te_type> evaluated(threadCount);
+        std::vector<std::thread> threads;
+        for (size_t thread = 0; thread < threadCount; ++thread)
+            {
+            threads.emplace_back([&, thread]()
+                {
+                // each thread evaluates its own rows (and unused columns are ignored)
+                std::vector<te_type> xs(500, static_cast<te_type>(thread)), ys(500), zs(500);
+                for (size_t i = 0; i < ys.size(); ++i)
+                    { ys[i] = static_cast<te_type>(i); }
+                std::string errorMessage;
+                results[thread].resize(xs.size());
+                failed[thread] = static_cast<char>(
+                    !compiled->evaluate_batch({ {"X", xs}, {"y", ys}, {"z", zs} }, results[thread], errorMessage));
+                evaluated[thread] = compiled->evaluate();
+                });
+            }
+        for (auto& thread : threads)
+            { thread.join(); }
+
+        for (size_t thread = 0; thread < threadCount; ++thread)
+            {
+            // y is 0 in the first row of each batch
+            CHECK(failed[thread]);
+            CHECK(std::isnan(results[thread][0]));
+            CHECK_THAT(results[thread][7], Catch::Matchers::WithinRel(static_cast<double>(thread) * 7 + 1.0 / 7, 1e-6));
+            CHECK_THAT(evaluated[thread], Catch::Matchers::WithinRel(12 + 1.0 / 4, 1e-6));
+            }
+        }
+    }
+
+TEST_CASE("Compile cache", "[cache]")
+    {
+    te_type a{ 1 }, b{ 2 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"a", &a}, {"b", &b} });
+
+    SECTION("Disabled by default")
+        {
+        CHECK(tep.get_compile_cache_size() == 0);
+        CHECK(tep.evaluate("a+5") == 6);
+        CHECK(tep.evaluate("a+5") == 6);
+        CHECK(tep.get_compile_cache_hits() == 0);
+        CHECK(tep.get_compile_cache_misses() == 0);
+        }
+
+    SECTION("Hits")
+        {
+        tep.set_compile_cache_size(2);
+        CHECK(tep.evaluate("=a+5 // add five") == 6);
+        a = 10;
+        CHECK(tep.evaluate("=a+5 // add five") == 15);
+        CHECK(tep.get_compile_cache_hits() == 1);
+        CHECK(tep.get_compile_cache_misses() == 1);
+        // the parser's state is the same as after compiling
+        CHECK(tep.success());
+        CHECK(tep.get_expression() == "a+5 ");
+        CHECK(tep.get_result() == 15);
+        CHECK(tep.get_last_error_position() == te_parser::npos);
+#ifndef TE_NO_BOOKKEEPING
+        CHECK(tep.is_variable_used("a"));
+        CHECK_FALSE(tep.is_variable_used("b"));
+#endif
+        // errors are still reported
+        CHECK(tep.evaluate("a/(b-2)") != tep.evaluate("a/(b-2)"));
+        CHECK(tep.get_last_error_message() == "Division by zero.");
+        CHECK(tep.get_compile_cache_hits() == 2);
+        // failures aren't cached
+        CHECK(std::isnan(tep.evaluate("a+")));
+        CHECK(std::isnan(tep.evaluate("a+")));
+        CHECK(tep.get_compile_cache_misses() == 4);
+        }
+
+    SECTION("Least recently used is removed")
+        {
+        tep.set_compile_cache_size(2);
+        CHECK(tep.evaluate("a+1") == 2);
+        CHECK(tep.evaluate("a+2") == 3);
+        CHECK(tep.evaluate("a+1") == 2);
+        CHECK(tep.evaluate("a+3") == 4);
+        CHECK(tep.get_compile_cache_hits() == 1);
+        // a+2 was removed, a+1 was not
+        CHECK(tep.evaluate("a+1") == 2);
+        CHECK(tep.get_compile_cache_hits() == 2);
+        CHECK(tep.evaluate("a+2") == 3);
+        CHECK(tep.get_compile_cache_hits() == 2);
+        tep.set_compile_cache_size(1);
+        CHECK(tep.evaluate("a+1") == 2);
+        CHECK(tep.get_compile_cache_hits() == 2);
+        }
+
+    SECTION("Symbol changes")
+        {
+        tep.set_compile_cache_size(10);
+        tep.set_constant("c", 3);
+        CHECK(tep.evaluate("a*c") == 3);
+        tep.set_constant("c", 4);
+        CHECK(tep.evaluate("a*c") == 4);
+        tep.remove_variable_or_function("c");
+        tep.add_variable_or_function({ "c", &b });
+        CHECK(tep.evaluate("a*c") == 2);
+        tep.set_list_separator(';');
+        CHECK(tep.evaluate("max(a;c)") == 2);
+        CHECK(tep.evaluate("max(a;c)") == 2);
+        CHECK(tep.get_compile_cache_hits() == 1);
+        tep.set_list_separator(',');
+        CHECK(std::isnan(tep.evaluate("max(a;c)")));
+        CHECK(tep.get_compile_cache_hits() == 1);
+        }
+
+    SECTION("Unknown symbols")
+        {
+        tep.set_compile_cache_size(10);
+        int resolveCount{ 0 };
+        tep.set_unknown_symbol_resolver([&resolveCount](std::string_view)
+            {
+            ++resolveCount;
+            return static_cast<te_type>(resolveCount);
+            }, false);
+        // volatile resolved variables aren't cached
+        CHECK(tep.evaluate("a+z") == 2);
+        CHECK(tep.evaluate("a+z") == 3);
+        CHECK(tep.get_compile_cache_hits() == 0);
+        tep.set_unknown_symbol_resolver([&resolveCount](std::string_view)
+            {
+            ++resolveCount;
+            return static_cast<te_type>(resolveCount);
+            });
+        CHECK(tep.evaluate("a+z") == 4);
+        CHECK(tep.evaluate("a+z") == 4);
+        CHECK(tep.get_compile_cache_hits() == 1);
+        }
+    }
+
+static int lazyCalls{ 0 };
+
+te_type counted(te_type val)
+    {
+    ++lazyCalls;
+    return val;
+    }
+
+TEST_CASE("Short-circuit evaluation", "[lazy]")
+    {
+    te_type a{ 1 }, b{ 0 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"a", &a}, {"b", &b}, {"counted", counted} });
+
+    const auto callsFor = [&tep](const std::string& expr, const te_type expected)
+        {
+        lazyCalls = 0;
+        CHECK(tep.evaluate(expr) == expected);
+        return lazyCalls;
+        };
+
+    SECTION("Untaken branches are skipped")
+        {
+        CHECK(callsFor("if(a, counted(5), counted(6))", 5) == 1);
+        CHECK(callsFor("if(b, counted(5), counted(6))", 6) == 1);
+        CHECK(callsFor("ifs(b, counted(1), a, counted(2), a, counted(3))", 2) == 1);
+        CHECK(callsFor("a && counted(2)", 1) == 1);
+        CHECK(callsFor("b && counted(2)", 0) == 0);
+        CHECK(callsFor("a || counted(2)", 1) == 0);
+        CHECK(callsFor("b || counted(2)", 1) == 1);
+        CHECK(callsFor("and(a, counted(b), counted(a))", 0) == 1);
+        CHECK(callsFor("or(b, counted(a), counted(a))", 1) == 1);
+        CHECK(callsFor("and(a, counted(a), counted(a))", 1) == 2);
+        CHECK(callsFor("or(b, counted(b), counted(b))", 0) == 2);
+        // untaken branches don't raise errors either
+        CHECK(tep.evaluate("if(a, 5, a/b)") == 5);
+        CHECK(tep.success());
+        CHECK(std::isnan(tep.evaluate("if(b, 5, a/b)")));
+        CHECK_FALSE(tep.success());
+        // (nor do constant ones, which aren't folded when they might not be evaluated)
+        for (const bool hoistLiterals : { false, true })
+            {
+            tep.set_literal_hoisting_enabled(hoistLiterals);
+            CHECK(tep.compile("if(a, 2, 1/0)"));
+            CHECK(tep.evaluate() == 2);
+            CHECK(tep.evaluate("a || 1/0") == 1);
+            CHECK(tep.evaluate("ifs(b, 1%0, a, 3, 1, 1/0)") == 3);
+            CHECK(tep.evaluate("if(a, 2, if(1, 1/0, 4))") == 2);
+            CHECK(tep.success());
+            CHECK(std::isnan(tep.evaluate("if(b, 2, 1/0)")));
+            CHECK(tep.get_last_error_message() == "Division by zero.");
+            }
+        // (constant errors that are always evaluated still fail to compile)
+        tep.set_literal_hoisting_enabled(false);
+        CHECK_FALSE(tep.compile("1/0 + if(a, 2, 3)"));
+        CHECK_FALSE(tep.compile("if(1/0, a, 2)"));
+        }
+
+    SECTION("Same results as eager evaluation")
+        {
+        // expressions with only constants are folded when compiled (i.e., evaluated eagerly)
+        const std::vector<std::pair<std::string, te_type>> values{
+            { "0", 0 }, { "1", 1 }, { "-2", -2 }, { "nan", std::numeric_limits<te_type>::quiet_NaN() }
+            };
+        const std::vector<std::string> formulas{
+            "a && b", "a || b", "if(a, 5, b)", "ifs(a, 2, b, 3)", "ifs(a, 2, b)", "and(a)",
+            "or(b)", "and(a, b, a)", "or(a, b, a)", "and(b, a, 1)", "or(b, a, 0)" };
+        const auto sameValue = [](const te_type lhs, const te_type rhs)
+            { return (std::isnan(lhs) && std::isnan(rhs)) || lhs == rhs; };
+        for (const auto& [aText, aValue] : values)
+            {
+            for (const auto& [bText, bValue] : values)
+                {
+                a = aValue;
+                b = bValue;
+                for (const auto& formula : formulas)
+                    {
+                    std::string constantFormula{ formula };
+                    constantFormula = std::regex_replace(constantFormula, std::regex{ "\\ba\\b" }, aText);
+                    constantFormula = std::regex_replace(constantFormula, std::regex{ "\\bb\\b" }, bText);
+                    INFO(formula << " with a=" << aText << ", b=" << bText);
+                    CHECK(sameValue(tep.evaluate(formula), tep.evaluate(constantFormula)));
+                    }
+                }
+            }
+        }
+
+    SECTION("Batch")
+        {
+        const std::vector<te_type> aValues{ 1, 0, 1, 0 };
+        const std::vector<te_type> bValues{ 0, 0, 2, 3 };
+        std::vector<te_type> results(aValues.size());
+        tep.compile("if(a, counted(b), a/b)");
+        lazyCalls = 0;
+        CHECK_FALSE(tep.evaluate_batch({ {"a", aValues}, {"b", bValues} }, results));
+        CHECK(lazyCalls == 2);
+        CHECK(results[0] == 0);
+        CHECK(std::isnan(results[1]));
+        CHECK(results[2] == 2);
+        CHECK(results[3] == 0);
+        CHECK(tep.get_last_error_message() == "Division by zero.");
+        }
+    }
+
+TEST_CASE("Symbol lookup", "[lookup]")
+    {
+    te_type price{ 10 }, priceLimit{ 12 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"Price", &price}, {"Price_Limit", &priceLimit} });
+
+    // names are looked up as views of the formula, case insensitively
+    CHECK(tep.evaluate("PRICE+price_limit*SQRT(4)") == 34);
+#ifndef TE_NO_BOOKKEEPING
+    CHECK(tep.is_variable_used("price"));
+    CHECK(tep.is_variable_used("PRICE_LIMIT"));
+    CHECK(tep.is_function_used("Sqrt"));
+    CHECK_FALSE(tep.is_variable_used("Price_Lim"));
+#endif
+
+    const std::string_view text{ "price_limit and more" };
+    const auto& vars = tep.get_variables_and_functions();
+    CHECK(vars.find(text.substr(0, 5)) != vars.cend());
+    CHECK(vars.find(text.substr(0, 11))->m_name == "Price_Limit");
+    CHECK(vars.find(text.substr(0, 9)) == vars.cend());
+
+    tep.remove_variable_or_function(text.substr(0, 11));
+    CHECK(std::isnan(tep.evaluate("price_limit")));
+    CHECK_FALSE(tep.success());
+    CHECK(tep.evaluate("price") == 10);
+    }
+
+TEST_CASE("Builtin lookup", "[lookup]")
+    {
+    te_parser tep;
+    CHECK(tep.evaluate("SQRT(4) + Abs(-1) + pI * 0") == 3);
+#ifndef TE_NO_BOOKKEEPING
+    CHECK(tep.is_function_used("sqrt"));
+#endif
+#ifndef TE_FLOAT
+    CHECK(tep.evaluate("BitNot8(0)") == 255);
+#endif
+    // names close to builtins (or their prefixes) are not builtins
+    for (const auto& name : { "sqr2(4)", "sqrtt(4)", "ab(1)", "pi2", "truncate(1)", "e_" })
+        {
+        CHECK(std::isnan(tep.evaluate(name)));
+        CHECK_FALSE(tep.success());
+        }
+    // custom variables take precedence over builtins
+    te_type pi{ 3 };
+    tep.set_variables_and_functions({ {"pi", &pi} });
+    CHECK(tep.evaluate("PI") == 3);
+
+    // the builtins are listed in (case-insensitive) order
+    const auto report = tep.list_available_functions_and_variables();
+    CHECK(report.find("Built-in Functions:\nabs\nacos\nand\nasin\n") == 0);
+    CHECK(report.find("\ntrue\ntrunc\n") != std::string::npos);
+    }
+
+TEST_CASE("Symbol index", "[lookup]")
+    {
+    std::vector<te_type> prices(10'000);
+    std::vector<te_variable> vars;
+    for (size_t i = 0; i < prices.size(); ++i)
+        {
+        prices[i] = static_cast<te_type>(i);
+        vars.push_back({ "Sym" + std::to_string(i), &prices[i] });
+        }
+    // names already in use are ignored
+    vars.push_back({ "SYM5", static_cast<te_type>(-1) });
+
+    te_parser tep;
+    tep.set_symbol_index_enabled(true);
+    CHECK(tep.is_symbol_index_enabled());
+    tep.add_variables_and_functions(vars);
+    CHECK(tep.get_variables_and_functions().size() == prices.size());
+    CHECK(tep.evaluate("sym5 + SYM9999 * Sym10") == 99'995);
+
+    SECTION("Adding and removing")
+        {
+        tep.add_variable_or_function({ "Extra", static_cast<te_type>(7) });
+        CHECK(tep.evaluate("extra + sym1") == 8);
+        tep.set_constant("EXTRA", 3);
+        CHECK(tep.evaluate("extra + sym1") == 4);
+        CHECK(tep.get_constant("Extra") == 3);
+        // removing an entry must not hide the ones that collided with it
+        for (size_t i = 0; i < prices.size(); i += 2)
+            {
+            tep.remove_variable_or_function("sym" + std::to_string(i));
+            }
+        CHECK(std::isnan(tep.evaluate("sym2")));
+        CHECK_FALSE(tep.success());
+        for (size_t i = 1; i < prices.size(); i += 2)
+            {
+            CHECK(tep.evaluate("sym" + std::to_string(i)) == prices[i]);
+            }
+        }
+
+    SECTION("Editing the list directly")
+        {
+        tep.get_variables_and_functions().insert({ "Direct", static_cast<te_type>(2) });
+        CHECK(tep.evaluate("direct * sym3") == 6);
+        te_parser copy{ tep };
+        CHECK(copy.is_symbol_index_enabled());
+        CHECK(copy.evaluate("direct * sym4") == 8);
+        }
+
+    SECTION("Unknown symbols")
+        {
+        tep.set_unknown_symbol_resolver([](std::string_view) { return 1.5; });
+        CHECK(tep.evaluate("sym2 + unknown") == 3.5);
+        CHECK(tep.get_variables_and_functions().size() == prices.size() + 1);
+        CHECK(tep.evaluate("UNKNOWN * 2") == 3);
+        }
+
+    SECTION("Disabled")
+        {
+        tep.set_symbol_index_enabled(false);
+        CHECK(tep.evaluate("sym5 + SYM9999 * Sym10") == 99'995);
+        tep.remove_variable_or_function("sym5");
+        tep.set_symbol_index_enabled(true);
+        CHECK(std::isnan(tep.evaluate("sym5")));
+        CHECK(tep.evaluate("sym6") == 6);
+        }
+    }
+
+TEST_CASE("Common subexpressions", "[cse]")
+    {
+    te_type a{ 2 }, b{ 0 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"a", &a}, {"b", &b}, {"counted", counted},
+                                      {"pcounted", counted, TE_PURE} });
+
+    const auto callsFor = [&tep](const std::string& expr, const te_type expected)
+        {
+        tep.compile(expr);
+        lazyCalls = 0;
+        CHECK(tep.evaluate() == Approx(expected));
+        return lazyCalls;
+        };
+
+    SECTION("Pure functions")
+        {
+        CHECK(callsFor("pcounted(a)*3 + pcounted(a)/2", 7) == 1);
+        CHECK(callsFor("pcounted(a+1) * pcounted(a+1) - pcounted(a)", 7) == 2);
+        CHECK(callsFor("sqrt(pcounted(a)**1.5+pcounted(a)**2.5) / (pcounted(a)**1.5+1)",
+                       std::sqrt(std::pow(2, 1.5) + std::pow(2, 2.5)) / (std::pow(2, 1.5) + 1)) == 1);
+        // shared multiplications aren't fused into the additions that use them
+        CHECK(callsFor("pcounted(a)*a + 1 + pcounted(a)*a", 9) == 1);
+        // functions that aren't pure are always called
+        CHECK(callsFor("counted(a) + counted(a)", 4) == 2);
+        }
+
+    SECTION("Branches")
+        {
+        // a value computed in a branch that may be skipped is computed again afterwards
+        CHECK(callsFor("if(b, pcounted(a), 1) + pcounted(a)", 3) == 1);
+        b = 1;
+        CHECK(callsFor("if(b, pcounted(a), 1) + pcounted(a)", 4) == 2);
+        CHECK(callsFor("pcounted(a) + if(b, pcounted(a), 1)", 4) == 1);
+        CHECK(callsFor("(b || pcounted(a)) + and(b, pcounted(a), pcounted(a))", 2) == 1);
+        }
+
+    SECTION("Signed zeros")
+        {
+        a = -1;
+        // 0 and -0 are not the same argument
+        CHECK(tep.evaluate("atan2(0, a) + atan2(-0, a)") == Approx(0).margin(1e-12));
+        }
+
+    SECTION("Batch")
+        {
+        const std::vector<te_type> aValues{ 1, 2, 3, 4 };
+        std::vector<te_type> results(aValues.size());
+        tep.compile("pcounted(a)*pcounted(a) + pcounted(a)");
+        lazyCalls = 0;
+        CHECK(tep.evaluate_batch({ {"a", aValues} }, results));
+        CHECK(lazyCalls == 4);
+        CHECK(results == std::vector<te_type>{ 2, 6, 12, 20 });
+        }
+    }
+
+TEST_CASE("Compiled formulas", "[formulas]")
+    {
+    te_type a{ 2 }, b{ 3 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"a", &a}, {"b", &b}, {"pcounted", counted, TE_PURE} });
+
+    SECTION("Shared subexpressions")
+        {
+        const std::vector<std::string> formulas{ "pcounted(a)*b", "=pcounted(a) + 1 /* comment */",
+                                                 "sqrt(pcounted(a)*b)", "b - a" };
+        const auto compiled = tep.compile_formulas(formulas);
+        REQUIRE(compiled != nullptr);
+        CHECK(tep.success());
+        CHECK(compiled->get_formula_count() == 4);
+        CHECK(compiled->get_expression(1) == "pcounted(a) + 1 ");
+#ifndef TE_NO_BOOKKEEPING
+        CHECK(tep.is_variable_used("b"));
+#endif
+        CHECK(tep.share_compiled_expression() == nullptr);
+
+        std::vector<te_type> results(formulas.size());
+        std::string errorMessage;
+        lazyCalls = 0;
+        CHECK(compiled->evaluate(results, errorMessage));
+        // the call is shared by all of the formulas
+        CHECK(lazyCalls == 1);
+        CHECK(errorMessage.empty());
+        CHECK(results == std::vector<te_type>{ 6, 3, std::sqrt(te_type{ 6 }), 1 });
+
+        // evaluating with a frame
+        CHECK(compiled->get_slot_count() == 2);
+        auto frame = compiled->make_frame();
+        frame[static_cast<size_t>(compiled->find_slot("A"))] = 4;
+        CHECK(compiled->find_slot("c") == -1);
+        CHECK(compiled->evaluate(frame, results, errorMessage));
+        CHECK(results == std::vector<te_type>{ 12, 5, std::sqrt(te_type{ 12 }), -1 });
+        // the variables themselves weren't changed
+        CHECK(a == 2);
+
+        std::vector<te_type> tooFewResults(3);
+        CHECK_THROWS(compiled->evaluate(tooFewResults, errorMessage));
+        }
+
+    SECTION("Failed formulas")
+        {
+        const auto compiled = tep.compile_formulas(std::vector<std::string>{ "a/(b-3)", "a+b", "-a" });
+        REQUIRE(compiled != nullptr);
+        std::vector<te_type> results(3);
+        std::string errorMessage;
+        // only the formula that failed is NaN
+        CHECK_FALSE(compiled->evaluate(results, errorMessage));
+        CHECK(errorMessage == "Division by zero.");
+        CHECK(std::isnan(results[0]));
+        CHECK(results[1] == 5);
+        CHECK(results[2] == -2);
+        }
+
+    SECTION("Syntax errors")
+        {
+        CHECK(tep.compile_formulas(std::vector<std::string>{ "a+b", "(a+", "b" }) == nullptr);
+        CHECK_FALSE(tep.success());
+        CHECK(tep.get_last_error_message() == "Formula 1 failed to compile.");
+        CHECK(tep.get_last_error_position() == 2);
+        CHECK(tep.compile_formulas(std::vector<std::string>{ "a", "" }) == nullptr);
+        CHECK(tep.get_last_error_position() == 0);
+        CHECK(tep.compile_formulas(std::vector<std::string>{ "a /* b" }) == nullptr);
+        CHECK(tep.get_last_error_position() == 2);
+        // no formulas at all is fine
+        const auto compiled = tep.compile_formulas(std::vector<std::string>{});
+        REQUIRE(compiled != nullptr);
+        std::vector<te_type> results;
+        std::string errorMessage;
+        CHECK(compiled->evaluate(results, errorMessage));
+        }
+    }
+
+TEST_CASE("Subtree caching", "[caching]")
+    {
+    te_type a{ 2 }, b{ 3 }, c{ 4 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"a", &a}, {"b", &b}, {"c", &c},
+                                      {"pcounted", counted, TE_PURE}, {"counted", counted} });
+    CHECK_FALSE(tep.is_subtree_caching_enabled());
+    tep.set_subtree_caching_enabled(true);
+    CHECK(tep.is_subtree_caching_enabled());
+    const te_parser copied{ tep };
+    CHECK(copied.is_subtree_caching_enabled());
+
+    const auto callsFor = [&tep](const te_type expected)
+        {
+        lazyCalls = 0;
+        CHECK(tep.evaluate() == expected);
+        return lazyCalls;
+        };
+
+    SECTION("Only changed subtrees are re-evaluated")
+        {
+        CHECK(tep.compile("pcounted(a*b) + pcounted(c) * pcounted(a+c)"));
+        CHECK(callsFor(6 + 4 * 6) == 3);
+        // nothing changed
+        CHECK(callsFor(30) == 0);
+        c = 5;
+        tep.mark_variables_changed({ "c" });
+        CHECK(callsFor(6 + 5 * 7) == 2);
+        b = 1;
+        tep.mark_variables_changed({ "B", "notAVariable" });
+        CHECK(callsFor(2 + 5 * 7) == 1);
+        a = 1;
+        tep.mark_variables_changed({ "a" });
+        CHECK(callsFor(1 + 5 * 6) == 2);
+        // changes that aren't declared aren't seen...
+        a = 2;
+        CHECK(callsFor(31) == 0);
+        // ...until the cache is cleared
+        tep.clear_subtree_cache();
+        CHECK(callsFor(2 + 5 * 7) == 3);
+        }
+
+    SECTION("Functions that aren't pure are always called")
+        {
+        CHECK(tep.compile("counted(a) + pcounted(b*c)"));
+        CHECK(callsFor(2 + 12) == 2);
+        CHECK(callsFor(14) == 1);
+        }
+
+    SECTION("Branches and shared subexpressions")
+        {
+        CHECK(tep.compile("if(a > 1, pcounted(b*c), 0) + pcounted(b*c) + pcounted(a)"));
+        // (the call in the branch is cached separately, since the branch may be skipped)
+        CHECK(callsFor(12 + 12 + 2) == 3);
+        a = 0;
+        tep.mark_variables_changed({ "a" });
+        CHECK(callsFor(12 + 0) == 1);
+        b = 2;
+        tep.mark_variables_changed({ "b" });
+        CHECK(callsFor(8) == 1);
+        }
+
+    SECTION("Errors and recompiling")
+        {
+        CHECK(tep.compile("pcounted(a/(b-3)) + c"));
+        CHECK(std::isnan(tep.evaluate()));
+        b = 4;
+        tep.mark_variables_changed({ "b" });
+        CHECK(callsFor(2 + 4) == 1);
+        // a new expression starts with empty caches
+        CHECK(tep.compile("pcounted(a/(b-3)) + c*2"));
+        CHECK(callsFor(2 + 8) == 1);
+        // batches ignore the caches
+        std::vector<te_type> results(2);
+        CHECK(tep.evaluate_batch({ {"c", std::vector<te_type>{ 1, 2 }} }, results));
+        CHECK(results == std::vector<te_type>{ 4, 6 });
+        tep.set_subtree_caching_enabled(false);
+        CHECK(callsFor(10) == 1);
+        CHECK(callsFor(10) == 1);
+        }
+    }
+
+te_type nonNegative(te_type val)
+    {
+    if (val < 0)
+        {
+        throw std::runtime_error("Negative value.");
+        }
+    return val;
+    }
+
+TEST_CASE("Constant patching", "[constants]")
+    {
+    te_type x{ 3 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"x", &x}, {"k", te_type{ 2 }}, {"j", te_type{ 2 }},
+                                      {"pcounted", counted, TE_PURE} });
+
+    SECTION("Read and folded constants")
+        {
+        CHECK(tep.compile("x*(k*2) + (x-k) + k + sqrt(k*8)"));
+        CHECK(tep.evaluate() == Approx(12 + 1 + 2 + 4));
+        tep.set_constant("K", 8);
+        CHECK(tep.evaluate() == Approx(48 - 5 + 8 + 8));
+        tep.set_constant("k", 0.5);
+        CHECK(tep.evaluate() == Approx(3 + 2.5 + 0.5 + 2));
+        // the expression keeps working with its variables
+        x = 1;
+        CHECK(tep.evaluate() == Approx(1 + 0.5 + 0.5 + 2));
+        }
+
+    SECTION("Constants with the same value stay separate")
+        {
+        CHECK(tep.compile("pcounted(x*k) + pcounted(x*j) + pcounted(x*2)"));
+        CHECK(tep.evaluate() == 18);
+        tep.set_constant("j", 10);
+        CHECK(tep.evaluate() == 6 + 30 + 6);
+        tep.set_constant("k", 10);
+        CHECK(tep.evaluate() == 30 + 30 + 6);
+        }
+
+    SECTION("Shared compiled expressions are left alone")
+        {
+        CHECK(tep.compile("x*k"));
+        const auto before = tep.share_compiled_expression();
+        tep.set_constant("k", 5);
+        CHECK(tep.evaluate() == 15);
+        CHECK(before->evaluate() == 6);
+        CHECK(tep.share_compiled_expression() != before);
+        }
+
+    SECTION("Errors while folding")
+        {
+        tep.set_variables_and_functions({ {"x", &x}, {"k", te_type{ 2 }}, {"checked", nonNegative, TE_PURE} });
+        CHECK(tep.compile("x + checked(k)"));
+        CHECK(tep.evaluate() == 5);
+        // (can't be folded, so it is compiled again, which also fails)
+        tep.set_constant("k", -1);
+        CHECK_FALSE(tep.success());
+        tep.set_constant("k", 4);
+        CHECK(tep.success());
+        CHECK(tep.evaluate() == 7);
+        }
+
+    SECTION("Cached subtrees")
+        {
+        tep.set_subtree_caching_enabled(true);
+        CHECK(tep.compile("pcounted(x*k) + 1"));
+        lazyCalls = 0;
+        CHECK(tep.evaluate() == 7);
+        CHECK(tep.evaluate() == 7);
+        CHECK(lazyCalls == 1);
+        // the new value is not read from the cache
+        tep.set_constant("k", 1);
+        CHECK(tep.evaluate() == 4);
+        CHECK(lazyCalls == 2);
+        }
+    }
+
+TEST_CASE("Literal hoisting", "[hoisting]")
+    {
+    te_type a{ 2 }, b{ 3 };
+    te_parser tep;
+    tep.set_variables_and_functions({ {"a", &a}, {"b", &b}, {"k", te_type{ 4 }} });
+    CHECK_FALSE(tep.is_literal_hoisting_enabled());
+    tep.set_literal_hoisting_enabled(true);
+    CHECK(tep.is_literal_hoisting_enabled());
+    const te_parser copied{ tep };
+    CHECK(copied.is_literal_hoisting_enabled());
+
+    SECTION("Expressions with the same shape share a program")
+        {
+        CHECK(tep.compile("a*0.5 + b*12"));
+        CHECK(tep.evaluate() == 1 + 36);
+        const auto first = tep.share_compiled_expression();
+        CHECK(first->get_literals() == std::vector<te_type>{ 0.5, 12 });
+        CHECK(tep.compile("a*1.5 + b*7"));
+        CHECK(tep.evaluate() == 3 + 21);
+        const auto second = tep.share_compiled_expression();
+        CHECK(second->shares_program_with(*first));
+        CHECK(tep.get_literal_template_count() == 1);
+        // each one keeps its own literals
+        CHECK(first->evaluate() == 37);
+        CHECK(second->evaluate() == 24);
+        // (literals are not folded, but are still read correctly)
+        CHECK(tep.evaluate("2*3 + a - 1e1") == -2);
+        CHECK(tep.evaluate("2*5 + a - 4e1") == -28);
+        CHECK(tep.get_literal_template_count() == 2);
+#ifndef TE_NO_BOOKKEEPING
+        // the bookkeeping comes along with the program
+        CHECK(tep.is_variable_used("a"));
+        CHECK_FALSE(tep.is_variable_used("b"));
+#endif
+        }
+
+    SECTION("Different shapes")
+        {
+        CHECK(tep.compile("a*2"));
+        CHECK(tep.compile("a*2 + 1"));
+        CHECK(tep.compile("a * 2"));
+        CHECK(tep.compile("a2*2") == false);
+        CHECK(tep.compile("a+2"));
+        CHECK(tep.evaluate() == 4);
+        CHECK(tep.get_literal_template_count() == 4);
+        tep.clear_literal_templates();
+        CHECK(tep.get_literal_template_count() == 0);
+        }
+
+    SECTION("Frames and batches")
+        {
+        CHECK(tep.compile("a*10 + b"));
+        CHECK(tep.compile("a*100 + b"));
+        const auto compiled = tep.share_compiled_expression();
+        // the literals take the first slots
+        CHECK(compiled->get_slot_count() == 3);
+        CHECK(compiled->find_slot("a") == 1);
+        auto frame = compiled->make_frame();
+        CHECK(frame == std::vector<te_type>{ 100, 2, 3 });
+        frame[1] = 1;
+        CHECK(compiled->evaluate(frame) == 103);
+        std::vector<te_type> results(2);
+        CHECK(tep.evaluate_batch({ {"a", std::vector<te_type>{ 1, 2 }} }, results));
+        CHECK(results == std::vector<te_type>{ 103, 203 });
+        }
+
+    SECTION("Errors and changes")
+        {
+        CHECK_FALSE(tep.compile("a*2 + )"));
+        const auto errorPos = tep.get_last_error_position();
+        CHECK_FALSE(tep.compile("a*3 + )"));
+        CHECK(tep.get_last_error_position() == errorPos);
+        CHECK(tep.get_literal_template_count() == 0);
+        // constants are still folded
+        CHECK(tep.compile("a*k + 1"));
+        CHECK(tep.evaluate() == 9);
+        tep.set_constant("k", 5);
+        CHECK(tep.evaluate() == 11);
+        CHECK(tep.compile("a*k + 2"));
+        CHECK(tep.evaluate() == 12);
+        // turning it off compiles literals as constants again
+        tep.set_literal_hoisting_enabled(false);
+        CHECK(tep.get_literal_template_count() == 0);
+        CHECK(tep.evaluate() == 12);
+        CHECK(tep.share_compiled_expression()->get_literals().empty());
+        }
+    }
+
+TEST_CASE("Number parsing", "[numbers]")
+    {
+    te_parser tep;
+
+    SECTION("Forms")
+        {
+        CHECK(tep.evaluate("1.5e3") == 1500);
+        CHECK(tep.evaluate("1.5E+2") == 150);
+        CHECK(tep.evaluate("2*1e-3") == Approx(0.002));
+        CHECK(tep.evaluate("1.e2") == 100);
+        CHECK(tep.evaluate(".5") == 0.5);
+        CHECK(tep.evaluate("5.") == 5);
+        CHECK(tep.evaluate("00012.50") == 12.5);
+        CHECK(tep.evaluate("0x1.8p3") == 12);
+        CHECK(tep.evaluate("0x.8") == 0.5);
+        }
+
+    SECTION("Out of range")
+        {
+        // (past the range of whichever floating-point type te_type is)
+        const auto maxExponent10 = std::numeric_limits<te_type>::max_exponent10;
+        const auto maxExponent = std::numeric_limits<te_type>::max_exponent;
+        CHECK(std::isinf(tep.evaluate("1e" + std::to_string(maxExponent10 + 2))));
+        CHECK(tep.evaluate("1e-" + std::to_string(maxExponent10 * 2)) == 0);
+        CHECK(tep.evaluate("0x1p-" + std::to_string(maxExponent * 4)) == 0);
+        CHECK(std::isinf(tep.evaluate("1000e" + std::to_string(maxExponent10 - 2))));
+        }
+
+    SECTION("Incomplete")
+        {
+        CHECK(std::isnan(tep.evaluate("1e")));
+        CHECK_FALSE(tep.success());
+        CHECK(std::isnan(tep.evaluate("1e+")));
+        CHECK(std::isnan(tep.evaluate(".")));
+        CHECK(tep.get_last_error_position() == 0);
+        CHECK(std::isnan(tep.evaluate("1 . 5")));
+        CHECK(tep.get_last_error_position() == 2);
+        }
+
+    SECTION("Comma decimal separator")
+        {
+        tep.set_decimal_separator(',');
+        tep.set_list_separator(';');
+        CHECK(tep.evaluate("2,5 + 1") == 3.5);
+        CHECK(tep.evaluate("pow(1,5; 2)") == 2.25);
+        CHECK(tep.evaluate(",25*4") == 1);
+        CHECK(tep.evaluate("1,5e1") == 15);
+        CHECK(tep.evaluate("0x1,8p1") == 3);
+        // a period isn't read as a decimal point
+        CHECK(std::isnan(tep.evaluate("1.5")));
+        }
+    }
+
+TEST_CASE("Deep expressions", "[depth]")
+    {
+    te_parser tep;
+    CHECK(tep.get_max_depth() == te_parser::DEFAULT_MAX_DEPTH);
+
+    SECTION("Long expressions")
+        {
+        te_type x{ 1 };
+        tep.set_variables_and_functions({ { "x", &x } });
+        std::string expression{ "x" };
+        for (size_t i = 1; i < 50'000; ++i)
+            {
+            expression += (i % 2 == 0) ? "+x" : "+1";
+            }
+        CHECK(tep.compile(expression));
+        CHECK(tep.evaluate() == 50'000);
+        x = 2;
+        CHECK(tep.evaluate() == 75'000);
+
+        std::string powers{ "1" };
+        for (size_t i = 0; i < 5'000; ++i)
+            {
+            powers += "**1";
+            }
+        CHECK(tep.evaluate(powers) == 1);
+        }
+
+    SECTION("Deeply nested expressions")
+        {
+        const std::string parens = std::string(5'000, '(') + "1" + std::string(5'000, ')');
+        CHECK(tep.evaluate(parens) == 1);
+        CHECK(tep.success());
+
+        std::string ifs{ "1" };
+        for (size_t i = 0; i < 2'000; ++i)
+            {
+            ifs = "if(1, " + ifs + ", 0)";
+            }
+        CHECK(tep.evaluate(ifs) == 1);
+
+        std::string sines{ "0" };
+        for (size_t i = 0; i < 2'000; ++i)
+            {
+            sines = "sin " + sines;
+            }
+        CHECK(tep.evaluate(sines) == 0);
+        }
+
+    SECTION("Lazy and shared subtrees below the recursion limit")
+        {
+        // the inner levels are lowered without recursing, and the outer ones by recursing
+        te_type x{ 1 };
+        tep.set_variables_and_functions({ { "x", &x } });
+        std::string nested{ "x" };
+        for (size_t i = 0; i < 200; ++i)
+            {
+            nested = "if(x, sin(x)*sin(x) + (" + nested + "), ifs(x < 0, 1, x = 0, 2))";
+            }
+        for (const bool caching : { false, true })
+            {
+            tep.set_subtree_caching_enabled(caching);
+            CHECK(tep.compile(nested));
+            x = 1;
+            CHECK(tep.evaluate() == Approx(200 * std::sin(1.0) * std::sin(1.0) + 1));
+            x = 0;
+            tep.mark_variables_changed({ "x" });
+            CHECK(tep.evaluate() == 2);
+            x = 2;
+            tep.mark_variables_changed({ "x" });
+            CHECK(tep.evaluate() == Approx(200 * std::sin(2.0) * std::sin(2.0) + 2));
+            }
+        tep.set_subtree_caching_enabled(false);
+        }
+
+    SECTION("Calls and untaken branches past the recursion limit")
+        {
+        // the calls are read by recursing, and their deeply nested arguments without
+        const std::string deep = std::string(100, '(') + "2" + std::string(100, ')');
+        CHECK(tep.evaluate("max(1, " + deep + ", 3) + sum(4, " + deep + ")") == 9);
+        CHECK(tep.success());
+
+        // an error deep inside a branch that isn't taken isn't raised while folding
+        te_type x{ 1 };
+        tep.set_variables_and_functions({ { "x", &x } });
+        std::string chain{ "1/0" };
+        for (size_t i = 0; i < 100; ++i)
+            {
+            chain = "1+(" + chain + ")";
+            }
+        CHECK(tep.compile("if(x, 2, " + chain + ")"));
+        CHECK(tep.evaluate() == 2);
+        CHECK_FALSE(tep.compile("x + " + chain));
+        }
+
+    SECTION("Maximum depth")
+        {
+        tep.set_max_depth(100);
+        CHECK(tep.get_max_depth() == 100);
+        CHECK(tep.evaluate(std::string(50, '(') + "1" + std::string(50, ')')) == 1);
+        CHECK(std::isnan(tep.evaluate(std::string(200, '(') + "1" + std::string(200, ')'))));
+        CHECK_FALSE(tep.success());
+        CHECK(tep.get_last_error_message().find("maximum depth") != std::string::npos);
+
+        // a call and its parentheses are one level, whichever kind of function it is
+        const auto nestedCalls = [](const std::string& call, const size_t depth)
+            {
+            std::string expression;
+            for (size_t i = 0; i < depth; ++i)
+                {
+                expression += call + "(";
+                }
+            return expression + "0" + std::string(depth, ')');
+            };
+        CHECK(tep.evaluate(nestedCalls("sin", 100)) == 0);
+        CHECK(tep.evaluate(nestedCalls("sum", 100)) == 0);
+        CHECK(std::isnan(tep.evaluate(nestedCalls("sin", 101))));
+        CHECK(std::isnan(tep.evaluate(nestedCalls("sum", 101))));
+
+        tep.set_max_depth(1'000'000);
+        const std::string parens =
+            std::string(200'000, '(') + "1" + std::string(200'000, ')');
+        CHECK(tep.evaluate(parens) == 1);
+        }
+    }
+
+TEST_CASE("Reassociation", "[reassociation]")
+    {
+    te_type a{ 1 }, b{ 2 }, c{ 3 }, d{ 4 };
+    te_parser tep;
+    tep.set_variables_and_functions({ { "a", &a }, { "b", &b }, { "c", &c }, { "d", &d } });
+    CHECK_FALSE(tep.is_reassociation_enabled());
+
+    SECTION("Same results")
+        {
+        tep.set_reassociation_enabled(true);
+        CHECK(tep.is_reassociation_enabled());
+        CHECK(tep.evaluate("a+b+c+d") == 10);
+        CHECK(tep.evaluate("a*b*c*d*a*b*c") == 144);
+        CHECK(tep.evaluate("a + (b + (c + d)) + a") == 11);
+        CHECK(tep.evaluate("a*b + c*d + a*c + b*d + 1") == 26);
+        CHECK(tep.evaluate("a + b - c + d + a") == 5);
+        CHECK(tep.evaluate("a + b*c*d*a + sin(a+b+c+d+0) + d") == Approx(29 + std::sin(10)));
+
+        std::string sum{ "a" };
+        for (size_t i = 1; i < 10'000; ++i)
+            {
+            sum += (i % 2 == 0) ? "+a" : "+b";
+            }
+        CHECK(tep.compile(sum));
+        CHECK(tep.evaluate() == 15'000);
+        b = 3;
+        CHECK(tep.evaluate() == 20'000);
+        b = 2;
+        }
+
+    SECTION("Grouping")
+        {
+        // terms that cancel out show how the sum was grouped
+        // (1 is less than half the spacing between numbers as large as b, so b+1 rounds to b)
+        a = 1;
+        b = 4 / std::numeric_limits<te_type>::epsilon();
+        c = -b;
+        d = 1;
+        CHECK(tep.evaluate("a+b+c+d") == 1);
+        tep.set_reassociation_enabled(true);
+        // re-compiled with the balanced tree
+        CHECK(tep.evaluate() == 0);
+        CHECK(tep.evaluate("(a+b)+(c+d)") == 0);
+        tep.set_reassociation_enabled(false);
+        CHECK(tep.evaluate() == 0);
+        CHECK(tep.evaluate("a+b+c+d") == 1);
+
+        tep.set_reassociation_enabled(true);
+        const te_parser tepCopy{ tep };
+        CHECK(tepCopy.is_reassociation_enabled());
+        }
+    }
+
+#ifndef TE_NO_BOOKKEEPING
+TEST_CASE("Formula graph", "[graph]")
+    {
+    te_formula_graph graph;
+    graph.set_input("x", 2);
+    graph.set_input("y", 3);
+    CHECK(graph.set_formula("sum", "x + y"));
+    CHECK(graph.set_formula("double", "sum * 2"));
+    CHECK(graph.set_formula("other", "y ** 2"));
+    CHECK(graph.is_dirty());
+    CHECK(graph.recalculate() == 3);
+    CHECK_FALSE(graph.is_dirty());
+    CHECK(graph.get_value("double") == 10);
+    CHECK(graph.get_value("OTHER") == 9);
+    CHECK(graph.get_cell_count() == 5);
+
+    SECTION("Only dirty formulas are re-evaluated")
+        {
+        graph.set_input("x", 5);
+        CHECK(graph.recalculate() == 2);
+        CHECK(graph.get_value("double") == 16);
+        CHECK(graph.recalculate() == 0);
+        // replacing a formula recalculates it and what uses it
+        CHECK(graph.set_formula("sum", "x - y"));
+        CHECK(graph.recalculate() == 2);
+        CHECK(graph.get_value("double") == 4);
+        graph.set_input("x", 6);
+        CHECK(graph.recalculate() == 2);
+        CHECK(graph.get_value("double") == 6);
+        }
+
+    SECTION("Setting long chains stays linear")
+        {
+        // each formula reads the one before it (setting them must not slow down
+        // as the graph grows)
+        constexpr size_t cellCount{ 20'000 };
+        graph.set_input("c0", 1);
+        for (size_t i = 1; i < cellCount; ++i)
+            {
+            CHECK(graph.set_formula("c" + std::to_string(i), "c" + std::to_string(i - 1) + " + 1"));
+            }
+        CHECK(graph.recalculate() == cellCount - 1);
+        CHECK(graph.get_value("c" + std::to_string(cellCount - 1)) == cellCount);
+        graph.set_input("c0", 2);
+        CHECK(graph.recalculate() == cellCount - 1);
+        CHECK(graph.get_value("c" + std::to_string(cellCount - 1)) == cellCount + 1);
+        }
+
+    SECTION("Formulas can be added in any order")
+        {
+        CHECK_FALSE(graph.set_formula("a", "b + 1"));
+        CHECK_FALSE(graph.get_error("a").empty());
+        CHECK(graph.set_formula("b", "double + 1"));
+        CHECK(graph.get_error("a").empty());
+        graph.recalculate();
+        CHECK(graph.get_value("a") == 12);
+        // removing a formula breaks the ones that use it
+        graph.remove("b");
+        graph.recalculate();
+        CHECK(std::isnan(graph.get_value("a")));
+        CHECK(std::isnan(graph.get_value("b")));
+        graph.set_input("b", 1);
+        graph.recalculate();
+        CHECK(graph.get_value("a") == 2);
+        }
+
+    SECTION("Circular references")
+        {
+        CHECK_FALSE(graph.set_formula("sum", "double + 1"));
+        CHECK(graph.get_error("sum") == "Circular reference.");
+        CHECK_FALSE(graph.set_formula("self", "self + 1"));
+        graph.recalculate();
+        CHECK(std::isnan(graph.get_value("double")));
+        CHECK(graph.set_formula("sum", "x"));
+        graph.recalculate();
+        CHECK(graph.get_value("double") == 4);
+        }
+
+    SECTION("Errors")
+        {
+        CHECK_THROWS(graph.set_input("sum", 1));
+        CHECK_FALSE(graph.set_formula("bad", "x +"));
+        CHECK(graph.set_formula("ratio", "x / (y - 3)"));
+        graph.recalculate();
+        CHECK(std::isnan(graph.get_value("ratio")));
+        CHECK(graph.get_error("ratio") == "Division by zero.");
+        CHECK(std::isnan(graph.get_value("missing")));
+        }
+
+    SECTION("Custom functions")
+        {
+        graph.add_variable_or_function({ "twice", static_cast<te_type(*)(te_type)>([](te_type val) { return val * 2; }) });
+        CHECK(graph.set_formula("t", "twice(double)"));
+        graph.recalculate();
+        CHECK(graph.get_value("t") == 20);
+        CHECK_THROWS(graph.set_input("twice", 1));
+        }
+
+    SECTION("Long chains")
+        {
+        graph.set_input("c0", 0);
+        graph.set_input("k", 1);
+        for (int i = 1; i <= 10'000; ++i)
+            {
+            CHECK(graph.set_formula("c" + std::to_string(i), "c" + std::to_string(i - 1) + " + k"));
+            }
+        graph.recalculate();
+        CHECK(graph.get_value("c10000") == 10'000);
+        graph.set_input("c0", 5);
+        CHECK(graph.recalculate() == 10'000);
+        CHECK(graph.get_value("c10000") == 10'005);
+        CHECK(graph.set_formula("c9991", "c9990 + 2"));
+        CHECK(graph.recalculate() == 10);
+        CHECK(graph.get_value("c10000") == 10'006);
+        }
+
+    SECTION("Parallel recalculation")
+        {
+        // a wide level of formulas, a narrow chain, and then another wide level
+        for (int i = 0; i < 2'000; ++i)
+            {
+            CHECK(graph.set_formula("w" + std::to_string(i), "x * " + std::to_string(i)));
+            }
+        CHECK(graph.set_formula("total", "w1999 + w1 + double"));
+        CHECK(graph.set_formula("total2", "total * 2"));
+        for (int i = 0; i < 2'000; ++i)
+            {
+            CHECK(graph.set_formula("v" + std::to_string(i), "total2 + w" + std::to_string(i)));
+            }
+        CHECK(graph.recalculate_parallel(4) == 4'002);
+        CHECK(graph.get_value("total2") == 2 * (3998 + 2 + 10));
+        CHECK(graph.get_value("v10") == 8020 + 20);
+
+        graph.set_input("x", 3);
+        CHECK(graph.recalculate_parallel(4) == 4'004);
+        CHECK(graph.get_value("total2") == 2 * (5997 + 3 + 12));
+        CHECK(graph.get_value("v1999") == 12024 + 5997);
+        // only what depends on y this time
+        graph.set_input("y", 4);
+        CHECK(graph.recalculate_parallel() == 2'005);
+        CHECK(graph.get_value("v0") == 2 * (5997 + 3 + 14));
+        CHECK(graph.recalculate_parallel() == 0);
+
+        // the worker threads are kept between calls (and more are started when needed)
+        graph.set_input("x", 4);
+        CHECK(graph.recalculate_parallel(2) == 4'004);
+        CHECK(graph.get_value("v1999") == 2 * (7996 + 4 + 16) + 7996);
+        graph.set_input("x", 5);
+        CHECK(graph.recalculate_parallel(8) == 4'004);
+        CHECK(graph.get_value("v10") == 2 * (9995 + 5 + 18) + 50);
+        }
+    }
+#endif
+
 TEST_CASE("Benchmarks", "[!benchmark]")
     {
     te_type benchmarkVar{ 9 };
@@ -4127,8 +5656,19 @@ TEST_CASE("Benchmarks", "[!benchmark]")
 
     BENCHMARK("a+5 Compiled")
         { return tep.evaluate("a+5"); };
+    te_parser cachingParser;
+    cachingParser.set_variables_and_functions({ {"a", &benchmarkVar} });
+    cachingParser.set_compile_cache_size(10);
+    BENCHMARK("a+5 Compiled (cached)")
+        { return cachingParser.evaluate("a+5"); };
     BENCHMARK("a+5 Native")
         { return bench_a5(benchmarkVar); };
+    tep.compile("a+5");
+    BENCHMARK("a+5 Precompiled")
+        { return tep.evaluate(); };
+    std::vector<te_type> batchValues(1'000, benchmarkVar), batchResults(1'000);
+    BENCHMARK("a+5 Batch (1000 rows)")
+        { return tep.evaluate_batch({ {"a", batchValues} }, batchResults); };
 
     BENCHMARK("5+a+5 Compiled")
         { return tep.evaluate("5+a+5"); };
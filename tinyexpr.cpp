@@ -1,4 +1,17 @@
 #include "tinyexpr.h"
+#include <array>
+#include <atomic>
+#include <charconv>
+#include <condition_variable>
+#include <mutex>
+#include <thread>
+
+// vectorized builtins for batch evaluation (define TE_NO_SIMD to disable them)
+#if !defined(TE_NO_SIMD) && !defined(TE_FLOAT) && !defined(TE_LONG_DOUBLE) &&                      \
+    (defined(__GNUC__) || defined(__clang__)) && defined(__x86_64__)
+#	define TE_SIMD_KERNELS
+#	include <immintrin.h>
+#endif
 
 // builtin functions
 namespace te_builtins
@@ -462,47 +475,26 @@ static te_type te_modulus(te_type val1, te_type val2)
 }
 
 [[nodiscard]]
-static te_type te_sum(te_type val1, te_type val2, te_type val3, te_type val4, te_type val5,
-                      te_type val6, te_type val7, te_type val8, te_type val9, te_type val10,
-                      te_type val11, te_type val12, te_type val13, te_type val14, te_type val15,
-                      te_type val16, te_type val17, te_type val18, te_type val19, te_type val20,
-                      te_type val21, te_type val22, te_type val23, te_type val24)
+static te_type te_sum(const te_type *values, const size_t count) noexcept
 {
-	const auto getSumMaybeNan = [](const auto val) { return (!std::isfinite(val) ? 0 : val); };
-
-	return getSumMaybeNan(val1) + getSumMaybeNan(val2) + getSumMaybeNan(val3) +
-	       getSumMaybeNan(val4) + getSumMaybeNan(val5) + getSumMaybeNan(val6) +
-	       getSumMaybeNan(val7) + getSumMaybeNan(val8) + getSumMaybeNan(val9) +
-	       getSumMaybeNan(val10) + getSumMaybeNan(val11) + getSumMaybeNan(val12) +
-	       getSumMaybeNan(val13) + getSumMaybeNan(val14) + getSumMaybeNan(val15) +
-	       getSumMaybeNan(val16) + getSumMaybeNan(val17) + getSumMaybeNan(val18) +
-	       getSumMaybeNan(val19) + getSumMaybeNan(val20) + getSumMaybeNan(val21) +
-	       getSumMaybeNan(val22) + getSumMaybeNan(val23) + getSumMaybeNan(val24);
+	// non-finite values (e.g., NaN) are skipped
+	te_type total{0};
+	for (size_t i = 0; i < count; ++i)
+	{
+		if (std::isfinite(values[i]))
+		{
+			total += values[i];
+		}
+	}
+	return total;
 }
 
 [[nodiscard]]
-static te_type te_average(te_type val1, te_type val2, te_type val3, te_type val4, te_type val5,
-                          te_type val6, te_type val7, te_type val8, te_type val9, te_type val10,
-                          te_type val11, te_type val12, te_type val13, te_type val14,
-                          te_type val15, te_type val16, te_type val17, te_type val18,
-                          te_type val19, te_type val20, te_type val21, te_type val22,
-                          te_type val23, te_type val24)
+static te_type te_average(const te_type *values, const size_t count)
 {
-	const auto isValidMaybeNan = [](const auto val) { return (!std::isfinite(val) ? 0 : 1); };
-
-	const auto validN =
-	    isValidMaybeNan(val1) + isValidMaybeNan(val2) + isValidMaybeNan(val3) +
-	    isValidMaybeNan(val4) + isValidMaybeNan(val5) + isValidMaybeNan(val6) +
-	    isValidMaybeNan(val7) + isValidMaybeNan(val8) + isValidMaybeNan(val9) +
-	    isValidMaybeNan(val10) + isValidMaybeNan(val11) + isValidMaybeNan(val12) +
-	    isValidMaybeNan(val13) + isValidMaybeNan(val14) + isValidMaybeNan(val15) +
-	    isValidMaybeNan(val16) + isValidMaybeNan(val17) + isValidMaybeNan(val18) +
-	    isValidMaybeNan(val19) + isValidMaybeNan(val20) + isValidMaybeNan(val21) +
-	    isValidMaybeNan(val22) + isValidMaybeNan(val23) + isValidMaybeNan(val24);
-	const auto total =
-	    te_sum(val1, val2, val3, val4, val5, val6, val7, val8, val9, val10, val11, val12, val13,
-	           val14, val15, val16, val17, val18, val19, val20, val21, val22, val23, val24);
-	return te_divide(total, static_cast<te_type>(validN));
+	const auto validN = std::count_if(values, values + count,
+	                                  [](const auto val) { return std::isfinite(val); });
+	return te_divide(te_sum(values, count), static_cast<te_type>(validN));
 }
 
 // Combinations (without repetition)
@@ -1073,38 +1065,15 @@ static te_type te_max_maybe_nan(te_type val1, te_type val2MaybeNan) noexcept
 }
 
 [[nodiscard]]
-static te_type te_max(te_type val1, te_type val2, te_type val3, te_type val4, te_type val5,
-                      te_type val6, te_type val7, te_type val8, te_type val9, te_type val10,
-                      te_type val11, te_type val12, te_type val13, te_type val14, te_type val15,
-                      te_type val16, te_type val17, te_type val18, te_type val19, te_type val20,
-                      te_type val21, te_type val22, te_type val23, te_type val24) noexcept
+static te_type te_max(const te_type *values, const size_t count) noexcept
 {
-	// assumes that at least val1 is a number, rest can be NaN
-	// NOLINTBEGIN
-	auto maxVal = te_max_maybe_nan(val1, val2);
-	maxVal      = te_max_maybe_nan(maxVal, val3);
-	maxVal      = te_max_maybe_nan(maxVal, val4);
-	maxVal      = te_max_maybe_nan(maxVal, val5);
-	maxVal      = te_max_maybe_nan(maxVal, val6);
-	maxVal      = te_max_maybe_nan(maxVal, val7);
-	maxVal      = te_max_maybe_nan(maxVal, val8);
-	maxVal      = te_max_maybe_nan(maxVal, val9);
-	maxVal      = te_max_maybe_nan(maxVal, val10);
-	maxVal      = te_max_maybe_nan(maxVal, val11);
-	maxVal      = te_max_maybe_nan(maxVal, val12);
-	maxVal      = te_max_maybe_nan(maxVal, val13);
-	maxVal      = te_max_maybe_nan(maxVal, val14);
-	maxVal      = te_max_maybe_nan(maxVal, val15);
-	maxVal      = te_max_maybe_nan(maxVal, val16);
-	maxVal      = te_max_maybe_nan(maxVal, val17);
-	maxVal      = te_max_maybe_nan(maxVal, val18);
-	maxVal      = te_max_maybe_nan(maxVal, val19);
-	maxVal      = te_max_maybe_nan(maxVal, val20);
-	maxVal      = te_max_maybe_nan(maxVal, val21);
-	maxVal      = te_max_maybe_nan(maxVal, val22);
-	maxVal      = te_max_maybe_nan(maxVal, val23);
-	return te_max_maybe_nan(maxVal, val24);
-	// NOLINTEND
+	// assumes that at least the first value is a number, rest can be NaN
+	te_type maxVal{(count > 0) ? values[0] : te_parser::te_nan};
+	for (size_t i = 1; i < count; ++i)
+	{
+		maxVal = te_max_maybe_nan(maxVal, values[i]);
+	}
+	return maxVal;
 }
 
 [[nodiscard]]
@@ -1114,38 +1083,15 @@ static te_type te_min_maybe_nan(te_type val1, te_type val2MaybeNan) noexcept
 }
 
 [[nodiscard]]
-static te_type te_min(te_type val1, te_type val2, te_type val3, te_type val4, te_type val5,
-                      te_type val6, te_type val7, te_type val8, te_type val9, te_type val10,
-                      te_type val11, te_type val12, te_type val13, te_type val14, te_type val15,
-                      te_type val16, te_type val17, te_type val18, te_type val19, te_type val20,
-                      te_type val21, te_type val22, te_type val23, te_type val24) noexcept
+static te_type te_min(const te_type *values, const size_t count) noexcept
 {
-	// assumes that at least val1 is legit, rest can be NaN
-	// NOLINTBEGIN
-	auto minVal = te_min_maybe_nan(val1, val2);
-	minVal      = te_min_maybe_nan(minVal, val3);
-	minVal      = te_min_maybe_nan(minVal, val4);
-	minVal      = te_min_maybe_nan(minVal, val5);
-	minVal      = te_min_maybe_nan(minVal, val6);
-	minVal      = te_min_maybe_nan(minVal, val7);
-	minVal      = te_min_maybe_nan(minVal, val8);
-	minVal      = te_min_maybe_nan(minVal, val9);
-	minVal      = te_min_maybe_nan(minVal, val10);
-	minVal      = te_min_maybe_nan(minVal, val11);
-	minVal      = te_min_maybe_nan(minVal, val12);
-	minVal      = te_min_maybe_nan(minVal, val13);
-	minVal      = te_min_maybe_nan(minVal, val14);
-	minVal      = te_min_maybe_nan(minVal, val15);
-	minVal      = te_min_maybe_nan(minVal, val16);
-	minVal      = te_min_maybe_nan(minVal, val17);
-	minVal      = te_min_maybe_nan(minVal, val18);
-	minVal      = te_min_maybe_nan(minVal, val19);
-	minVal      = te_min_maybe_nan(minVal, val20);
-	minVal      = te_min_maybe_nan(minVal, val21);
-	minVal      = te_min_maybe_nan(minVal, val22);
-	minVal      = te_min_maybe_nan(minVal, val23);
-	return te_min_maybe_nan(minVal, val24);
-	// NOLINTEND
+	// assumes that at least the first value is legit, rest can be NaN
+	te_type minVal{(count > 0) ? values[0] : te_parser::te_nan};
+	for (size_t i = 1; i < count; ++i)
+	{
+		minVal = te_min_maybe_nan(minVal, values[i]);
+	}
+	return minVal;
 }
 
 [[nodiscard]]
@@ -1158,43 +1104,19 @@ static te_type te_and_maybe_nan(te_type val1, te_type val2MaybeNan)
 }
 
 [[nodiscard]]
-static te_type te_and_variadic(te_type val1, te_type val2, te_type val3, te_type val4,
-                               te_type val5, te_type val6, te_type val7, te_type val8,
-                               te_type val9, te_type val10, te_type val11, te_type val12,
-                               te_type val13, te_type val14, te_type val15, te_type val16,
-                               te_type val17, te_type val18, te_type val19, te_type val20,
-                               te_type val21, te_type val22, te_type val23, te_type val24)
+static te_type te_and_variadic(const te_type *values, const size_t count)
 {
-	// at least val1 must be legit, rest can be NaN
-	if (!std::isfinite(val1))
+	// at least the first value must be legit, rest can be NaN
+	if (count == 0 || !std::isfinite(values[0]))
 	{
 		return te_parser::te_nan;
 	}
-	// NOLINTBEGIN
-	auto andVal = te_and_maybe_nan(val1, val2);
-	andVal      = te_and_maybe_nan(andVal, val3);
-	andVal      = te_and_maybe_nan(andVal, val4);
-	andVal      = te_and_maybe_nan(andVal, val5);
-	andVal      = te_and_maybe_nan(andVal, val6);
-	andVal      = te_and_maybe_nan(andVal, val7);
-	andVal      = te_and_maybe_nan(andVal, val8);
-	andVal      = te_and_maybe_nan(andVal, val9);
-	andVal      = te_and_maybe_nan(andVal, val10);
-	andVal      = te_and_maybe_nan(andVal, val11);
-	andVal      = te_and_maybe_nan(andVal, val12);
-	andVal      = te_and_maybe_nan(andVal, val13);
-	andVal      = te_and_maybe_nan(andVal, val14);
-	andVal      = te_and_maybe_nan(andVal, val15);
-	andVal      = te_and_maybe_nan(andVal, val16);
-	andVal      = te_and_maybe_nan(andVal, val17);
-	andVal      = te_and_maybe_nan(andVal, val18);
-	andVal      = te_and_maybe_nan(andVal, val19);
-	andVal      = te_and_maybe_nan(andVal, val20);
-	andVal      = te_and_maybe_nan(andVal, val21);
-	andVal      = te_and_maybe_nan(andVal, val22);
-	andVal      = te_and_maybe_nan(andVal, val23);
-	return te_and_maybe_nan(andVal, val24);
-	// NOLINTEND
+	auto andVal = static_cast<te_type>(te_parser::number_to_bool(values[0]));
+	for (size_t i = 1; i < count; ++i)
+	{
+		andVal = te_and_maybe_nan(andVal, values[i]);
+	}
+	return andVal;
 }
 
 [[nodiscard]]
@@ -1207,43 +1129,19 @@ static te_type te_or_maybe_nan(te_type val1, te_type val2MaybeNan)
 }
 
 [[nodiscard]]
-static te_type te_or_variadic(te_type val1, te_type val2, te_type val3, te_type val4,
-                              te_type val5, te_type val6, te_type val7, te_type val8,
-                              te_type val9, te_type val10, te_type val11, te_type val12,
-                              te_type val13, te_type val14, te_type val15, te_type val16,
-                              te_type val17, te_type val18, te_type val19, te_type val20,
-                              te_type val21, te_type val22, te_type val23, te_type val24)
+static te_type te_or_variadic(const te_type *values, const size_t count)
 {
-	// at least val1 must be legit, rest can be NaN
-	if (!std::isfinite(val1))
+	// at least the first value must be legit, rest can be NaN
+	if (count == 0 || !std::isfinite(values[0]))
 	{
 		return te_parser::te_nan;
 	}
-	// NOLINTBEGIN
-	auto orVal = te_or_maybe_nan(val1, val2);
-	orVal      = te_or_maybe_nan(orVal, val3);
-	orVal      = te_or_maybe_nan(orVal, val4);
-	orVal      = te_or_maybe_nan(orVal, val5);
-	orVal      = te_or_maybe_nan(orVal, val6);
-	orVal      = te_or_maybe_nan(orVal, val7);
-	orVal      = te_or_maybe_nan(orVal, val8);
-	orVal      = te_or_maybe_nan(orVal, val9);
-	orVal      = te_or_maybe_nan(orVal, val10);
-	orVal      = te_or_maybe_nan(orVal, val11);
-	orVal      = te_or_maybe_nan(orVal, val12);
-	orVal      = te_or_maybe_nan(orVal, val13);
-	orVal      = te_or_maybe_nan(orVal, val14);
-	orVal      = te_or_maybe_nan(orVal, val15);
-	orVal      = te_or_maybe_nan(orVal, val16);
-	orVal      = te_or_maybe_nan(orVal, val17);
-	orVal      = te_or_maybe_nan(orVal, val18);
-	orVal      = te_or_maybe_nan(orVal, val19);
-	orVal      = te_or_maybe_nan(orVal, val20);
-	orVal      = te_or_maybe_nan(orVal, val21);
-	orVal      = te_or_maybe_nan(orVal, val22);
-	orVal      = te_or_maybe_nan(orVal, val23);
-	return te_or_maybe_nan(orVal, val24);
-	// NOLINTEND
+	auto orVal = static_cast<te_type>(te_parser::number_to_bool(values[0]));
+	for (size_t i = 1; i < count; ++i)
+	{
+		orVal = te_or_maybe_nan(orVal, values[i]);
+	}
+	return orVal;
 }
 
 [[nodiscard]]
@@ -1253,26 +1151,17 @@ static te_type te_if(te_type val1, te_type val2, te_type val3)
 }
 
 [[nodiscard]]
-static te_type te_ifs(te_type if1, te_type if1True, te_type if2, te_type if2True, te_type if3,
-                      te_type if3True, te_type if4, te_type if4True, te_type if5,
-                      te_type if5True, te_type if6, te_type if6True, te_type if7,
-                      te_type if7True, te_type if8, te_type if8True, te_type if9,
-                      te_type if9True, te_type if10, te_type if10True, te_type if11,
-                      te_type if11True, te_type if12, te_type if12True)
+static te_type te_ifs(const te_type *values, const size_t count) noexcept
 {
-	return te_parser::number_to_bool(if1)  ? if1True :
-	       te_parser::number_to_bool(if2)  ? if2True :
-	       te_parser::number_to_bool(if3)  ? if3True :
-	       te_parser::number_to_bool(if4)  ? if4True :
-	       te_parser::number_to_bool(if5)  ? if5True :
-	       te_parser::number_to_bool(if6)  ? if6True :
-	       te_parser::number_to_bool(if7)  ? if7True :
-	       te_parser::number_to_bool(if8)  ? if8True :
-	       te_parser::number_to_bool(if9)  ? if9True :
-	       te_parser::number_to_bool(if10) ? if10True :
-	       te_parser::number_to_bool(if11) ? if11True :
-	       te_parser::number_to_bool(if12) ? if12True :
-	                                         te_parser::te_nan;
+	// condition and value pairs; the value for the first true condition is returned
+	for (size_t i = 0; i < count; i += 2)
+	{
+		if (te_parser::number_to_bool(values[i]))
+		{
+			return (i + 1 < count) ? values[i + 1] : te_parser::te_nan;
+		}
+	}
+	return te_parser::te_nan;
 }
 
 [[nodiscard]]
@@ -1319,134 +1208,820 @@ constexpr static te_type te_comma([[maybe_unused]] te_type unusedVal,        //
 }
 }        // namespace te_builtins
 
-//--------------------------------------------------
-void te_parser::te_free_parameters(te_expr *texp)
+// vectorized versions of the builtins, used when evaluating batches
+namespace te_simd
+{
+/// @brief The vectorized kernels for the builtins, for a given instruction set.
+/// @details A null kernel means that the builtin is evaluated one value at a time.
+///     The exact kernels return the same results as the scalar builtins; the approximate ones
+///     (for exp, ln, sin, and cos) are within 1 ulp of them and are only used when
+///     te_parser::set_approximate_batch_math_enabled() is turned on.
+struct kernel_table
+{
+	std::string_view                                             m_name{"none"};
+	std::array<std::pair<te_fun1, te_program::unary_kernel>, 2>  m_unaryKernels{};
+	std::array<std::pair<te_fun1, te_program::unary_kernel>, 4>  m_approximateKernels{};
+	std::array<std::pair<te_fun2, te_program::binary_kernel>, 6> m_binaryKernels{};
+};
+
+#ifdef TE_SIMD_KERNELS
+// the generic helpers below are always inlined into the target-specific kernels, and they pass
+// vectors by reference (never by value, or as return values) so that no ABI notes are reported
+#	pragma GCC diagnostic push
+#	pragma GCC diagnostic ignored "-Wpsabi"
+
+// GCC/Clang vector extensions; the kernels are written once against these and
+// compiled for each instruction set by inlining them into target-specific functions
+using v4d = double __attribute__((vector_size(32)));
+using v4i = int64_t __attribute__((vector_size(32)));
+using v8d = double __attribute__((vector_size(64)));
+using v8i = int64_t __attribute__((vector_size(64)));
+
+template <typename V>
+using int_vector = std::conditional_t<sizeof(V) == sizeof(v4d), v4i, v8i>;
+
+template <typename V>
+constexpr size_t lane_count = sizeof(V) / sizeof(double);
+
+constexpr int64_t SIGN_MASK{static_cast<int64_t>(0x8000000000000000ULL)};
+// adding this to a double (< 2^51) rounds it to an integer in the low bits of the mantissa
+constexpr double  ROUNDING_SHIFTER{0x1.8p52};
+constexpr int64_t ROUNDING_SHIFTER_BITS{0x4338000000000000LL};
+// the bits of 1.0
+constexpr int64_t ONE_BITS{0x3FF0000000000000LL};
+
+template <typename V>
+[[gnu::always_inline]]
+inline void load(const te_type *vals, V &result)
+{
+	std::memcpy(&result, vals, sizeof(V));
+}
+
+template <typename V>
+[[gnu::always_inline]]
+inline void store(te_type *vals, const V &result)
+{
+	std::memcpy(vals, &result, sizeof(V));
+}
+
+template <typename IV>
+[[nodiscard, gnu::always_inline]]
+inline bool all_of(const IV &mask)
 {
-	if (texp == nullptr)
+	for (size_t lane = 0; lane < sizeof(IV) / sizeof(int64_t); ++lane)
 	{
-		return;
+		if (mask[lane] == 0)
+		{
+			return false;
+		}
+	}
+	return true;
+}
+
+// replaces the lanes of val where mask is set with those of trueVal
+template <typename V>
+[[gnu::always_inline]]
+inline void blend(V &val, const int_vector<V> &mask, const V &trueVal)
+{
+	using IV = int_vector<V>;
+	val      = (V)(((IV)trueVal & mask) | ((IV)val & ~mask));
+}
+
+// converts (small) integers to doubles without needing AVX-512DQ
+template <typename V>
+[[gnu::always_inline]]
+inline void to_double(const int_vector<V> &vals, V &result)
+{
+	result = (V)(vals + ROUNDING_SHIFTER_BITS) - ROUNDING_SHIFTER;
+}
+
+struct abs_op
+{
+	constexpr static auto scalar = te_builtins::te_absolute_value;
+
+	template <typename V>
+	[[nodiscard, gnu::always_inline]]
+	static bool in_range([[maybe_unused]] const V &val)
+	{
+		return true;
+	}
+
+	template <typename V>
+	[[gnu::always_inline]]
+	static void lanes(const V &val, V &result)
+	{
+		result = (V)((int_vector<V>)val & ~SIGN_MASK);
+	}
+};
+
+// exp() by reducing to exp(r) * 2^k, with |r| <= ln(2)/2, and a Taylor polynomial for exp(r)
+struct exp_op
+{
+	constexpr static auto scalar = te_builtins::te_exp;
+
+	// keeps 2^k normal; overflow, underflow, and NaN are left to the scalar function
+	template <typename V>
+	[[nodiscard, gnu::always_inline]]
+	static bool in_range(const V &val)
+	{
+		return all_of((int_vector<V>)((val >= -708.0) & (val <= 708.0)));
+	}
+
+	template <typename V>
+	[[gnu::always_inline]]
+	static void lanes(const V &val, V &result)
+	{
+		using IV = int_vector<V>;
+		const V shifted = (val * 1.44269504088896338700e+00) + ROUNDING_SHIFTER;
+		const V k       = shifted - ROUNDING_SHIFTER;
+		const V r =
+		    (val - (k * 6.93147180369123816490e-01)) - (k * 1.90821492927058770002e-10);
+
+		V poly = (r * (1.0 / 6227020800.0)) + (1.0 / 479001600.0);
+		poly = (poly * r) + (1.0 / 39916800.0);
+		poly = (poly * r) + (1.0 / 3628800.0);
+		poly = (poly * r) + (1.0 / 362880.0);
+		poly = (poly * r) + (1.0 / 40320.0);
+		poly = (poly * r) + (1.0 / 5040.0);
+		poly = (poly * r) + (1.0 / 720.0);
+		poly = (poly * r) + (1.0 / 120.0);
+		poly = (poly * r) + (1.0 / 24.0);
+		poly = (poly * r) + (1.0 / 6.0);
+		poly = (poly * r) + 0.5;
+		poly = (poly * r) + 1.0;
+		poly = (poly * r) + 1.0;
+
+		// 2^k, built directly from its exponent bits
+		const IV scale = (((IV)shifted) + 1023) << 52;
+		result         = poly * (V)scale;
+	}
+};
+
+// log() by splitting into 2^k * (1+f), with log(1+f) from the fdlibm polynomial
+struct log_op
+{
+	constexpr static auto scalar = te_builtins::te_log;
+
+	// positive, normal numbers; everything else (including negatives) is left to the scalar function
+	template <typename V>
+	[[nodiscard, gnu::always_inline]]
+	static bool in_range(const V &val)
+	{
+		return all_of((int_vector<V>)((val >= DBL_MIN) & (val <= DBL_MAX)));
+	}
+
+	template <typename V>
+	[[gnu::always_inline]]
+	static void lanes(const V &val, V &result)
+	{
+		using IV       = int_vector<V>;
+		const IV bits  = (IV)val;
+		IV exponent    = (bits >> 52) - 1023;
+		V mantissa     = (V)((bits & 0x000FFFFFFFFFFFFFLL) | 0x3FF0000000000000LL);
+		// keep the mantissa in [sqrt(2)/2, sqrt(2))
+		const IV large = (IV)(mantissa > 1.41421356237309514547e+00);
+		blend<V>(mantissa, large, mantissa * 0.5);
+		exponent -= large;
+
+		V k;
+		to_double<V>(exponent, k);
+		const V f    = mantissa - 1.0;
+		const V s    = f / (f + 2.0);
+		const V z    = s * s;
+		const V w    = z * z;
+		const V t1   = w * (3.999999999940941908e-01 +
+		                  w * (2.222219843214978396e-01 + w * 1.531383769920937332e-01));
+		const V t2   = z * (6.666666666666735130e-01 +
+		                  w * (2.857142874366239149e-01 +
+		                       w * (1.818357216161805012e-01 + w * 1.479819860511658591e-01)));
+		const V hfsq = (f * f) * 0.5;
+		result = (k * 6.93147180369123816490e-01) -
+		         ((hfsq - ((s * (hfsq + (t2 + t1))) + (k * 1.90821492927058770002e-10))) - f);
+	}
+};
+
+// sin() and cos() by reducing to [-pi/4, pi/4] and using the fdlibm kernels
+template <bool IsCosine>
+struct sin_cos_op
+{
+	constexpr static auto scalar = IsCosine ? te_builtins::te_cos : te_builtins::te_sin;
+
+	// large arguments need a more expensive reduction, so they are left to the scalar function
+	template <typename V>
+	[[nodiscard, gnu::always_inline]]
+	static bool in_range(const V &val)
+	{
+		return all_of((int_vector<V>)((val >= -0x1p19) & (val <= 0x1p19)));
+	}
+
+	template <typename V>
+	[[gnu::always_inline]]
+	static void lanes(const V &val, V &result)
+	{
+		using IV          = int_vector<V>;
+		const V shifted   = (val * 6.36619772367581382433e-01) + ROUNDING_SHIFTER;
+		const IV quadrant = ((IV)shifted) + (IsCosine ? 1 : 0);
+		const V n         = shifted - ROUNDING_SHIFTER;
+
+		// subtract n*pi/2, with pi/2 split into three parts to avoid cancellation
+		V r = val - (n * 1.57079632673412561417e+00);
+		V t = r;
+		V w = n * 6.07710050630396597660e-11;
+		r   = t - w;
+		w   = (n * 2.02226624879595063154e-21) - ((t - r) - w);
+		t   = r;
+		w   = n * 2.02226624871116645580e-21;
+		r   = t - w;
+		w   = (n * 8.47842766036889956997e-32) - ((t - r) - w);
+		const V y0 = r - w;
+		const V y1 = (r - y0) - w;
+
+		const V z = y0 * y0;
+		const V v = z * y0;
+		const V sinR =
+		    8.33333333332248946124e-03 +
+		    z * (-1.98412698298579493134e-04 +
+		         z * (2.75573137070700676789e-06 +
+		              z * (-2.50507602534068634195e-08 + z * 1.58969099521155010221e-10)));
+		const V sinY = y0 - (((z * ((y1 * 0.5) - (v * sinR))) - y1) -
+		                     (v * -1.66666666666666324348e-01));
+
+		const V cosR =
+		    z * (4.16666666666666019037e-02 +
+		         z * (-1.38888888888741095749e-03 +
+		              z * (2.48015872894767294178e-05 +
+		                   z * (-2.75573143513906633035e-07 +
+		                        z * (2.08757232129817482790e-09 + z * -1.13596475577881948265e-11)))));
+		const V hz   = z * 0.5;
+		const V oneW = 1.0 - hz;
+		const V cosY = oneW + (((1.0 - oneW) - hz) + ((z * cosR) - (y0 * y1)));
+
+		// odd quadrants swap sine and cosine, and the upper two quadrants are negated
+		result = sinY;
+		blend<V>(result, (IV)((quadrant & 1) != 0), cosY);
+		result = (V)((IV)result ^ ((IV)((quadrant & 2) != 0) & SIGN_MASK));
+	}
+};
+
+// the comparison operators, as 1 or 0 (and false for NaNs, except for !=)
+template <te_fun2 Builtin>
+struct compare_op
+{
+	template <typename V>
+	[[gnu::always_inline]]
+	static void lanes(const V &lhs, const V &rhs, V &result)
+	{
+		using IV = int_vector<V>;
+		IV mask{};
+		if constexpr (Builtin == te_builtins::te_equal)
+		{
+			mask = (IV)(lhs == rhs);
+		}
+		else if constexpr (Builtin == te_builtins::te_not_equal)
+		{
+			mask = (IV)(lhs != rhs);
+		}
+		else if constexpr (Builtin == te_builtins::te_less_than)
+		{
+			mask = (IV)(lhs < rhs);
+		}
+		else if constexpr (Builtin == te_builtins::te_less_than_equal_to)
+		{
+			mask = (IV)(lhs <= rhs);
+		}
+		else if constexpr (Builtin == te_builtins::te_greater_than)
+		{
+			mask = (IV)(lhs > rhs);
+		}
+		else
+		{
+			mask = (IV)(lhs >= rhs);
+		}
+		result = (V)(mask & ONE_BITS);
+	}
+};
+
+// applies an operation to a block of values, with the scalar function handling
+// any group of lanes with special values
+template <typename V, typename Op>
+[[gnu::always_inline]]
+inline void apply_unary(te_type *vals, const size_t count)
+{
+	size_t i{0};
+	for (; i + lane_count<V> <= count; i += lane_count<V>)
+	{
+		V val;
+		load(vals + i, val);
+		if (Op::in_range(val))
+		{
+			V result;
+			Op::lanes(val, result);
+			store(vals + i, result);
+		}
+		else
+		{
+			for (size_t lane = 0; lane < lane_count<V>; ++lane)
+			{
+				vals[i + lane] = Op::scalar(vals[i + lane]);
+			}
+		}
+	}
+	for (; i < count; ++i)
+	{
+		vals[i] = Op::scalar(vals[i]);
+	}
+}
+
+template <typename V, typename Op>
+[[gnu::always_inline]]
+inline void apply_binary(te_type *lhs, const te_type *rhs, const size_t count)
+{
+	size_t i{0};
+	V      lhsVals;
+	V      rhsVals;
+	V      result;
+	for (; i + lane_count<V> <= count; i += lane_count<V>)
+	{
+		load(lhs + i, lhsVals);
+		load(rhs + i, rhsVals);
+		Op::lanes(lhsVals, rhsVals, result);
+		store(lhs + i, result);
+	}
+	for (; i < count; ++i)
+	{
+		lhsVals = lhs[i] + V{};
+		rhsVals = rhs[i] + V{};
+		Op::lanes(lhsVals, rhsVals, result);
+		lhs[i] = result[0];
+	}
+}
+
+// SQRT throws on negatives (so that batches fall back to evaluating row by row)
+inline void check_sqrt_domain(const te_type *vals, const size_t count)
+{
+	if (std::any_of(vals, vals + count, [](const te_type val) { return val < 0; }))
+	{
+		throw std::runtime_error("Negative value passed to SQRT.");
+	}
+}
+
+struct avx2
+{
+	constexpr static std::string_view name{"AVX2"};
+
+	template <typename Op>
+	[[gnu::target("avx2"), gnu::flatten]]
+	static void unary(te_type *vals, const size_t count)
+	{
+		apply_unary<v4d, Op>(vals, count);
+	}
+
+	template <typename Op>
+	[[gnu::target("avx2"), gnu::flatten]]
+	static void binary(te_type *lhs, const te_type *rhs, const size_t count)
+	{
+		apply_binary<v4d, Op>(lhs, rhs, count);
+	}
+
+	[[gnu::target("avx2")]]
+	static void sqrt(te_type *vals, const size_t count)
+	{
+		check_sqrt_domain(vals, count);
+		size_t i{0};
+		for (; i + 4 <= count; i += 4)
+		{
+			_mm256_storeu_pd(vals + i, _mm256_sqrt_pd(_mm256_loadu_pd(vals + i)));
+		}
+		for (; i < count; ++i)
+		{
+			vals[i] = std::sqrt(vals[i]);
+		}
+	}
+};
+
+struct avx512
+{
+	constexpr static std::string_view name{"AVX-512"};
+
+	template <typename Op>
+	[[gnu::target("avx512f"), gnu::flatten]]
+	static void unary(te_type *vals, const size_t count)
+	{
+		apply_unary<v8d, Op>(vals, count);
+	}
+
+	template <typename Op>
+	[[gnu::target("avx512f"), gnu::flatten]]
+	static void binary(te_type *lhs, const te_type *rhs, const size_t count)
+	{
+		apply_binary<v8d, Op>(lhs, rhs, count);
+	}
+
+	[[gnu::target("avx512f")]]
+	static void sqrt(te_type *vals, const size_t count)
+	{
+		check_sqrt_domain(vals, count);
+		size_t i{0};
+		for (; i + 8 <= count; i += 8)
+		{
+			_mm512_storeu_pd(vals + i, _mm512_maskz_sqrt_pd(0xFF, _mm512_loadu_pd(vals + i)));
+		}
+		for (; i < count; ++i)
+		{
+			vals[i] = std::sqrt(vals[i]);
+		}
+	}
+};
+
+template <typename ISA>
+[[nodiscard]]
+static kernel_table make_kernel_table()
+{
+	return kernel_table{
+	    ISA::name,
+	    {{{te_builtins::te_sqrt, &ISA::sqrt},
+	      {te_builtins::te_absolute_value, &ISA::template unary<abs_op>}}},
+	    {{{te_builtins::te_exp, &ISA::template unary<exp_op>},
+	      {te_builtins::te_log, &ISA::template unary<log_op>},
+	      {te_builtins::te_sin, &ISA::template unary<sin_cos_op<false>>},
+	      {te_builtins::te_cos, &ISA::template unary<sin_cos_op<true>>}}},
+	    {{{te_builtins::te_equal, &ISA::template binary<compare_op<te_builtins::te_equal>>},
+	      {te_builtins::te_not_equal, &ISA::template binary<compare_op<te_builtins::te_not_equal>>},
+	      {te_builtins::te_less_than, &ISA::template binary<compare_op<te_builtins::te_less_than>>},
+	      {te_builtins::te_less_than_equal_to,
+	       &ISA::template binary<compare_op<te_builtins::te_less_than_equal_to>>},
+	      {te_builtins::te_greater_than,
+	       &ISA::template binary<compare_op<te_builtins::te_greater_than>>},
+	      {te_builtins::te_greater_than_equal_to,
+	       &ISA::template binary<compare_op<te_builtins::te_greater_than_equal_to>>}}}};
+}
+#	pragma GCC diagnostic pop
+#endif
+
+/// @returns The kernels for the best instruction set that the CPU supports.
+[[nodiscard]]
+static const kernel_table &get_kernels()
+{
+	static const kernel_table kernels = []()
+	{
+#ifdef TE_SIMD_KERNELS
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("avx512f"))
+		{
+			return make_kernel_table<avx512>();
+		}
+		if (__builtin_cpu_supports("avx2"))
+		{
+			return make_kernel_table<avx2>();
+		}
+#endif
+		return kernel_table{};
+	}();
+	return kernels;
+}
+
+/// @returns The vectorized kernel for a builtin, or null if there isn't one.
+/// @param func The builtin.
+/// @param allowApproximate Whether a kernel that is not bit-identical to the builtin can be used.
+[[nodiscard]]
+static te_program::unary_kernel find_kernel(const te_fun1 func, const bool allowApproximate)
+{
+	for (const auto &[builtin, kernel] : get_kernels().m_unaryKernels)
+	{
+		if (builtin == func)
+		{
+			return kernel;
+		}
 	}
-	if (is_closure(texp->m_value))
+	if (allowApproximate)
 	{
-		// last param is the context object, we don't manage that here
-		for (auto param = texp->m_parameters.begin(); param != texp->m_parameters.end() - 1;
-		     ++param)
+		for (const auto &[builtin, kernel] : get_kernels().m_approximateKernels)
 		{
-			te_free(*param);
-			*param = nullptr;
+			if (builtin == func)
+			{
+				return kernel;
+			}
 		}
 	}
-	else if (is_function(texp->m_value))
+	return nullptr;
+}
+
+/// @returns The vectorized kernel for a builtin, or null if there isn't one.
+[[nodiscard]]
+static te_program::binary_kernel find_kernel(const te_fun2 func)
+{
+	for (const auto &[builtin, kernel] : get_kernels().m_binaryKernels)
 	{
-		for (auto *param : texp->m_parameters)
+		if (builtin == func)
 		{
-			te_free(param);
-			param = nullptr;
+			return kernel;
 		}
 	}
+	return nullptr;
 }
+}        // namespace te_simd
 
 //--------------------------------------------------
-const std::set<te_variable> te_parser::m_functions = {        // NOLINT
-    {"abs", static_cast<te_fun1>(te_builtins::te_absolute_value), TE_PURE},
-    {"acos", static_cast<te_fun1>(te_builtins::te_acos), TE_PURE},
-    // variadic, accepts 1-24 arguments
-    {"and", static_cast<te_fun24>(te_builtins::te_and_variadic),
-     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
-    {"asin", static_cast<te_fun1>(te_builtins::te_asin), TE_PURE},
-    {"atan", static_cast<te_fun1>(te_builtins::te_atan), TE_PURE},
-    {"atan2", static_cast<te_fun2>(te_builtins::te_atan2), TE_PURE},
-    {"average", static_cast<te_fun24>(te_builtins::te_average),
-     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
+// the built-in functions, sorted by name (case insensitively)
+constexpr static auto te_builtin_functions = []()
+{
+	auto builtins = std::to_array<te_builtin>({
+	    {"abs", static_cast<te_fun1>(te_builtins::te_absolute_value), TE_PURE},
+	    {"acos", static_cast<te_fun1>(te_builtins::te_acos), TE_PURE},
+	    // variadic, accepts any number of arguments (at least 1)
+	    {"and", static_cast<te_funv>(te_builtins::te_and_variadic),
+	     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
+	    {"asin", static_cast<te_fun1>(te_builtins::te_asin), TE_PURE},
+	    {"atan", static_cast<te_fun1>(te_builtins::te_atan), TE_PURE},
+	    {"atan2", static_cast<te_fun2>(te_builtins::te_atan2), TE_PURE},
+	    {"average", static_cast<te_funv>(te_builtins::te_average),
+	     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
 #ifndef TE_FLOAT
-    {"bitand", static_cast<te_fun2>(te_builtins::te_bitwise_and), TE_PURE},
-    {"bitor", static_cast<te_fun2>(te_builtins::te_bitwise_or), TE_PURE},
+	    {"bitand", static_cast<te_fun2>(te_builtins::te_bitwise_and), TE_PURE},
+	    {"bitor", static_cast<te_fun2>(te_builtins::te_bitwise_or), TE_PURE},
 #	if __cplusplus >= 202002L
-    {"bitlrotate8", static_cast<te_fun2>(te_builtins::te_left_rotate8), TE_PURE},
-    {"bitrrotate8", static_cast<te_fun2>(te_builtins::te_right_rotate8), TE_PURE},
-    {"bitlrotate16", static_cast<te_fun2>(te_builtins::te_left_rotate16), TE_PURE},
-    {"bitrrotate16", static_cast<te_fun2>(te_builtins::te_right_rotate16), TE_PURE},
-    {"bitlrotate32", static_cast<te_fun2>(te_builtins::te_left_rotate32), TE_PURE},
-    {"bitrrotate32", static_cast<te_fun2>(te_builtins::te_right_rotate32), TE_PURE},
-    {"bitlrotate64", static_cast<te_fun2>(te_builtins::te_left_rotate64), TE_PURE},
-    {"bitrrotate64", static_cast<te_fun2>(te_builtins::te_right_rotate64), TE_PURE},
-    {"bitlrotate", static_cast<te_fun2>(te_builtins::te_left_rotate), TE_PURE},
-    {"bitrrotate", static_cast<te_fun2>(te_builtins::te_right_rotate), TE_PURE},
+	    {"bitlrotate8", static_cast<te_fun2>(te_builtins::te_left_rotate8), TE_PURE},
+	    {"bitrrotate8", static_cast<te_fun2>(te_builtins::te_right_rotate8), TE_PURE},
+	    {"bitlrotate16", static_cast<te_fun2>(te_builtins::te_left_rotate16), TE_PURE},
+	    {"bitrrotate16", static_cast<te_fun2>(te_builtins::te_right_rotate16), TE_PURE},
+	    {"bitlrotate32", static_cast<te_fun2>(te_builtins::te_left_rotate32), TE_PURE},
+	    {"bitrrotate32", static_cast<te_fun2>(te_builtins::te_right_rotate32), TE_PURE},
+	    {"bitlrotate64", static_cast<te_fun2>(te_builtins::te_left_rotate64), TE_PURE},
+	    {"bitrrotate64", static_cast<te_fun2>(te_builtins::te_right_rotate64), TE_PURE},
+	    {"bitlrotate", static_cast<te_fun2>(te_builtins::te_left_rotate), TE_PURE},
+	    {"bitrrotate", static_cast<te_fun2>(te_builtins::te_right_rotate), TE_PURE},
 #	endif
-    {"bitnot8", static_cast<te_fun1>(te_builtins::te_bitwise_not8), TE_PURE},
-    {"bitnot16", static_cast<te_fun1>(te_builtins::te_bitwise_not16), TE_PURE},
-    {"bitnot32", static_cast<te_fun1>(te_builtins::te_bitwise_not32), TE_PURE},
-    {"bitnot64", static_cast<te_fun1>(te_builtins::te_bitwise_not64), TE_PURE},
-    {"bitnot", static_cast<te_fun1>(te_builtins::te_bitwise_not), TE_PURE},
-    {"bitlshift", static_cast<te_fun2>(te_builtins::te_left_shift_or_right), TE_PURE},
-    {"bitrshift", static_cast<te_fun2>(te_builtins::te_right_shift_or_left), TE_PURE},
-    {"bitxor", static_cast<te_fun2>(te_builtins::te_bitwise_xor), TE_PURE},
+	    {"bitnot8", static_cast<te_fun1>(te_builtins::te_bitwise_not8), TE_PURE},
+	    {"bitnot16", static_cast<te_fun1>(te_builtins::te_bitwise_not16), TE_PURE},
+	    {"bitnot32", static_cast<te_fun1>(te_builtins::te_bitwise_not32), TE_PURE},
+	    {"bitnot64", static_cast<te_fun1>(te_builtins::te_bitwise_not64), TE_PURE},
+	    {"bitnot", static_cast<te_fun1>(te_builtins::te_bitwise_not), TE_PURE},
+	    {"bitlshift", static_cast<te_fun2>(te_builtins::te_left_shift_or_right), TE_PURE},
+	    {"bitrshift", static_cast<te_fun2>(te_builtins::te_right_shift_or_left), TE_PURE},
+	    {"bitxor", static_cast<te_fun2>(te_builtins::te_bitwise_xor), TE_PURE},
+#endif
+	    {"ceil", static_cast<te_fun1>(te_builtins::te_ceil), TE_PURE},
+	    {"clamp",
+	     static_cast<te_fun3>(
+	         [](const te_type num, const te_type start, const te_type end)        // NOLINT
+	         {
+		         return (start <= end) ? std::clamp<te_type>(num, start, end) :
+		                                 std::clamp<te_type>(num, end, start);
+	         }),
+	     TE_PURE},
+	    {"combin", static_cast<te_fun2>(te_builtins::te_ncr), TE_PURE},
+	    {"cos", static_cast<te_fun1>(te_builtins::te_cos), TE_PURE},
+	    {"cosh", static_cast<te_fun1>(te_builtins::te_cosh), TE_PURE},
+	    {"cot", static_cast<te_fun1>(te_builtins::te_cot), TE_PURE},
+	    {"db", static_cast<te_fun5>(te_builtins::te_asset_depreciation),
+	     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
+	    {"e", static_cast<te_fun0>(te_builtins::te_e), TE_PURE},
+	    {"effect", static_cast<te_fun2>(te_builtins::te_effect), TE_PURE},
+	    {"even", static_cast<te_fun1>(te_builtins::te_even), TE_PURE},
+	    {"exp", static_cast<te_fun1>(te_builtins::te_exp), TE_PURE},
+	    {"fac", static_cast<te_fun1>(te_builtins::te_fac), TE_PURE},
+	    {"fact", static_cast<te_fun1>(te_builtins::te_fac), TE_PURE},
+	    {"false", static_cast<te_fun0>(te_builtins::te_false_value), TE_PURE},
+	    {"floor", static_cast<te_fun1>(te_builtins::te_floor), TE_PURE},
+	    {"iseven", static_cast<te_fun1>(te_builtins::te_is_even), TE_PURE},
+	    {"isodd", static_cast<te_fun1>(te_builtins::te_is_odd), TE_PURE},
+	    {"if", static_cast<te_fun3>(te_builtins::te_if), TE_PURE},
+	    {"ifs", static_cast<te_funv>(te_builtins::te_ifs),
+	     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
+	    {"ln", static_cast<te_fun1>(te_builtins::te_log), TE_PURE},
+	    {"log10", static_cast<te_fun1>(te_builtins::te_log10), TE_PURE},
+	    {"max", static_cast<te_funv>(te_builtins::te_max),
+	     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
+	    {"maxint", static_cast<te_fun0>(te_builtins::te_max_integer), TE_PURE},
+	    {"min", static_cast<te_funv>(te_builtins::te_min),
+	     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
+	    {"mod", static_cast<te_fun2>(te_builtins::te_modulus), TE_PURE},
+	    {"nan", static_cast<te_fun0>(te_builtins::te_nan_value), TE_PURE},
+	    {"ncr", static_cast<te_fun2>(te_builtins::te_ncr), TE_PURE},
+	    {"nominal", static_cast<te_fun2>(te_builtins::te_nominal), TE_PURE},
+	    {"not", static_cast<te_fun1>(te_builtins::te_not), TE_PURE},
+	    {"npr", static_cast<te_fun2>(te_builtins::te_npr), TE_PURE},
+	    {"odd", static_cast<te_fun1>(te_builtins::te_odd), TE_PURE},
+	    {"or", static_cast<te_funv>(te_builtins::te_or_variadic),
+	     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
+	    {"permut", static_cast<te_fun2>(te_builtins::te_npr), TE_PURE},
+	    {"pi", static_cast<te_fun0>(te_builtins::te_pi), TE_PURE},
+	    {"pow", static_cast<te_fun2>(te_builtins::te_pow), TE_PURE},
+	    {"power", /* Excel alias*/ static_cast<te_fun2>(te_builtins::te_pow), TE_PURE},
+	    {"rand", static_cast<te_fun0>(te_builtins::te_random), TE_PURE},
+	    {"round", static_cast<te_fun2>(te_builtins::te_round),
+	     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
+	    {"sign", static_cast<te_fun1>(te_builtins::te_sign), TE_PURE},
+	    {"sin", static_cast<te_fun1>(te_builtins::te_sin), TE_PURE},
+	    {"sinh", static_cast<te_fun1>(te_builtins::te_sinh), TE_PURE},
+	    {"sqr", static_cast<te_fun1>(te_builtins::te_sqr), TE_PURE},
+	    {"sqrt", static_cast<te_fun1>(te_builtins::te_sqrt), TE_PURE},
+	    {"sum", static_cast<te_funv>(te_builtins::te_sum),
+	     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
+	    {"supports32bit", static_cast<te_fun0>(te_builtins::te_supports_32bit), TE_PURE},
+	    {"supports64bit", static_cast<te_fun0>(te_builtins::te_supports_64bit), TE_PURE},
+	    {"tan", static_cast<te_fun1>(te_builtins::te_tan), TE_PURE},
+	    {"tanh", static_cast<te_fun1>(te_builtins::te_tanh), TE_PURE},
+	    {"tgamma", static_cast<te_fun1>(te_builtins::te_tgamma), TE_PURE},
+	    {"true", static_cast<te_fun0>(te_builtins::te_true_value), TE_PURE},
+	    {"trunc", static_cast<te_fun1>(te_builtins::te_trunc), TE_PURE}});
+	std::sort(builtins.begin(), builtins.end(), [](const te_builtin &lhv, const te_builtin &rhv)
+	          { return te_string_less{}(lhv.m_name, rhv.m_name); });
+	return builtins;
+}();
+
+/// @brief A perfect hash table of the builtins, built at compile time.
+/// @details The seed is searched for when compiling, until one is found that sends
+///     every builtin's name to its own slot. A lookup is then a single probe (and one
+///     name comparison).
+class te_builtin_table
+{
+  public:
+	constexpr te_builtin_table()
+	{
+		static_assert(te_builtin_functions.size() < std::numeric_limits<uint8_t>::max());
+		for (m_seed = 0; m_seed < MAX_SEED; ++m_seed)
+		{
+			std::array<bool, SLOT_COUNT> used{};
+			bool                         collided{false};
+			for (const auto &builtin : te_builtin_functions)
+			{
+				auto &slotUsed = used[slot(te_symbol_index::hash(builtin.m_name), m_seed)];
+				if (slotUsed)
+				{
+					collided = true;
+					break;
+				}
+				slotUsed = true;
+			}
+			if (!collided)
+			{
+				break;
+			}
+		}
+		for (size_t i = 0; i < te_builtin_functions.size(); ++i)
+		{
+			m_slots[slot(te_symbol_index::hash(te_builtin_functions[i].m_name), m_seed)] =
+			    static_cast<uint8_t>(i + 1);
+		}
+	}
+
+	/// @returns The builtin with the given name, or null if not found.
+	[[nodiscard]]
+	constexpr const te_builtin *find(const std::string_view name) const noexcept
+	{
+		const auto entry = m_slots[slot(te_symbol_index::hash(name), m_seed)];
+		if (entry == 0)
+		{
+			return nullptr;
+		}
+		const auto &builtin = te_builtin_functions[entry - 1];
+		return (!te_string_less{}(builtin.m_name, name) &&
+		        !te_string_less{}(name, builtin.m_name)) ?
+		           &builtin :
+		           nullptr;
+	}
+
+	/// @returns Whether a seed was found.
+	[[nodiscard]]
+	constexpr bool is_perfect() const noexcept
+	{
+		return (m_seed < MAX_SEED);
+	}
+
+  private:
+	constexpr static size_t   SLOT_BITS{10};
+	constexpr static size_t   SLOT_COUNT{1 << SLOT_BITS};
+	constexpr static uint64_t MAX_SEED{10'000};
+
+	[[nodiscard]]
+	constexpr static size_t slot(const size_t hashValue, const uint64_t seed) noexcept
+	{
+		// (a Fibonacci hash of the seeded hash, keeping its top bits)
+		return static_cast<size_t>(
+		    ((static_cast<uint64_t>(hashValue) ^ seed) * 0x9E3779B97F4A7C15ULL) >> (64 - SLOT_BITS));
+	}
+
+	uint64_t                        m_seed{0};
+	std::array<uint8_t, SLOT_COUNT> m_slots{};
+};
+
+constexpr static te_builtin_table te_builtin_lookup;
+static_assert(te_builtin_lookup.is_perfect(), "No perfect hash seed found for the builtins.");
+
+//--------------------------------------------------
+const te_builtin *te_parser::find_builtin(const std::string_view name) noexcept
+{
+	return te_builtin_lookup.find(name);
+}
+
+//--------------------------------------------------
+template <typename SymbolT>
+void te_parser::read_symbol(te_parser::state *theState, const SymbolT &symbol)
+{
+	m_varFound       = true;
+	m_currentVarType = symbol.m_type;
+#ifndef TE_NO_BOOKKEEPING
+	// keep track of what's been used in the formula
+	if (is_function(symbol.m_value) || is_closure(symbol.m_value))
+	{
+		m_usedFunctions.emplace(symbol.m_name);
+	}
+	else
+	{
+		m_usedVars.emplace(symbol.m_name);
+	}
+#endif
+
+	if (is_constant(symbol.m_value))
+	{
+		theState->m_type  = te_parser::state::token_type::TOK_NUMBER;
+		theState->m_value = symbol.m_value;
+		// (custom constants can be changed later by set_constant())
+		if constexpr (std::is_same_v<SymbolT, te_variable>)
+		{
+			theState->m_customConstant = &symbol.m_name;
+		}
+	}
+	else if (is_variable(symbol.m_value))
+	{
+		theState->m_type  = te_parser::state::token_type::TOK_VARIABLE;
+		theState->m_value = symbol.m_value;
+		if constexpr (std::is_same_v<SymbolT, te_variable>)
+		{
+			m_readVariables.push_back(&symbol);
+		}
+	}
+	else if (is_function(symbol.m_value))
+	{
+		theState->m_type    = te_parser::state::token_type::TOK_FUNCTION;
+		theState->m_varType = symbol.m_type;
+		theState->m_value   = symbol.m_value;
+	}
+	else if (is_closure(symbol.m_value))
+	{
+		theState->context   = symbol.m_context;
+		theState->m_type    = te_parser::state::token_type::TOK_FUNCTION;
+		theState->m_varType = symbol.m_type;
+		theState->m_value   = symbol.m_value;
+	}
+}
+
+//--------------------------------------------------
+void te_parser::read_infix(te_parser::state *theState, const infix_operator oper) noexcept
+{
+	struct infix_entry
+	{
+		te_fun2 m_function{nullptr};
+		int     m_precedence{0};
+		bool    m_rightToLeft{false};
+	};
+
+	// The binary operators that next_token() reads, by infix_operator (which lists them
+	// from the lowest precedence to the highest). Logical operators are the lowest,
+	// once tokens have been split into arguments.
+	constexpr static auto operators = std::to_array<infix_entry>({
+	    {te_builtins::te_or, 1},
+	    {te_builtins::te_and, 2},
+	    {te_builtins::te_bitwise_or, 3},
+	    {te_builtins::te_bitwise_xor, 4},
+	    {te_builtins::te_bitwise_and, 5},
+	    {te_builtins::te_equal, 6},
+	    {te_builtins::te_not_equal, 6},
+	    {te_builtins::te_less_than, 7},
+	    {te_builtins::te_less_than_equal_to, 7},
+	    {te_builtins::te_greater_than, 7},
+	    {te_builtins::te_greater_than_equal_to, 7},
+	    {te_builtins::te_left_shift, 8},
+	    {te_builtins::te_right_shift, 8},
+#if __cplusplus >= 202002L && !defined(TE_FLOAT)
+	    {te_builtins::te_left_rotate, 8},
+	    {te_builtins::te_right_rotate, 8},
+#else
+	    // (next_token() reads these as errors)
+	    {nullptr, 8},
+	    {nullptr, 8},
 #endif
-    {"ceil", static_cast<te_fun1>(te_builtins::te_ceil), TE_PURE},
-    {"clamp",
-     static_cast<te_fun3>(
-         [](const te_type num, const te_type start, const te_type end)        // NOLINT
-         {
-	         return (start <= end) ? std::clamp<te_type>(num, start, end) :
-	                                 std::clamp<te_type>(num, end, start);
-         }),
-     TE_PURE},
-    {"combin", static_cast<te_fun2>(te_builtins::te_ncr), TE_PURE},
-    {"cos", static_cast<te_fun1>(te_builtins::te_cos), TE_PURE},
-    {"cosh", static_cast<te_fun1>(te_builtins::te_cosh), TE_PURE},
-    {"cot", static_cast<te_fun1>(te_builtins::te_cot), TE_PURE},
-    {"db", static_cast<te_fun5>(te_builtins::te_asset_depreciation),
-     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
-    {"e", static_cast<te_fun0>(te_builtins::te_e), TE_PURE},
-    {"effect", static_cast<te_fun2>(te_builtins::te_effect), TE_PURE},
-    {"even", static_cast<te_fun1>(te_builtins::te_even), TE_PURE},
-    {"exp", static_cast<te_fun1>(te_builtins::te_exp), TE_PURE},
-    {"fac", static_cast<te_fun1>(te_builtins::te_fac), TE_PURE},
-    {"fact", static_cast<te_fun1>(te_builtins::te_fac), TE_PURE},
-    {"false", static_cast<te_fun0>(te_builtins::te_false_value), TE_PURE},
-    {"floor", static_cast<te_fun1>(te_builtins::te_floor), TE_PURE},
-    {"iseven", static_cast<te_fun1>(te_builtins::te_is_even), TE_PURE},
-    {"isodd", static_cast<te_fun1>(te_builtins::te_is_odd), TE_PURE},
-    {"if", static_cast<te_fun3>(te_builtins::te_if), TE_PURE},
-    {"ifs", static_cast<te_fun24>(te_builtins::te_ifs),
-     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
-    {"ln", static_cast<te_fun1>(te_builtins::te_log), TE_PURE},
-    {"log10", static_cast<te_fun1>(te_builtins::te_log10), TE_PURE},
-    {"max", static_cast<te_fun24>(te_builtins::te_max),
-     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
-    {"maxint", static_cast<te_fun0>(te_builtins::te_max_integer), TE_PURE},
-    {"min", static_cast<te_fun24>(te_builtins::te_min),
-     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
-    {"mod", static_cast<te_fun2>(te_builtins::te_modulus), TE_PURE},
-    {"nan", static_cast<te_fun0>(te_builtins::te_nan_value), TE_PURE},
-    {"ncr", static_cast<te_fun2>(te_builtins::te_ncr), TE_PURE},
-    {"nominal", static_cast<te_fun2>(te_builtins::te_nominal), TE_PURE},
-    {"not", static_cast<te_fun1>(te_builtins::te_not), TE_PURE},
-    {"npr", static_cast<te_fun2>(te_builtins::te_npr), TE_PURE},
-    {"odd", static_cast<te_fun1>(te_builtins::te_odd), TE_PURE},
-    {"or", static_cast<te_fun24>(te_builtins::te_or_variadic),
-     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
-    {"permut", static_cast<te_fun2>(te_builtins::te_npr), TE_PURE},
-    {"pi", static_cast<te_fun0>(te_builtins::te_pi), TE_PURE},
-    {"pow", static_cast<te_fun2>(te_builtins::te_pow), TE_PURE},
-    {"power", /* Excel alias*/ static_cast<te_fun2>(te_builtins::te_pow), TE_PURE},
-    {"rand", static_cast<te_fun0>(te_builtins::te_random), TE_PURE},
-    {"round", static_cast<te_fun2>(te_builtins::te_round),
-     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
-    {"sign", static_cast<te_fun1>(te_builtins::te_sign), TE_PURE},
-    {"sin", static_cast<te_fun1>(te_builtins::te_sin), TE_PURE},
-    {"sinh", static_cast<te_fun1>(te_builtins::te_sinh), TE_PURE},
-    {"sqr", static_cast<te_fun1>(te_builtins::te_sqr), TE_PURE},
-    {"sqrt", static_cast<te_fun1>(te_builtins::te_sqrt), TE_PURE},
-    {"sum", static_cast<te_fun24>(te_builtins::te_sum),
-     static_cast<te_variable_flags>(TE_PURE | TE_VARIADIC)},
-    {"supports32bit", static_cast<te_fun0>(te_builtins::te_supports_32bit), TE_PURE},
-    {"supports64bit", static_cast<te_fun0>(te_builtins::te_supports_64bit), TE_PURE},
-    {"tan", static_cast<te_fun1>(te_builtins::te_tan), TE_PURE},
-    {"tanh", static_cast<te_fun1>(te_builtins::te_tanh), TE_PURE},
-    {"tgamma", static_cast<te_fun1>(te_builtins::te_tgamma), TE_PURE},
-    {"true", static_cast<te_fun0>(te_builtins::te_true_value), TE_PURE},
-    {"trunc", static_cast<te_fun1>(te_builtins::te_trunc), TE_PURE}};
+	    {te_builtins::te_add, 9},
+	    {te_builtins::te_sub, 9},
+	    {te_builtins::te_mul, 10},
+	    {te_builtins::te_divide, 10},
+	    {te_builtins::te_modulus, 10},
+#ifdef TE_POW_FROM_RIGHT
+	    {static_cast<te_fun2>(te_builtins::te_pow), 11, true},
+#else
+	    {static_cast<te_fun2>(te_builtins::te_pow), 11},
+#endif
+	});
+	static_assert(operators.size() == static_cast<size_t>(infix_operator::POW) + 1,
+	              "The operator table must have an entry for each infix_operator.");
+
+	const auto &entry       = operators[static_cast<size_t>(oper)];
+	theState->m_type        = te_parser::state::token_type::TOK_INFIX;
+	theState->m_value       = entry.m_function;
+	theState->m_precedence  = entry.m_precedence;
+	theState->m_rightToLeft = entry.m_rightToLeft;
+}
 
 //--------------------------------------------------
 void te_parser::next_token(te_parser::state *theState)
@@ -1457,7 +2032,8 @@ void te_parser::next_token(te_parser::state *theState)
 		return;
 	}
 
-	theState->m_type = te_parser::state::token_type::TOK_NULL;
+	theState->m_type           = te_parser::state::token_type::TOK_NULL;
+	theState->m_customConstant = nullptr;
 
 	do        // NOLINT
 	{
@@ -1471,16 +2047,31 @@ void te_parser::next_token(te_parser::state *theState)
 		if (((*theState->m_next >= '0') && (*theState->m_next <= '9')) ||
 		    (*theState->m_next == get_decimal_separator()))
 		{
-			char *nEnd{nullptr};
-#ifdef TE_FLOAT
-			theState->m_value = static_cast<te_type>(std::strtof(theState->m_next, &nEnd));
-#elif defined(TE_LONG_DOUBLE)
-			theState->m_value = static_cast<te_type>(std::strtold(theState->m_next, &nEnd));
-#else
-			theState->m_value = static_cast<te_type>(std::strtod(theState->m_next, &nEnd));
-#endif
-			theState->m_next = nEnd;
-			theState->m_type = te_parser::state::token_type::TOK_NUMBER;
+			te_type value{0};
+			const char *const numberEnd = read_number(theState->m_next, theState->m_end, value);
+			// (a separator without any digits)
+			if (numberEnd == theState->m_next)
+			{
+				std::advance(theState->m_next, 1);
+				theState->m_type = te_parser::state::token_type::TOK_ERROR;
+				return;
+			}
+			theState->m_next  = numberEnd;
+			theState->m_value = value;
+			theState->m_type  = te_parser::state::token_type::TOK_NUMBER;
+			// (read from a parameter that each expression of this shape binds its own value to)
+			if (theState->m_hoistLiterals)
+			{
+				if (m_hoistedLiteralCount < m_hoistedLiterals.size())
+				{
+					theState->m_value = &m_hoistedLiterals[m_hoistedLiteralCount++];
+					theState->m_type  = te_parser::state::token_type::TOK_VARIABLE;
+				}
+				else
+				{
+					theState->m_type = te_parser::state::token_type::TOK_ERROR;
+				}
+			}
 		}
 		else
 		{
@@ -1496,71 +2087,66 @@ void te_parser::next_token(te_parser::state *theState)
 				m_varFound = false;
 				const std::string_view currentVarToken{start, static_cast<std::string::size_type>(
 				                                                  theState->m_next - start)};
-				m_currentVar = find_lookup(theState, currentVarToken);
-				if (m_currentVar != theState->m_lookup.cend())
+				if (const auto var = find_lookup(theState, currentVarToken);
+				    var != theState->m_lookup.cend())
 				{
-					m_varFound = true;
+					read_symbol(theState, *var);
 				}
-				else
+				else if (const auto *const builtin = find_builtin(currentVarToken);
+				         builtin != nullptr)
 				{
-					m_currentVar = find_builtin(currentVarToken);
-					if (m_currentVar != m_functions.cend())
-					{
-						m_varFound = true;
-					}
-					// if unknown symbol resolve is not a no-op, then try using it
-					// to see what this variable is
-					else if (m_unknownSymbolResolve.index() != 0)
+					read_symbol(theState, *builtin);
+				}
+				// if unknown symbol resolve is not a no-op, then try using it
+				// to see what this variable is
+				else if (m_unknownSymbolResolve.index() != 0)
+				{
+					try
 					{
-						try
+						// "te_type usr(string_view)" resolver
+						if (m_unknownSymbolResolve.index() == 1)
 						{
-							// "te_type usr(string_view)" resolver
-							if (m_unknownSymbolResolve.index() == 1)
+							const auto retUsrVal =
+							    std::get<1>(m_unknownSymbolResolve)(currentVarToken);
+							if (std::isfinite(retUsrVal))
 							{
-								const auto retUsrVal =
-								    std::get<1>(m_unknownSymbolResolve)(currentVarToken);
-								if (std::isfinite(retUsrVal))
+								add_variable_or_function(
+								    {te_variable::name_type{currentVarToken}, retUsrVal});
+								const auto resolvedVar = find_lookup(theState, currentVarToken);
+								assert(resolvedVar != theState->m_lookup.cend() &&
+								       "Internal error in parser using unknown symbol resolver.");
+								if (resolvedVar != theState->m_lookup.cend())
 								{
-									add_variable_or_function(
-									    {te_variable::name_type{currentVarToken}, retUsrVal});
-									m_currentVar = find_lookup(theState, currentVarToken);
-									assert(
-									    m_currentVar != theState->m_lookup.cend() &&
-									    "Internal error in parser using unknown symbol resolver.");
-									if (m_currentVar != theState->m_lookup.cend())
-									{
-										m_resolvedVariables.insert(
-										    te_variable::name_type{currentVarToken});
-										m_varFound = true;
-									}
+									m_resolvedVariables.insert(
+									    te_variable::name_type{currentVarToken});
+									read_symbol(theState, *resolvedVar);
 								}
 							}
-							// "te_type usr(string_view, string&)" resolver
-							else if (m_unknownSymbolResolve.index() == 2)
+						}
+						// "te_type usr(string_view, string&)" resolver
+						else if (m_unknownSymbolResolve.index() == 2)
+						{
+							const auto retUsrVal = std::get<2>(m_unknownSymbolResolve)(
+							    currentVarToken, m_lastErrorMessage);
+							if (std::isfinite(retUsrVal))
 							{
-								const auto retUsrVal = std::get<2>(m_unknownSymbolResolve)(
-								    currentVarToken, m_lastErrorMessage);
-								if (std::isfinite(retUsrVal))
+								add_variable_or_function(
+								    {te_variable::name_type{currentVarToken}, retUsrVal});
+								const auto resolvedVar = find_lookup(theState, currentVarToken);
+								assert(resolvedVar != theState->m_lookup.cend() &&
+								       "Internal error in parser using unknown symbol resolver.");
+								if (resolvedVar != theState->m_lookup.cend())
 								{
-									add_variable_or_function(
-									    {te_variable::name_type{currentVarToken}, retUsrVal});
-									m_currentVar = find_lookup(theState, currentVarToken);
-									assert(
-									    m_currentVar != theState->m_lookup.cend() &&
-									    "Internal error in parser using unknown symbol resolver.");
-									if (m_currentVar != theState->m_lookup.cend())
-									{
-										m_resolvedVariables.insert(
-										    te_variable::name_type{currentVarToken});
-										m_varFound = true;
-									}
+									m_resolvedVariables.insert(
+									    te_variable::name_type{currentVarToken});
+									read_symbol(theState, *resolvedVar);
 								}
 							}
 						}
-						catch (const std::exception &exp)
-						{
-							m_lastErrorMessage = exp.what();
-						}
+					}
+					catch (const std::exception &exp)
+					{
+						m_lastErrorMessage = exp.what();
 					}
 				}
 
@@ -1568,65 +2154,43 @@ void te_parser::next_token(te_parser::state *theState)
 				{
 					theState->m_type = te_parser::state::token_type::TOK_ERROR;
 				}
-				else
+			}
+			else
+			{
+				/* Look for an operator or special character. */
+				const auto tok = *theState->m_next;
+				std::advance(theState->m_next, 1);
+				/* Skip comments, like whitespace. */
+				if (tok == '/' && (*theState->m_next == '*' || *theState->m_next == '/'))
 				{
-#ifndef TE_NO_BOOKKEEPING
-					// keep track of what's been used in the formula
-					if (is_function(m_currentVar->m_value) || is_closure(m_currentVar->m_value))
+					const char *const commentStart = std::prev(theState->m_next);
+					const char *const commentEnd   = skip_comment(commentStart);
+					if (commentEnd == nullptr)
 					{
-						m_usedFunctions.insert(m_currentVar->m_name);
+						theState->m_type = te_parser::state::token_type::TOK_ERROR;
 					}
 					else
 					{
-						m_usedVars.insert(m_currentVar->m_name);
-					}
-#endif
-
-					if (is_constant(m_currentVar->m_value))
-					{
-						theState->m_type  = te_parser::state::token_type::TOK_NUMBER;
-						theState->m_value = m_currentVar->m_value;
-					}
-					else if (is_variable(m_currentVar->m_value))
-					{
-						theState->m_type  = te_parser::state::token_type::TOK_VARIABLE;
-						theState->m_value = m_currentVar->m_value;
-					}
-					else if (is_function(m_currentVar->m_value))
-					{
-						theState->m_type    = te_parser::state::token_type::TOK_FUNCTION;
-						theState->m_varType = m_currentVar->m_type;
-						theState->m_value   = m_currentVar->m_value;
-					}
-					else if (is_closure(m_currentVar->m_value))
-					{
-						theState->context   = m_currentVar->m_context;
-						theState->m_type    = te_parser::state::token_type::TOK_FUNCTION;
-						theState->m_varType = m_currentVar->m_type;
-						theState->m_value   = m_currentVar->m_value;
+						theState->m_commentLength += std::distance(commentStart, commentEnd);
+						theState->m_next = commentEnd;
 					}
 				}
-			}
-			else
-			{
-				/* Look for an operator or special character. */
-				const auto tok = *theState->m_next;
-				std::advance(theState->m_next, 1);
-				if (tok == '+')
+				else if (tok == '+')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = te_builtins::te_add;
+					read_infix(theState, infix_operator::ADD);
 				}
 				else if (tok == '-')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = te_builtins::te_sub;
+					read_infix(theState, infix_operator::SUB);
 				}
 #ifndef TE_FLOAT
 				else if (tok == '~')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = te_builtins::te_bitwise_not;
+					theState->m_type        = te_parser::state::token_type::TOK_INFIX;
+					theState->m_value       = te_builtins::te_bitwise_not;
+					// (only a prefix, so it can't join two operands)
+					theState->m_precedence  = 0;
+					theState->m_rightToLeft = false;
 				}
 #else
 				else if (tok == '~')
@@ -1636,37 +2200,31 @@ void te_parser::next_token(te_parser::state *theState)
 #endif
 				else if (tok == '*' && (*theState->m_next == '*'))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_pow);
+					read_infix(theState, infix_operator::POW);
 					std::advance(theState->m_next, 1);
 				}
 				else if (tok == '*')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = te_builtins::te_mul;
+					read_infix(theState, infix_operator::MUL);
 				}
 				else if (tok == '/')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = te_builtins::te_divide;
+					read_infix(theState, infix_operator::DIVIDE);
 				}
 #if defined(TE_BITWISE_OPERATORS) && !defined(TE_FLOAT)
 				else if (tok == '^')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_bitwise_xor);
+					read_infix(theState, infix_operator::BITWISE_XOR);
 				}
 #else
 				else if (tok == '^')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_pow);
+					read_infix(theState, infix_operator::POW);
 				}
 #endif
 				else if (tok == '%')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = te_builtins::te_modulus;
+					read_infix(theState, infix_operator::MODULUS);
 				}
 #ifdef TE_BRACKETS_AS_PARENS
 				else if (tok == '(' || tok == '[')
@@ -1693,15 +2251,13 @@ void te_parser::next_token(te_parser::state *theState)
 				else if (tok == '<' && (*theState->m_next == '<') &&
 				         (*std::next(theState->m_next) == '<'))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_left_rotate);
+					read_infix(theState, infix_operator::LEFT_ROTATE);
 					std::advance(theState->m_next, 2);
 				}
 				else if (tok == '>' && (*theState->m_next == '>') &&
 				         (*std::next(theState->m_next) == '>'))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_right_rotate);
+					read_infix(theState, infix_operator::RIGHT_ROTATE);
 					std::advance(theState->m_next, 2);
 				}
 #else
@@ -1718,14 +2274,12 @@ void te_parser::next_token(te_parser::state *theState)
 				// shift operators
 				else if (tok == '<' && (*theState->m_next == '<'))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_left_shift);
+					read_infix(theState, infix_operator::LEFT_SHIFT);
 					std::advance(theState->m_next, 1);
 				}
 				else if (tok == '>' && (*theState->m_next == '>'))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_right_shift);
+					read_infix(theState, infix_operator::RIGHT_SHIFT);
 					std::advance(theState->m_next, 1);
 				}
 #else
@@ -1739,85 +2293,71 @@ void te_parser::next_token(te_parser::state *theState)
 				// logical operators
 				else if (tok == '=' && (*theState->m_next == '='))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_equal);
+					read_infix(theState, infix_operator::EQUAL);
 					std::advance(theState->m_next, 1);
 				}
 				else if (tok == '=')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_equal);
+					read_infix(theState, infix_operator::EQUAL);
 				}
 				else if (tok == '!' && (*theState->m_next == '='))        // NOLINT
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_not_equal);
+					read_infix(theState, infix_operator::NOT_EQUAL);
 					std::advance(theState->m_next, 1);
 				}
 				else if (tok == '<' && (*theState->m_next == '>'))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_not_equal);
+					read_infix(theState, infix_operator::NOT_EQUAL);
 					std::advance(theState->m_next, 1);
 				}
 				else if (tok == '<' && (*theState->m_next == '='))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_less_than_equal_to);
+					read_infix(theState, infix_operator::LESS_THAN_EQUAL_TO);
 					std::advance(theState->m_next, 1);
 				}
 				else if (tok == '<')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_less_than);
+					read_infix(theState, infix_operator::LESS_THAN);
 				}
 				else if (tok == '>' && (*theState->m_next == '='))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_greater_than_equal_to);
+					read_infix(theState, infix_operator::GREATER_THAN_EQUAL_TO);
 					std::advance(theState->m_next, 1);
 				}
 				else if (tok == '>')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_greater_than);
+					read_infix(theState, infix_operator::GREATER_THAN);
 				}
 				else if (tok == '&' && (*theState->m_next == '&'))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_and);
+					read_infix(theState, infix_operator::AND);
 					std::advance(theState->m_next, 1);
 				}
 #if defined(TE_BITWISE_OPERATORS) && !defined(TE_FLOAT)
 				else if (tok == '&')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_bitwise_and);
+					read_infix(theState, infix_operator::BITWISE_AND);
 				}
 #else
 				else if (tok == '&')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_and);
+					read_infix(theState, infix_operator::AND);
 				}
 #endif
 				else if (tok == '|' && (*theState->m_next == '|'))
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_or);
+					read_infix(theState, infix_operator::OR);
 					std::advance(theState->m_next, 1);
 				}
 #if defined(TE_BITWISE_OPERATORS) && !defined(TE_FLOAT)
 				else if (tok == '|')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_bitwise_or);
+					read_infix(theState, infix_operator::BITWISE_OR);
 				}
 #else
 				else if (tok == '|')
 				{
-					theState->m_type  = te_parser::state::token_type::TOK_INFIX;
-					theState->m_value = static_cast<te_fun2>(te_builtins::te_or);
+					read_infix(theState, infix_operator::OR);
 				}
 #endif
 				else if (tok == ' ' || tok == '\t' || tok == '\n' || tok == '\r')
@@ -1833,426 +2373,256 @@ void te_parser::next_token(te_parser::state *theState)
 }
 
 //--------------------------------------------------
-te_expr *te_parser::base(te_parser::state *theState)
+te_parser::node_index te_parser::parse(te_parser::state *theState)
 {
-	/* <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <power> |
+	/* <list>      =    <expr> {"," <expr>}
+	   <expr>      =    <power> {<infix operator> <power>}
+	   <power>     =    {("-" | "+" | "~")} <base>
+	   <base>      =    <constant> | <variable> | <function-0> {"(" ")"} | <function-1> <power> |
 	                    <function-X> "(" <expr> {"," <expr>} ")" | "(" <list> ")" */
-	te_expr *ret{nullptr};
+	m_variadicArgs.clear();
+	return parse_list(theState, 0);
+}
 
-	if (theState->m_type == te_parser::state::token_type::TOK_OPEN)
-	{
-		next_token(theState);
-		ret = list(theState);
-		if (theState->m_type != te_parser::state::token_type::TOK_CLOSE)
-		{
-			theState->m_type = te_parser::state::token_type::TOK_ERROR;
-		}
-		else
-		{
-			next_token(theState);
-		}
-	}
-	else if (theState->m_type == te_parser::state::token_type::TOK_NUMBER)
-	{
-		ret = new_expr(TE_DEFAULT, theState->m_value);
-		next_token(theState);
-	}
-	else if (theState->m_type == te_parser::state::token_type::TOK_VARIABLE)
+//--------------------------------------------------
+template <te_parser::parse_frame::step rule>
+te_parser::node_index te_parser::parse_nested(te_parser::state *theState, const size_t depth,
+                                              const int minPrecedence, const bool liftNegation)
+{
+	using step = parse_frame::step;
+
+	if (depth > m_maxDepth)
 	{
-		ret = new_expr(TE_DEFAULT, theState->m_value);
-		next_token(theState);
+		theState->m_type          = te_parser::state::token_type::TOK_ERROR;
+		theState->m_depthExceeded = true;
+		return new_expr(TE_DEFAULT, te_variant_type{te_nan});
 	}
-	else if (theState->m_type == te_parser::state::token_type::TOK_NULL ||
-	         theState->m_type == te_parser::state::token_type::TOK_ERROR ||
-	         theState->m_type == te_parser::state::token_type::TOK_END ||
-	         theState->m_type == te_parser::state::token_type::TOK_SEP ||
-	         theState->m_type == te_parser::state::token_type::TOK_CLOSE ||
-	         theState->m_type == te_parser::state::token_type::TOK_INFIX)
+	// deeply nested rules (e.g., long chains of parentheses) are read without recursing
+	if (depth >= MAX_RECURSIVE_PARSE_DEPTH)
 	{
-		ret              = new_expr(TE_DEFAULT, te_variant_type{te_nan});
-		theState->m_type = te_parser::state::token_type::TOK_ERROR;
+		return parse_deep(theState, rule, depth, minPrecedence, liftNegation);
 	}
-	else if (is_function0(theState->m_value) || is_closure0(theState->m_value))
+	if constexpr (rule == step::LIST)
 	{
-		ret = new_expr(theState->m_varType, theState->m_value, {});
-		if (is_closure(theState->m_value))
-		{
-			ret->m_parameters[0] = theState->context;
-		}
-		next_token(theState);
-		if (theState->m_type == te_parser::state::token_type::TOK_OPEN)
-		{
-			next_token(theState);
-			if (theState->m_type != te_parser::state::token_type::TOK_CLOSE)
-			{
-				theState->m_type = te_parser::state::token_type::TOK_ERROR;
-			}
-			else
-			{
-				next_token(theState);
-			}
-		}
+		return parse_list(theState, depth);
 	}
-	else if (is_function1(theState->m_value) || is_closure1(theState->m_value))
+	else if constexpr (rule == step::POWER)
 	{
-		ret = new_expr(theState->m_varType, theState->m_value);
-		if (is_closure(theState->m_value))
-		{
-			ret->m_parameters[1] = theState->context;
-		}
-		next_token(theState);
-		ret->m_parameters[0] = power(theState);
+		return parse_power(theState, depth);
 	}
-	else if (is_function(theState->m_value) || is_closure(theState->m_value))
+	else
 	{
-		const auto arity = get_arity(theState->m_value);
-
-		ret = new_expr(theState->m_varType, theState->m_value);
-		if (is_closure(theState->m_value))
-		{
-			ret->m_parameters[arity] = theState->context;
-		}
-		next_token(theState);
-
-		if (theState->m_type != te_parser::state::token_type::TOK_OPEN)
-		{
-			theState->m_type = te_parser::state::token_type::TOK_ERROR;
-		}
-		else
-		{
-			// If there are vars or other functions in the parameters, keep track of the original
-			// opening function; that is what we will do our variadic check on.
-			const bool                                  varValid{m_varFound};
-			const std::set<te_variable>::const_iterator openingVar = m_currentVar;
-			// load any parameters
-			std::decay<decltype(arity)>::type i{0};        // NOLINT
-			for (i = 0; i < arity; i++)
-			{
-				next_token(theState);
-				ret->m_parameters[i] = expr_level1(theState);
-				if (theState->m_type != te_parser::state::token_type::TOK_SEP)
-				{
-					break;
-				}
-			}
-			if (theState->m_type == te_parser::state::token_type::TOK_CLOSE && (i != arity - 1) &&
-			    varValid && is_variadic(openingVar->m_type))
-			{
-				next_token(theState);
-			}
-			else if (theState->m_type != te_parser::state::token_type::TOK_CLOSE ||
-			         (i != arity - 1))
-			{
-				theState->m_type = te_parser::state::token_type::TOK_ERROR;
-			}
-			else
-			{
-				next_token(theState);
-			}
-		}
+		static_assert(rule == step::EXPR, "Only lists, expressions, and powers are nested.");
+		return parse_expr(theState, depth, minPrecedence, liftNegation);
 	}
-
-	return ret;
 }
 
 //--------------------------------------------------
-te_expr *te_parser::list(te_parser::state *theState)
+te_parser::node_index te_parser::parse_list(te_parser::state *theState, const size_t depth)
 {
-	/* <list>      =    <expr> {"," <expr>} */
-	te_expr *ret = expr_level1(theState);
+	node_index ret = parse_expr(theState, depth, 1, true);
 
 	while (theState->m_type == te_parser::state::token_type::TOK_SEP)
 	{
 		next_token(theState);
 		ret = new_expr(TE_PURE, te_variant_type(te_builtins::te_comma),
-		               {ret, expr_level1(theState)});
+		               {ret, parse_expr(theState, depth, 1, true)});
 	}
 
 	return ret;
 }
 
-// Operator precedence, lowest to highest:
 //--------------------------------------------------
-te_expr *te_parser::expr_level1(te_parser::state *theState)
+te_parser::node_index te_parser::parse_expr(te_parser::state *theState, const size_t depth,
+                                            const int minPrecedence, const bool liftNegation)
 {
-	/* <expr>      =    <term> {(logic operations) <term>} */
-	// These are the lowest of operator precedence
-	// (once we have split tokens into arguments)
-	te_expr *ret = expr_level2(theState);
+	// (precedence climbing: each operator's right side is read with a higher minimum,
+	// or the same minimum if it groups from the right)
+	node_index ret = parse_power(theState, depth);
+	bool       isFirstOperand{liftNegation};
 
 	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       get_function2(theState->m_value) == te_builtins::te_or)
+	       theState->m_precedence >= minPrecedence)
 	{
 		const te_fun2 func = get_function2(theState->m_value);
+		const int     precedence{theState->m_precedence};
+		const bool    rightToLeft{theState->m_rightToLeft};
 		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, expr_level2(theState)});
-	}
-
-	return ret;
-}
 
-//--------------------------------------------------
-te_expr *te_parser::expr_level2(te_parser::state *theState)
-{
-	/* <expr>      =    <term> {(logic operations) <term>} */
-	// next to lowest in precedence...
-	te_expr *ret = expr_level3(theState);
+		// a negation in front of a right-to-left operator applies to its result (e.g., -2^2)
+		bool negate{false};
+		if (rightToLeft && isFirstOperand && m_nodes[ret].m_flags == TE_PURE &&
+		    is_function1(m_nodes[ret].m_value) &&
+		    get_function1(m_nodes[ret].m_value) == te_builtins::te_negate)
+		{
+			// (the negation node is left in the arena)
+			ret    = m_nodes.arg(ret, 0);
+			negate = true;
+		}
 
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       get_function2(theState->m_value) == te_builtins::te_and)
-	{
-		const te_fun2 func = get_function2(theState->m_value);
-		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, expr_level3(theState)});
+		// (the right side of a right-to-left operator is nested, as it can chain without end)
+		const auto right =
+		    rightToLeft ?
+		        parse_nested<parse_frame::step::EXPR>(theState, depth + 1, precedence, false) :
+		        parse_expr(theState, depth, precedence + 1, true);
+		ret = new_expr(TE_PURE, func, {ret, right});
+		if (negate)
+		{
+			ret = new_expr(TE_PURE, te_variant_type(te_builtins::te_negate), {ret});
+		}
+		isFirstOperand = false;
 	}
 
 	return ret;
 }
 
 //--------------------------------------------------
-te_expr *te_parser::expr_level3(te_parser::state *theState)
+te_parser::node_index te_parser::parse_power(te_parser::state *theState, const size_t depth)
 {
-	/* <expr>      =    <term> {(logic operations) <term>} */
-	// next to lowest in precedence...
-	te_expr *ret = expr_level4(theState);
-
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       get_function2(theState->m_value) == te_builtins::te_bitwise_or)
+	if (theState->m_type != te_parser::state::token_type::TOK_INFIX)
 	{
-		const te_fun2 func = get_function2(theState->m_value);
-		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, expr_level4(theState)});
+		return parse_base(theState, depth);
 	}
-
-	return ret;
+	const te_fun1 prefix = read_prefix(theState);
+	const auto    ret    = parse_base(theState, depth);
+	return (prefix != nullptr) ? new_expr(TE_PURE, te_variant_type(prefix), {ret}) : ret;
 }
 
 //--------------------------------------------------
-te_expr *te_parser::expr_level4(te_parser::state *theState)
+te_parser::node_index te_parser::parse_base(te_parser::state *theState, const size_t depth)
 {
-	/* <expr>      =    <term> {(logic operations) <term>} */
-	// next to lowest in precedence...
-	te_expr *ret = expr_level5(theState);
+	using token_type = te_parser::state::token_type;
+	using step       = parse_frame::step;
 
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       get_function2(theState->m_value) == te_builtins::te_bitwise_xor)
-	{
-		const te_fun2 func = get_function2(theState->m_value);
-		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, expr_level5(theState)});
-	}
-
-	return ret;
-}
+	node_index ret{te_node_arena::MISSING};
 
-//--------------------------------------------------
-te_expr *te_parser::expr_level5(te_parser::state *theState)
-{
-	/* <expr>      =    <term> {(logic operations) <term>} */
-	// next to lowest in precedence...
-	te_expr *ret = expr_level6(theState);
-
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       get_function2(theState->m_value) == te_builtins::te_bitwise_and)
+	if (theState->m_type == token_type::TOK_NUMBER || theState->m_type == token_type::TOK_VARIABLE)
 	{
-		const te_fun2 func = get_function2(theState->m_value);
-		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, expr_level6(theState)});
+		ret = read_value(theState);
 	}
-
-	return ret;
-}
-
-//--------------------------------------------------
-te_expr *te_parser::expr_level6(te_parser::state *theState)
-{
-	/* <expr>      =    <term> {(logic operations) <term>} */
-	// next to lowest in precedence...
-	te_expr *ret = expr_level7(theState);
-
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       (get_function2(theState->m_value) == te_builtins::te_equal ||
-	        get_function2(theState->m_value) == te_builtins::te_not_equal))
+	else if (theState->m_type == token_type::TOK_OPEN)
 	{
-		const te_fun2 func = get_function2(theState->m_value);
 		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, expr_level7(theState)});
+		ret = parse_nested<step::LIST>(theState, depth + 1);
+		read_close(theState);
 	}
-
-	return ret;
-}
-
-//--------------------------------------------------
-te_expr *te_parser::expr_level7(te_parser::state *theState)
-{
-	/* <expr>      =    <term> {(comparison operators) <term>} */
-	te_expr *ret = expr_level8(theState);
-
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       (get_function2(theState->m_value) == te_builtins::te_less_than ||
-	        get_function2(theState->m_value) == te_builtins::te_less_than_equal_to ||
-	        get_function2(theState->m_value) == te_builtins::te_greater_than ||
-	        get_function2(theState->m_value) == te_builtins::te_greater_than_equal_to))
+	else if (theState->m_type == token_type::TOK_NULL ||
+	         theState->m_type == token_type::TOK_ERROR ||
+	         theState->m_type == token_type::TOK_END || theState->m_type == token_type::TOK_SEP ||
+	         theState->m_type == token_type::TOK_CLOSE ||
+	         theState->m_type == token_type::TOK_INFIX)
 	{
-		const te_fun2 func = get_function2(theState->m_value);
-		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, expr_level8(theState)});
+		ret              = new_expr(TE_DEFAULT, te_variant_type{te_nan});
+		theState->m_type = token_type::TOK_ERROR;
 	}
-
-	return ret;
-}
-
-//--------------------------------------------------
-te_expr *te_parser::expr_level8(te_parser::state *theState)
-{
-	/* <expr>      =    <term> {("<<" | ">>") <term>} */
-	te_expr *ret = expr_level9(theState);
-
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       (get_function2(theState->m_value) == te_builtins::te_left_shift ||
-	        get_function2(theState->m_value) == te_builtins::te_right_shift
-#if __cplusplus >= 202002L && !defined(TE_FLOAT)
-	        || get_function2(theState->m_value) == te_builtins::te_left_rotate ||
-	        get_function2(theState->m_value) == te_builtins::te_right_rotate ||
-	        get_function2(theState->m_value) == te_builtins::te_left_rotate32 ||
-	        get_function2(theState->m_value) == te_builtins::te_right_rotate32 ||
-	        get_function2(theState->m_value) == te_builtins::te_left_rotate16 ||
-	        get_function2(theState->m_value) == te_builtins::te_right_rotate16 ||
-	        get_function2(theState->m_value) == te_builtins::te_left_rotate8 ||
-	        get_function2(theState->m_value) == te_builtins::te_right_rotate8
-#endif
-	        ))
+	else if (is_function0(theState->m_value) || is_closure0(theState->m_value))
 	{
-		const te_fun2 func = get_function2(theState->m_value);
+		ret                    = new_expr(theState->m_varType, theState->m_value);
+		m_nodes[ret].m_context = theState->context;
 		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, expr_level9(theState)});
+		if (theState->m_type == token_type::TOK_OPEN)
+		{
+			next_token(theState);
+			read_close(theState);
+		}
 	}
-
-	return ret;
-}
-
-//--------------------------------------------------
-te_expr *te_parser::expr_level9(te_parser::state *theState)
-{
-	/* <expr>      =    <term> {("+" | "-") <term>} */
-	te_expr *ret = term(theState);
-
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       (get_function2(theState->m_value) == te_builtins::te_add ||
-	        get_function2(theState->m_value) == te_builtins::te_sub))
+	else if (is_function1(theState->m_value) || is_closure1(theState->m_value))
 	{
-		const te_fun2 func = get_function2(theState->m_value);
+		ret                    = new_expr(theState->m_varType, theState->m_value);
+		m_nodes[ret].m_context = theState->context;
 		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, term(theState)});
-	}
-
-	return ret;
-}
-
-// Higher levels of operator precendence:
-//--------------------------------------------------
-te_expr *te_parser::term(te_parser::state *theState)
-{
-	/* <term>      =    <factor> {("*" | "/" | "%") <factor>} */
-	// third from highest level of operator precendence
-	te_expr *ret = factor(theState);
-
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       (get_function2(theState->m_value) == te_builtins::te_mul ||
-	        get_function2(theState->m_value) == te_builtins::te_divide ||
-	        get_function2(theState->m_value) == te_builtins::te_modulus))
-	{
-		const te_fun2 func = get_function2(theState->m_value);
+		// (a call and its own parentheses are one level, which the parentheses count)
+		const auto param =
+		    (theState->m_type == token_type::TOK_OPEN) ?
+		        parse_power(theState, depth) :
+		        parse_nested<step::POWER>(theState, depth + 1);
+		m_nodes.args(ret)[0] = param;
+	}
+	else if (is_function_variadic(theState->m_value))
+	{
+		// the node is added after its arguments, so that they can be stored together
+		const te_variant_type   func{theState->m_value};
+		const te_variable_flags flags{theState->m_varType};
+		const size_t            firstArg{m_variadicArgs.size()};
 		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, factor(theState)});
-	}
-
-	return ret;
-}
-
-//--------------------------------------------------
-#ifdef TE_POW_FROM_RIGHT
-te_expr *te_parser::factor(te_parser::state *theState)
-{
-	/* <factor>    =    <power> {"^" <power>} */
-	// second from highest level of operator precendence
-	te_expr *ret = power(theState);
 
-	int neg{0};
-
-	if (ret->m_type == TE_PURE && is_function1(ret->m_value) &&
-	    get_function1(ret->m_value) == te_builtins::te_negate)
-	{
-		te_expr *se = ret->m_parameters[0];
-		delete ret;
-		ret = se;
-		neg = 1;
+		if (theState->m_type != token_type::TOK_OPEN)
+		{
+			theState->m_type = token_type::TOK_ERROR;
+		}
+		else
+		{
+			// load however many arguments there are (at least one)
+			do
+			{
+				next_token(theState);
+				const auto arg = parse_nested<step::EXPR>(theState, depth + 1);
+				m_variadicArgs.push_back(arg);
+			} while (theState->m_type == token_type::TOK_SEP &&
+			         m_variadicArgs.size() - firstArg < te_node_arena::MAX_ARGUMENTS);
+			read_close(theState);
+		}
+		const auto args = std::span<const node_index>{m_variadicArgs}.subspan(firstArg);
+		ret             = m_nodes.add(func, flags, args.size());
+		std::copy(args.begin(), args.end(), m_nodes.args(ret).begin());
+		m_variadicArgs.resize(firstArg);
 	}
-
-	te_expr *insertion{nullptr};
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       (get_function2(theState->m_value) == static_cast<te_fun2>(te_builtins::te_pow)))
+	else if (is_function(theState->m_value) || is_closure(theState->m_value))
 	{
-		const te_fun2 t = get_function2(theState->m_value);
+		const auto arity = get_arity(theState->m_value);
+
+		ret                    = new_expr(theState->m_varType, theState->m_value);
+		m_nodes[ret].m_context = theState->context;
 		next_token(theState);
 
-		if (insertion)
+		if (theState->m_type != token_type::TOK_OPEN)
 		{
-			/* Make exponentiation go right-to-left. */
-			te_expr *insert            = new_expr(TE_PURE, t, {insertion->m_parameters[1], power(theState)});
-			insertion->m_parameters[1] = insert;
-			insertion                  = insert;
+			theState->m_type = token_type::TOK_ERROR;
 		}
 		else
 		{
-			ret       = new_expr(TE_PURE, t, {ret, power(theState)});
-			insertion = ret;
+			// If there are vars or other functions in the arguments, keep track of the original
+			// opening function; that is what we will do our variadic check on.
+			const bool              varValid{m_varFound};
+			const te_variable_flags openingVarType{m_currentVarType};
+			size_t                  argIndex{0};
+			for (;;)
+			{
+				next_token(theState);
+				const auto param            = parse_nested<step::EXPR>(theState, depth + 1);
+				m_nodes.args(ret)[argIndex] = param;
+				if (theState->m_type != token_type::TOK_SEP)
+				{
+					break;
+				}
+				// (reading every argument and still finding a separator counts as one past the end)
+				if (++argIndex == arity)
+				{
+					break;
+				}
+			}
+			read_call_end(theState, argIndex, arity, varValid, openingVarType);
 		}
 	}
 
-	if (neg)
-	{
-		ret = new_expr(TE_PURE, te_variant_type(te_builtins::te_negate), {ret});
-	}
-
 	return ret;
 }
-#else
-te_expr *te_parser::factor(te_parser::state *theState)
-{
-	/* <factor>    =    <power> {"^" <power>} */
-	// second from highest level of operator precendence
-	te_expr *ret = power(theState);
 
-	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
-	       is_function2(theState->m_value) &&
-	       (get_function2(theState->m_value) == static_cast<te_fun2>(te_builtins::te_pow)))
+//--------------------------------------------------
+te_parser::node_index te_parser::read_value(te_parser::state *theState)
+{
+	const auto ret = new_expr(TE_DEFAULT, theState->m_value);
+	if (theState->m_customConstant != nullptr)
 	{
-		const te_fun2 func = get_function2(theState->m_value);
-		next_token(theState);
-		ret = new_expr(TE_PURE, func, {ret, power(theState)});
+		m_constantPatches.m_leaves.emplace_back(ret, *theState->m_customConstant);
 	}
-
+	next_token(theState);
 	return ret;
 }
-#endif
 
 //--------------------------------------------------
-te_expr *te_parser::power(te_parser::state *theState)
+te_fun1 te_parser::read_prefix(te_parser::state *theState)
 {
-	/* <power>     =    {("-" | "+")} <base> */
-	// highest level of operator precendence
 	int  theSign{1};
 	bool bitwiseNot{false};
 	while (theState->m_type == te_parser::state::token_type::TOK_INFIX &&
@@ -2278,51 +2648,362 @@ te_expr *te_parser::power(te_parser::state *theState)
 		next_token(theState);
 	}
 
-	te_expr *ret{nullptr};
-
 	if (bitwiseNot)
 	{
-		ret = new_expr(TE_PURE, te_variant_type(te_builtins::te_bitwise_not), {base(theState)});
-	}
-	else if (theSign == -1)
-	{
-		ret = new_expr(TE_PURE, te_variant_type(te_builtins::te_negate), {base(theState)});
+		return te_builtins::te_bitwise_not;
 	}
-	else
+	if (theSign == -1)
 	{
-		ret = base(theState);
+		return te_builtins::te_negate;
 	}
-
-	return ret;
+	return nullptr;
 }
 
 //--------------------------------------------------
-// tuple-list-maker
-template <typename F, size_t... Indices>
-auto make_closure_arg_list(const F &fn, te_expr *ctx, std::index_sequence<Indices...>)
+void te_parser::read_call_end(te_parser::state *theState, const size_t argIndex,
+                              const size_t arity, const bool varValid,
+                              const te_variable_flags varType)
 {
-	return std::make_tuple(ctx, fn(Indices)...);
+	if (theState->m_type == te_parser::state::token_type::TOK_CLOSE && (argIndex != arity - 1) &&
+	    varValid && is_variadic(varType))
+	{
+		next_token(theState);
+	}
+	else if (argIndex != arity - 1)
+	{
+		theState->m_type = te_parser::state::token_type::TOK_ERROR;
+	}
+	else
+	{
+		read_close(theState);
+	}
 }
 
-template <typename F, size_t... Indices>
-auto make_function_arg_list(const F &fn, std::index_sequence<Indices...>)
+//--------------------------------------------------
+void te_parser::read_close(te_parser::state *theState)
 {
-	return std::make_tuple(fn(Indices)...);
+	if (theState->m_type != te_parser::state::token_type::TOK_CLOSE)
+	{
+		theState->m_type = te_parser::state::token_type::TOK_ERROR;
+	}
+	else
+	{
+		next_token(theState);
+	}
 }
 
-te_type te_parser::te_eval(const te_expr *texp)
+//--------------------------------------------------
+te_parser::node_index te_parser::parse_deep(te_parser::state *theState,
+                                            const parse_frame::step rule, const size_t depth,
+                                            const int minPrecedence, const bool liftNegation)
 {
-	if (texp == nullptr)
-	{
-		return te_nan;
+	using token_type = te_parser::state::token_type;
+	using step       = parse_frame::step;
+
+	// (variadic arguments share m_variadicArgs with the recursive parser, which may be
+	// partway through a call, so that is only ever added to and trimmed back)
+	auto &frames = m_parseFrames;
+	frames.clear();
+	auto &variadicArgs = m_variadicArgs;
+	// what the last rule that was finished read
+	node_index result{te_node_arena::MISSING};
+	// Starts reading a rule, and then continues the current one from the next step.
+	// (Nesting too deeply reads an error instead, which stops the parse.)
+	const auto read = [&](step readRule, const step next, const bool nested,
+	                      const int readMinPrecedence = 1, const bool readLiftNegation = true)
+	{
+		frames.back().m_step = next;
+		const size_t readDepth{frames.back().m_depth + (nested ? 1 : 0)};
+		if (readDepth > m_maxDepth)
+		{
+			result                    = new_expr(TE_DEFAULT, te_variant_type{te_nan});
+			theState->m_type          = token_type::TOK_ERROR;
+			theState->m_depthExceeded = true;
+			return;
+		}
+		// operands that are just a constant or variable are read right away
+		// (rather than through a frame for each rule down to them)
+		if ((readRule == step::EXPR || readRule == step::POWER) &&
+		    (theState->m_type == token_type::TOK_NUMBER ||
+		     theState->m_type == token_type::TOK_VARIABLE))
+		{
+			result = read_value(theState);
+			if (readRule == step::POWER || theState->m_type != token_type::TOK_INFIX ||
+			    theState->m_precedence < readMinPrecedence)
+			{
+				return;
+			}
+			readRule = step::EXPR_OPERAND;
+		}
+		// and a power without a prefix operator is just its base
+		else if (readRule == step::POWER && theState->m_type != token_type::TOK_INFIX)
+		{
+			readRule = step::BASE;
+		}
+		auto &frame            = frames.emplace_back(parse_frame{readRule, readDepth});
+		frame.m_minPrecedence  = readMinPrecedence;
+		frame.m_isFirstOperand = readLiftNegation;
+	};
+	const auto finish = [&frames, &result](const node_index node)
+	{
+		result = node;
+		frames.pop_back();
+	};
+
+	auto &first            = frames.emplace_back(parse_frame{rule, depth});
+	first.m_minPrecedence  = minPrecedence;
+	first.m_isFirstOperand = liftNegation;
+	while (!frames.empty())
+	{
+		// (reading another rule adds a frame, so this is only used until then)
+		auto &frame = frames.back();
+		switch (frame.m_step)
+		{
+			case step::LIST:
+				read(step::EXPR, step::LIST_FIRST, false);
+				break;
+			case step::LIST_FIRST:
+			case step::LIST_NEXT:
+				frame.m_node = (frame.m_step == step::LIST_FIRST) ?
+				                   result :
+				                   new_expr(TE_PURE, te_variant_type(te_builtins::te_comma),
+				                            {frame.m_node, result});
+				if (theState->m_type == token_type::TOK_SEP)
+				{
+					next_token(theState);
+					read(step::EXPR, step::LIST_NEXT, false);
+				}
+				else
+				{
+					finish(frame.m_node);
+				}
+				break;
+
+			// operators are grouped by precedence climbing: each one's right side is read with a
+			// higher minimum precedence, or the same minimum if it groups from the right
+			case step::EXPR:
+				read(step::POWER, step::EXPR_OPERAND, false);
+				break;
+			case step::EXPR_OPERAND:
+			case step::EXPR_RIGHT:
+				if (frame.m_step == step::EXPR_OPERAND)
+				{
+					frame.m_node = result;
+				}
+				else
+				{
+					frame.m_node = new_expr(TE_PURE, frame.m_operator, {frame.m_node, result});
+					if (frame.m_negate)
+					{
+						frame.m_node = new_expr(TE_PURE, te_variant_type(te_builtins::te_negate),
+						                        {frame.m_node});
+					}
+					frame.m_isFirstOperand = false;
+				}
+				if (theState->m_type == token_type::TOK_INFIX &&
+				    theState->m_precedence >= frame.m_minPrecedence)
+				{
+					frame.m_operator = get_function2(theState->m_value);
+					const int  precedence{theState->m_precedence};
+					const bool rightToLeft{theState->m_rightToLeft};
+					next_token(theState);
+
+					// a negation in front of a right-to-left operator applies to its result
+					// (e.g., -2^2)
+					frame.m_negate = false;
+					if (rightToLeft && frame.m_isFirstOperand &&
+					    m_nodes[frame.m_node].m_flags == TE_PURE &&
+					    is_function1(m_nodes[frame.m_node].m_value) &&
+					    get_function1(m_nodes[frame.m_node].m_value) == te_builtins::te_negate)
+					{
+						// (the negation node is left in the arena)
+						frame.m_node   = m_nodes.arg(frame.m_node, 0);
+						frame.m_negate = true;
+					}
+					read(step::EXPR, step::EXPR_RIGHT, rightToLeft,
+					     rightToLeft ? precedence : precedence + 1, !rightToLeft);
+				}
+				else
+				{
+					finish(frame.m_node);
+				}
+				break;
+
+			case step::POWER:
+				frame.m_prefix = read_prefix(theState);
+				read(step::BASE, step::POWER_OPERAND, false);
+				break;
+			case step::POWER_OPERAND:
+				finish((frame.m_prefix != nullptr) ?
+				           new_expr(TE_PURE, te_variant_type(frame.m_prefix), {result}) :
+				           result);
+				break;
+
+			case step::BASE:
+				if (theState->m_type == token_type::TOK_OPEN)
+				{
+					next_token(theState);
+					read(step::LIST, step::BASE_PARENS, true);
+				}
+				else if (theState->m_type == token_type::TOK_NUMBER ||
+				         theState->m_type == token_type::TOK_VARIABLE)
+				{
+					finish(read_value(theState));
+				}
+				else if (theState->m_type == token_type::TOK_NULL ||
+				         theState->m_type == token_type::TOK_ERROR ||
+				         theState->m_type == token_type::TOK_END ||
+				         theState->m_type == token_type::TOK_SEP ||
+				         theState->m_type == token_type::TOK_CLOSE ||
+				         theState->m_type == token_type::TOK_INFIX)
+				{
+					theState->m_type = token_type::TOK_ERROR;
+					finish(new_expr(TE_DEFAULT, te_variant_type{te_nan}));
+				}
+				else if (is_function0(theState->m_value) || is_closure0(theState->m_value))
+				{
+					const auto ret         = new_expr(theState->m_varType, theState->m_value);
+					m_nodes[ret].m_context = theState->context;
+					next_token(theState);
+					if (theState->m_type == token_type::TOK_OPEN)
+					{
+						next_token(theState);
+						read_close(theState);
+					}
+					finish(ret);
+				}
+				else if (is_function1(theState->m_value) || is_closure1(theState->m_value))
+				{
+					frame.m_node = new_expr(theState->m_varType, theState->m_value);
+					m_nodes[frame.m_node].m_context = theState->context;
+					next_token(theState);
+					// (a call and its own parentheses are one level, which the parentheses count)
+					read(step::POWER, step::BASE_OPERAND,
+					     theState->m_type != token_type::TOK_OPEN);
+				}
+				else if (is_function_variadic(theState->m_value))
+				{
+					// the node is added after its arguments, so that they can be stored together
+					frame.m_function = theState->m_value;
+					frame.m_varType  = theState->m_varType;
+					frame.m_argIndex = variadicArgs.size();
+					next_token(theState);
+
+					if (theState->m_type != token_type::TOK_OPEN)
+					{
+						theState->m_type = token_type::TOK_ERROR;
+						finish(m_nodes.add(frame.m_function, frame.m_varType, 0));
+					}
+					else
+					{
+						// load however many arguments there are (at least one)
+						next_token(theState);
+						read(step::EXPR, step::BASE_VARIADIC_ARG, true);
+					}
+				}
+				else if (is_function(theState->m_value) || is_closure(theState->m_value))
+				{
+					frame.m_arity = get_arity(theState->m_value);
+					frame.m_node  = new_expr(theState->m_varType, theState->m_value);
+					m_nodes[frame.m_node].m_context = theState->context;
+					next_token(theState);
+
+					if (theState->m_type != token_type::TOK_OPEN)
+					{
+						theState->m_type = token_type::TOK_ERROR;
+						finish(frame.m_node);
+					}
+					else
+					{
+						// If there are vars or other functions in the arguments, keep track of the
+						// original opening function; that is what we will do our variadic check on.
+						frame.m_varValid = m_varFound;
+						frame.m_varType  = m_currentVarType;
+						frame.m_argIndex = 0;
+						next_token(theState);
+						read(step::EXPR, step::BASE_ARG, true);
+					}
+				}
+				else
+				{
+					finish(te_node_arena::MISSING);
+				}
+				break;
+			case step::BASE_PARENS:
+				read_close(theState);
+				finish(result);
+				break;
+			case step::BASE_OPERAND:
+				m_nodes.args(frame.m_node)[0] = result;
+				finish(frame.m_node);
+				break;
+			case step::BASE_VARIADIC_ARG:
+				variadicArgs.push_back(result);
+				if (theState->m_type == token_type::TOK_SEP &&
+				    variadicArgs.size() - frame.m_argIndex < te_node_arena::MAX_ARGUMENTS)
+				{
+					next_token(theState);
+					read(step::EXPR, step::BASE_VARIADIC_ARG, true);
+				}
+				else
+				{
+					read_close(theState);
+					const auto args =
+					    std::span<const node_index>{variadicArgs}.subspan(frame.m_argIndex);
+					const auto ret = m_nodes.add(frame.m_function, frame.m_varType, args.size());
+					std::copy(args.begin(), args.end(), m_nodes.args(ret).begin());
+					variadicArgs.resize(frame.m_argIndex);
+					finish(ret);
+				}
+				break;
+			case step::BASE_ARG:
+				m_nodes.args(frame.m_node)[frame.m_argIndex] = result;
+				if (theState->m_type == token_type::TOK_SEP && frame.m_argIndex + 1 < frame.m_arity)
+				{
+					++frame.m_argIndex;
+					next_token(theState);
+					read(step::EXPR, step::BASE_ARG, true);
+					break;
+				}
+				// (reading every argument and still finding a separator counts as one past the end)
+				if (theState->m_type == token_type::TOK_SEP)
+				{
+					++frame.m_argIndex;
+				}
+				read_call_end(theState, frame.m_argIndex, frame.m_arity, frame.m_varValid,
+				              frame.m_varType);
+				finish(frame.m_node);
+				break;
+		}
 	}
 
+	return result;
+}
+
+//--------------------------------------------------
+// tuple-list-maker
+template <typename F, size_t... Indices>
+auto make_closure_arg_list(const F &fn, const te_expr *ctx, std::index_sequence<Indices...>)
+{
+	return std::make_tuple(ctx, fn(Indices)...);
+}
+
+template <typename F, size_t... Indices>
+auto make_function_arg_list(const F &fn, std::index_sequence<Indices...>)
+{
+	return std::make_tuple(fn(Indices)...);
+}
+
+te_type te_parser::te_eval(const node_index texp) const
+{
+	const auto &node = m_nodes[texp];
+
 	// NOLINTBEGIN
 	// cppcheck-suppress unreadVariable
-	const auto M = [&texp = std::as_const(texp)](const size_t e) { return (e < texp->m_parameters.size()) ? te_eval(texp->m_parameters[e]) : te_nan; };
+	const auto M = [this, texp](const size_t e) { return te_eval(m_nodes.arg(texp, e)); };
 
 	return std::visit(
-	    [&, texp](const auto &var) -> te_type {
+	    [&](const auto &var) -> te_type {
 		    using T = std::decay_t<decltype(var)>;
 		    if constexpr (te_is_constant_v<T>)
 		    {
@@ -2338,14 +3019,22 @@ te_type te_parser::te_eval(const te_expr *texp)
 		    }
 		    else if constexpr (std::is_same_v<T, te_confun0>)
 		    {
-			    return var(texp->m_parameters[0]);
+			    return var(node.m_context);
+		    }
+		    else if constexpr (std::is_same_v<T, te_funv>)
+		    {
+			    const auto           params = m_nodes.args(texp);
+			    std::vector<te_type> args(params.size());
+			    std::transform(params.begin(), params.end(), args.begin(),
+			                   [this](const node_index param) { return te_eval(param); });
+			    return var(args.data(), args.size());
 		    }
 		    else if constexpr (te_is_closure_v<T>)
 		    {
 			    constexpr size_t n_args = te_function_arity<T>;
 			    static_assert(n_args > 0);
 			    return std::apply(var,
-			                      make_closure_arg_list(M, texp->m_parameters[n_args - 1],
+			                      make_closure_arg_list(M, node.m_context,
 			                                            std::make_index_sequence<n_args - 1>{}));
 		    }
 		    else if constexpr (te_is_function_v<T>)
@@ -2359,223 +3048,2729 @@ te_type te_parser::te_eval(const te_expr *texp)
 			    return te_nan;
 		    }
 	    },
-	    texp->m_value);
+	    node.m_value);
 	// NOLINTEND
 }
 
 //--------------------------------------------------
-void te_parser::optimize(te_expr *texp)
+bool te_parser::is_lazy_function(const te_variant_type &value) noexcept
+{
+	if (is_function2(value))
+	{
+		return (get_function2(value) == te_builtins::te_and ||
+		        get_function2(value) == te_builtins::te_or);
+	}
+	if (const auto *const func3 = std::get_if<te_fun3>(&value); func3 != nullptr)
+	{
+		return (*func3 == te_builtins::te_if);
+	}
+	if (is_function_variadic(value))
+	{
+		return (get_function_variadic(value) == te_builtins::te_ifs ||
+		        get_function_variadic(value) == te_builtins::te_and_variadic ||
+		        get_function_variadic(value) == te_builtins::te_or_variadic);
+	}
+	return false;
+}
+
+//--------------------------------------------------
+void te_parser::optimize(const node_index texp, const size_t depth, const bool skippable)
 {
-	if (texp == nullptr)
+	// deep subtrees (e.g., long chains of operators) are folded without recursing
+	if (depth >= MAX_RECURSIVE_FOLDING_DEPTH)
 	{
+		optimize_deep(texp, skippable);
 		return;
 	}
+	const auto &node = m_nodes[texp];
 	/* Evaluates as much as possible. */
-	if (is_constant(texp->m_value) || is_variable(texp->m_value))
+	if (is_constant(node.m_value) || is_variable(node.m_value))
 	{
 		return;
 	}
 
 	/* Only optimize out functions flagged as pure. */
-	if (is_pure(texp->m_type))
+	if (is_pure(static_cast<te_variable_flags>(node.m_flags)))
 	{
-		const auto arity = get_arity(texp->m_value);
+		// (optimizing never adds nodes, so these stay valid)
+		const auto params = m_nodes.args(texp);
+		const bool lazy{params.size() > 1 && is_lazy_function(node.m_value)};
 		bool       known{true};
-		for (std::decay<decltype(arity)>::type i = 0; i < arity; ++i)
+		for (size_t i = 0; i < params.size(); ++i)
 		{
-			if (texp->m_parameters[i] == nullptr)
-			{
-				break;
-			}
-			optimize(texp->m_parameters[i]);
-			if (!is_constant(texp->m_parameters[i]->m_value))
+			optimize(params[i], depth + 1, skippable || (lazy && i > 0));
+			if (!is_constant(m_nodes[params[i]].m_value))
 			{
 				known = false;
 			}
 		}
 		if (known)
 		{
-			const auto value = te_eval(texp);
-			te_free_parameters(texp);
-			texp->m_type  = TE_DEFAULT;
-			texp->m_value = value;
+			fold_node(texp, skippable);
 		}
 	}
 }
 
 //--------------------------------------------------
-te_expr *te_parser::te_compile(const std::string_view expression, std::set<te_variable> &variables)
+void te_parser::optimize_deep(const node_index texp, const bool skippable)
 {
-	state theState(expression.data(), TE_DEFAULT, variables);
-
-	next_token(&theState);
-	te_expr *root = list(&theState);
-
-	if (theState.m_type != te_parser::state::token_type::TOK_END)
-	{
-		te_free(root);
-		m_errorPos = (theState.m_next - theState.m_start);
-		if (m_errorPos > 0)
+	// Each node is visited twice: once to queue its arguments, and again after they are
+	// optimized. (Only the arguments of pure functions are optimized.)
+	auto &pending = m_pendingNodes;
+	pending.assign(1, {texp, false});
+	// the nodes that may not be evaluated (only filled in once one is found)
+	std::vector<uint8_t> skippableNodes;
+	if (skippable)
+	{
+		skippableNodes.assign(m_nodes.size(), 0);
+		skippableNodes[texp] = 1;
+	}
+	while (!pending.empty())
+	{
+		const auto [current, argumentsDone] = pending.back();
+		pending.pop_back();
+		const auto &node = m_nodes[current];
+		if (is_constant(node.m_value) || is_variable(node.m_value) ||
+		    !is_pure(static_cast<te_variable_flags>(node.m_flags)))
 		{
-			--m_errorPos;
+			continue;
+		}
+		const auto params = m_nodes.args(current);
+		const bool isSkippable{!skippableNodes.empty() && skippableNodes[current] != 0};
+		if (!argumentsDone && !params.empty())
+		{
+			if (isSkippable || is_lazy_function(node.m_value))
+			{
+				if (skippableNodes.empty())
+				{
+					skippableNodes.assign(m_nodes.size(), 0);
+				}
+				for (size_t i = (isSkippable ? 0 : 1); i < params.size(); ++i)
+				{
+					skippableNodes[params[i]] = 1;
+				}
+			}
+			pending.emplace_back(current, true);
+			// (queued in reverse, so that they are optimized in order)
+			for (auto param = params.rbegin(); param != params.rend(); ++param)
+			{
+				pending.emplace_back(*param, false);
+			}
+			continue;
+		}
+		if (std::all_of(params.begin(), params.end(), [this](const node_index param)
+		                { return is_constant(m_nodes[param].m_value); }))
+		{
+			fold_node(current, isSkippable);
 		}
-		return nullptr;
 	}
-
-	optimize(root);
-	m_errorPos = te_parser::npos;
-	return root;
 }
 
 //--------------------------------------------------
-bool te_parser::compile(const std::string_view expression)
+void te_parser::fold_node(const node_index texp, const bool skippable)
 {
-	reset_state();
-	if (get_list_separator() == get_decimal_separator())
+	auto   &node = m_nodes[texp];
+	te_type value{0};
+	try
 	{
-		throw std::runtime_error("List and decimal separators cannot be the same.");
+		value = te_eval(texp);
 	}
-	if (expression.empty())
+	catch (const std::exception &)
 	{
-		m_expression.clear();
-		m_errorPos = 0;
-		return false;
+		// (e.g., "if(a, 2, 1/0)" only fails if a is false)
+		if (skippable)
+		{
+			return;
+		}
+		throw;
 	}
-	m_expression.assign(expression);
-
-	// In case the expression was a spreadsheet formula like "=SUM(...)",
-	// remove the '=' in front.
-	if ((m_expression.length() > 0) && m_expression.front() == '=')
+	// remember how it was folded, if it depends on a custom constant
+	const auto params  = m_nodes.args(texp);
+	auto      &origins = m_constantPatches.m_origins;
+	if (std::any_of(params.begin(), params.end(),
+	                [&origins](const node_index param) { return origins[param] != 0; }))
 	{
-		m_expression.erase(0, 1);
+		m_constantPatches.m_foldedNodes.emplace_back(texp, node);
+		origins[texp] = constant_patches::FOLDED_ORIGIN;
 	}
+	// (the arguments are left in the arena)
+	node.m_argCount = 0;
+	node.m_flags    = TE_DEFAULT;
+	node.m_value    = value;
+}
 
-	size_t commentStart{0};
-	while (commentStart != std::string::npos)
-	{
-		commentStart = m_expression.find('/', commentStart);
-		if (commentStart == std::string::npos || commentStart == m_expression.length() - 1)
+//--------------------------------------------------
+void te_parser::reassociate(const node_index texp)
+{
+	// the operator of a chain that can be regrouped, or null if the node isn't one
+	const auto chainFunction = [this](const node_index node) -> te_fun2
+	{
+		const auto &chainNode = m_nodes[node];
+		if (chainNode.m_flags == TE_PURE && chainNode.m_argCount == 2 &&
+		    is_function2(chainNode.m_value) &&
+		    (get_function2(chainNode.m_value) == te_builtins::te_add ||
+		     get_function2(chainNode.m_value) == te_builtins::te_mul))
 		{
-			break;
+			return get_function2(chainNode.m_value);
 		}
-		// remove multi-line comments
-		if (m_expression[commentStart + 1] == '*')
+		return nullptr;
+	};
+
+	std::vector<node_index> pending{texp};
+	// the terms of the chain being rebuilt (in order), and the nodes that combined them
+	std::vector<node_index> operands;
+	std::vector<node_index> operators;
+	std::vector<node_index> chain;
+	while (!pending.empty())
+	{
+		const auto current = pending.back();
+		pending.pop_back();
+		const auto func = chainFunction(current);
+		if (func == nullptr)
+		{
+			pending.insert(pending.end(), m_nodes.args(current).begin(),
+			               m_nodes.args(current).end());
+			continue;
+		}
+
+		// flatten the chain, however it was grouped
+		operands.clear();
+		operators.clear();
+		chain.assign(1, current);
+		while (!chain.empty())
 		{
-			auto commentEnd = m_expression.find("*/", commentStart);
-			if (commentEnd == std::string::npos)
+			const auto node = chain.back();
+			chain.pop_back();
+			if (chainFunction(node) == func)
 			{
-				m_errorPos     = static_cast<decltype(m_errorPos)>(commentStart);
-				m_parseSuccess = false;
-				m_result       = te_nan;
-				return false;
+				operators.push_back(node);
+				chain.push_back(m_nodes.arg(node, 1));
+				chain.push_back(m_nodes.arg(node, 0));
 			}
-			m_expression.erase(commentStart, (commentEnd + 2) - commentStart);
+			else
+			{
+				operands.push_back(node);
+			}
+		}
+		// (the terms may have chains of their own)
+		pending.insert(pending.end(), operands.cbegin(), operands.cend());
+		if (operands.size() < 4)
+		{
+			continue;
 		}
-		// remove single-line comments
-		else if (m_expression[commentStart + 1] == '/')
+
+		// combine neighboring terms in pairs, and then those in pairs, until one is left
+		// (the chain's first node is combined last, so that it stays the root)
+		auto nextOperator = operators.crbegin();
+		while (operands.size() > 1)
 		{
-			auto commentEnd = m_expression.find_first_of("\n\r", commentStart);
-			if (commentEnd == std::string::npos)
+			size_t paired{0};
+			for (size_t i = 0; i + 1 < operands.size(); i += 2)
 			{
-				m_expression.erase(commentStart);
-				break;
+				const auto node       = *nextOperator++;
+				m_nodes.args(node)[0] = operands[i];
+				m_nodes.args(node)[1] = operands[i + 1];
+				operands[paired++]    = node;
+			}
+			if (operands.size() % 2 != 0)
+			{
+				operands[paired++] = operands.back();
 			}
-			m_expression.erase(commentStart, commentEnd - commentStart);
+			operands.resize(paired);
 		}
-		else
+	}
+}
+
+//--------------------------------------------------
+te_parser::node_index
+te_parser::share_subexpressions(const node_index texp)
+{
+	// Each node is visited twice: once to queue its arguments, and again after they are
+	// merged, when what they were merged into is at the end of the results.
+	auto &pending = m_pendingNodes;
+	pending.assign(1, {texp, false});
+	auto &merged = m_nodeStack;
+	merged.clear();
+	while (!pending.empty())
+	{
+		const auto [current, argumentsDone] = pending.back();
+		pending.pop_back();
+		// (sharing never adds nodes, so these stay valid)
+		const auto params = m_nodes.args(current);
+		if (!argumentsDone && !params.empty())
 		{
-			++commentStart;
+			pending.emplace_back(current, true);
+			for (auto param = params.rbegin(); param != params.rend(); ++param)
+			{
+				pending.emplace_back(*param, false);
+			}
+			continue;
 		}
+		std::copy(merged.cend() - static_cast<std::ptrdiff_t>(params.size()), merged.cend(),
+		          params.begin());
+		merged.resize(merged.size() - params.size());
+		merged.push_back(find_shared_node(current));
 	}
+	return merged.back();
+}
 
-	try
+//--------------------------------------------------
+te_parser::node_index
+te_parser::find_shared_node(const node_index texp)
+{
+	const auto params = m_nodes.args(texp);
+	// only pure functions are safe to call once in place of several times
+	const auto &node = m_nodes[texp];
+	if (texp == te_node_arena::MISSING ||
+	    !(is_constant(node.m_value) || is_variable(node.m_value) ||
+	      is_pure(static_cast<te_variable_flags>(node.m_flags))))
 	{
-		m_compiledExpression = te_compile(m_expression, get_variables_and_functions());
-		m_parseSuccess       = (m_compiledExpression != nullptr);
+		return texp;
 	}
-	catch (const std::exception &expt)
+	// constants folded from custom constants can change independently of each other,
+	// and ones read from custom constants are only the same if they have the same name
+	const auto origin = m_constantPatches.get_origin(texp);
+	if (origin == constant_patches::FOLDED_ORIGIN)
 	{
-		m_parseSuccess     = false;
-		m_result           = te_nan;
-		m_lastErrorMessage = expt.what();
+		return texp;
 	}
+	const auto constantName = [this](const uint32_t nodeOrigin)
+	{ return std::string_view{m_constantPatches.m_leaves[nodeOrigin - 1].second}; };
 
-	reset_usr_resolved_if_necessary();
-
-	return m_parseSuccess;
-}
-
-//--------------------------------------------------
-te_type te_parser::evaluate()
-{
-	try
+	size_t     hashValue{node.m_value.index()};
+	const auto combine = [&hashValue](const size_t value)
+	{ hashValue ^= value + 0x9E3779B9 + (hashValue << 6) + (hashValue >> 2); };
+	if (origin != 0)
 	{
-		if (m_expression.empty())
-		{
-			m_parseSuccess     = false;
-			m_errorPos         = 0;
-			m_lastErrorMessage = "Expression is emtpy.";
-		}
-		m_result = (m_compiledExpression != nullptr) ? te_eval(m_compiledExpression) : te_nan;
+		combine(te_symbol_index::hash(constantName(origin)));
 	}
-	catch (const std::exception &expt)
+	else if (is_constant(node.m_value))
 	{
-		m_parseSuccess     = false;
-		m_result           = te_nan;
-		m_lastErrorMessage = expt.what();
+		combine(std::hash<te_type>{}(get_constant(node.m_value)));
+	}
+	else if (is_variable(node.m_value))
+	{
+		combine(std::hash<const te_type *>{}(get_variable(node.m_value)));
+	}
+	combine(std::hash<const te_expr *>{}(node.m_context));
+	combine(node.m_flags);
+	for (const auto param : params)
+	{
+		// (the arguments have already been merged, so equal arguments have equal indices)
+		combine(param);
 	}
 
-	reset_usr_resolved_if_necessary();
-
-	return m_result;
+	const auto isSameNode = [this, &node, params, origin, &constantName](const node_index other)
+	{
+		const auto &otherNode   = m_nodes[other];
+		const auto  otherOrigin = m_constantPatches.get_origin(other);
+		if (origin != 0 || otherOrigin != 0)
+		{
+			return (origin != 0 && otherOrigin != 0 &&
+			        !te_string_less{}(constantName(origin), constantName(otherOrigin)) &&
+			        !te_string_less{}(constantName(otherOrigin), constantName(origin)));
+		}
+		if (is_constant(node.m_value) && is_constant(otherNode.m_value))
+		{
+			// 0 and -0 are equal, but aren't interchangeable (e.g., as divisors)
+			const auto value      = get_constant(node.m_value);
+			const auto otherValue = get_constant(otherNode.m_value);
+			return (value == otherValue && std::signbit(value) == std::signbit(otherValue));
+		}
+		const auto otherParams = m_nodes.args(other);
+		return (otherNode.m_value == node.m_value && otherNode.m_context == node.m_context &&
+		        otherNode.m_flags == node.m_flags &&
+		        std::equal(params.begin(), params.end(), otherParams.begin(), otherParams.end()));
+	};
+	// (every node is registered at most once, so the table can't fill up)
+	const size_t mask = m_sharedNodes.size() - 1;
+	size_t position   = hashValue & mask;
+	while (m_sharedNodes[position].m_node != te_node_arena::MISSING)
+	{
+		const auto &shared = m_sharedNodes[position];
+		if (shared.m_hash == hashValue && isSameNode(shared.m_node))
+		{
+			return shared.m_node;
+		}
+		position = (position + 1) & mask;
+	}
+	m_sharedNodes[position] = shared_node{hashValue, texp};
+	return texp;
 }
 
 //--------------------------------------------------
-te_type
-    te_parser::evaluate(const std::string_view expression)        // NOLINT(-readability-identifier-naming)
+void te_parser::reset_shared_nodes()
 {
-	if (compile(expression))
+	size_t capacity{16};
+	while (capacity < m_nodes.size() * 2)
 	{
-		return evaluate();
+		capacity *= 2;
 	}
+	m_sharedNodes.assign(capacity, shared_node{});
+}
 
-	if (expression.empty())
+//--------------------------------------------------
+bool te_parser::can_share_subexpressions() const noexcept
+{
+	// a repeated subtree needs a parent to be repeated in, so the smallest tree that can
+	// hold one is something like "f(x)+f(x)" (leaves are only read, so sharing them is moot)
+	size_t functionNodes{0};
+	for (size_t i = 1; i < m_nodes.size(); ++i)
 	{
-		m_parseSuccess     = false;
-		m_errorPos         = 0;
-		m_lastErrorMessage = "Expression is emtpy.";
+		if (m_nodes[static_cast<node_index>(i)].m_argCount > 0 && ++functionNodes == 3)
+		{
+			return true;
+		}
 	}
-
-	return te_nan;
+	return false;
 }
 
 //--------------------------------------------------
-// cppcheck-suppress unusedFunction
-std::string te_parser::list_available_functions_and_variables()
+void te_parser::count_node_uses(const node_index texp)
 {
-	std::string report = "Built-in Functions:\n";
-	for (const auto &func : m_functions)
+	auto &pending = m_nodeStack;
+	pending.assign(1, texp);
+	while (!pending.empty())
 	{
-		report.append(func.m_name).append("\n");
-	}
-	report.append("\nCustom Functions & Variables:\n");
-	for (const auto &func : get_variables_and_functions())
-	{
-		report.append(func.m_name).append("\n");
+		const auto current = pending.back();
+		pending.pop_back();
+		if (m_nodeSharing[current].m_uses++ == 0)
+		{
+			pending.insert(pending.end(), m_nodes.args(current).begin(),
+			               m_nodes.args(current).end());
+		}
 	}
-	return report;
 }
 
 //--------------------------------------------------
-// cppcheck-suppress unusedFunction
-std::string te_parser::info()
+bool te_parser::mark_cached_subtrees(const node_index texp, std::vector<uint8_t> &purity)
 {
-	std::string sysInfo{"tinyexpr++ system info:\n=======================\n"};
-#ifdef TE_FLOAT
-	sysInfo += "Data type:                float\n";
-#elif defined(TE_LONG_DOUBLE)
-	sysInfo += "Data type:                long double\n";
-#else
+	// (0 is not visited yet, 1 is pure, and 2 is not)
+	// Each node is visited twice: once to queue its arguments, and again after they are marked.
+	auto &pending = m_pendingNodes;
+	pending.assign(1, {texp, false});
+	while (!pending.empty())
+	{
+		const auto [current, argumentsDone] = pending.back();
+		pending.pop_back();
+		if (purity[current] != 0)
+		{
+			continue;
+		}
+		const auto params = m_nodes.args(current);
+		if (!argumentsDone && !params.empty())
+		{
+			pending.emplace_back(current, true);
+			for (auto param = params.rbegin(); param != params.rend(); ++param)
+			{
+				pending.emplace_back(*param, false);
+			}
+			continue;
+		}
+
+		const auto &node   = m_nodes[current];
+		bool        isPure = (is_constant(node.m_value) || is_variable(node.m_value) ||
+		                      is_pure(static_cast<te_variable_flags>(node.m_flags)));
+		auto       &variables = m_nodeVariables[current];
+		if (is_variable(node.m_value))
+		{
+			variables.push_back(get_variable(node.m_value));
+		}
+		for (const auto param : params)
+		{
+			if (purity[param] != 1)
+			{
+				isPure = false;
+			}
+			variables.insert(variables.end(), m_nodeVariables[param].cbegin(),
+			                 m_nodeVariables[param].cend());
+		}
+		std::sort(variables.begin(), variables.end());
+		variables.erase(std::unique(variables.begin(), variables.end()), variables.end());
+
+		for (const auto param : params)
+		{
+			if (purity[param] == 1 && m_nodes[param].m_argCount > 0 &&
+			    !m_nodeVariables[param].empty() && m_nodeVariables[param].size() < variables.size())
+			{
+				m_nodeSharing[param].m_cached = true;
+			}
+		}
+
+		purity[current] = isPure ? 1 : 2;
+	}
+	return (purity[texp] == 1);
+}
+
+//--------------------------------------------------
+// trampolines for calling functions with their arguments laid out on the evaluation stack
+template <typename FuncType, size_t... Indices>
+static te_type te_invoke_function(const FuncType func, const te_type *args,
+                                  std::index_sequence<Indices...>)
+{
+	return func(args[Indices]...);
+}
+
+template <typename FuncType, size_t... Indices>
+static te_type te_invoke_closure(const FuncType func, const te_expr *context, const te_type *args,
+                                 std::index_sequence<Indices...>)
+{
+	return func(context, args[Indices]...);
+}
+
+template <size_t Index>
+static te_type te_call_thunk(const te_variant_type &func, const te_expr *context,
+                             [[maybe_unused]] const te_type *args)
+{
+	using T = std::variant_alternative_t<Index, te_variant_type>;
+	if constexpr (std::is_same_v<T, te_funv>)
+	{
+		// variadic functions need their argument count, so they are called by OP_CALLV instead
+		return te_parser::te_nan;
+	}
+	else if constexpr (te_is_closure_v<T>)
+	{
+		return te_invoke_closure(*std::get_if<Index>(&func), context, args,
+		                         std::make_index_sequence<te_function_arity<T> - 1>{});
+	}
+	else if constexpr (te_is_function_v<T>)
+	{
+		return te_invoke_function(*std::get_if<Index>(&func), args,
+		                          std::make_index_sequence<te_function_arity<T>>{});
+	}
+	else
+	{
+		return te_parser::te_nan;
+	}
+}
+
+template <size_t... Indices>
+constexpr static auto te_make_call_thunks(std::index_sequence<Indices...>)
+{
+	return std::array<te_program::call_thunk, sizeof...(Indices)>{&te_call_thunk<Indices>...};
+}
+
+// one thunk for each alternative of te_variant_type, looked up by the variant's index
+constexpr static auto te_call_thunks =
+    te_make_call_thunks(std::make_index_sequence<std::variant_size_v<te_variant_type>>{});
+
+//--------------------------------------------------
+void te_parser::te_lower(const node_index texp, te_program &program)
+{
+	lower_node(texp, program, 0);
+}
+
+//--------------------------------------------------
+void te_parser::lower_node(const node_index texp, te_program &program, const size_t depth)
+{
+	using opcode = te_program::opcode;
+
+	// deep subtrees (e.g., long chains of operators) are lowered without recursing
+	if (depth >= MAX_DIRECT_LOWERING_DEPTH)
+	{
+		lower_planned(texp, program);
+		return;
+	}
+	if (load_ready_temp(texp, program))
+	{
+		return;
+	}
+
+	direct_lowering lowering{*this, program, depth};
+	if (m_nodeSharing[texp].m_cached)
+	{
+		// the subtree is skipped while its cached value is valid,
+		// so the temporaries computed in it can't be re-read outside of it
+		const auto cache      = program.add_cache();
+		const auto readyCount = m_readyNodes.size();
+		program.emit({opcode::OP_CACHE_LOAD, cache, 0, nullptr}, 0);
+		plan_node_lowering(texp, lowering);
+		forget_ready_nodes(readyCount);
+		program.end_cache(cache, m_nodeVariables[texp]);
+	}
+	else
+	{
+		plan_node_lowering(texp, lowering);
+	}
+	// if it will be needed again, then keep a copy of its value
+	if (needs_temp(texp))
+	{
+		store_temp(texp, program);
+	}
+}
+
+//--------------------------------------------------
+void te_parser::lower_planned(const node_index texp, te_program &program)
+{
+	using opcode = te_program::opcode;
+	using action = lowering_plan::step::action;
+
+	auto &plan = m_loweringPlan;
+	plan.clear();
+	plan.lower(texp);
+	while (!plan.m_pending.empty())
+	{
+		const auto next = plan.m_pending.back();
+		plan.m_pending.pop_back();
+		auto &reg = plan.m_registers;
+		switch (next.m_action)
+		{
+			case action::LOWER:
+			{
+				if (load_ready_temp(next.m_node, program))
+				{
+					break;
+				}
+
+				plan.plan();
+				plan_node_lowering(next.m_node, plan);
+				if (m_nodeSharing[next.m_node].m_cached)
+				{
+					const auto cache = program.add_cache();
+					program.emit({opcode::OP_CACHE_LOAD, cache, 0, nullptr}, 0);
+					lowering_plan::step finish{action::FINISH_CACHE, next.m_node};
+					finish.m_instruction.m_index = cache;
+					finish.m_register            = reg.size();
+					reg.push_back(static_cast<int64_t>(m_readyNodes.size()));
+					plan.m_pending.push_back(finish);
+				}
+				if (needs_temp(next.m_node))
+				{
+					plan.m_pending.push_back({action::STORE_SHARED, next.m_node});
+				}
+				plan.commit();
+				break;
+			}
+			case action::FINISH_CACHE:
+				forget_ready_nodes(static_cast<size_t>(reg[next.m_register]));
+				program.end_cache(next.m_instruction.m_index, m_nodeVariables[next.m_node]);
+				break;
+			case action::STORE_SHARED:
+				store_temp(next.m_node, program);
+				break;
+			case action::EMIT:
+				program.emit(next.m_instruction, next.m_stackEffect);
+				if (next.m_constantUse)
+				{
+					record_constant_use(program, next.m_node, next.m_negated);
+				}
+				break;
+			case action::EMIT_CALL:
+				emit_node_call(next.m_node, program);
+				break;
+			case action::EMIT_CALL2:
+				emit_builtin_call2(next.m_function, program);
+				break;
+			case action::EMIT_JUMP:
+				reg[next.m_register] = static_cast<int64_t>(
+				    program.emit_jump(next.m_instruction.m_opcode, next.m_stackEffect));
+				break;
+			case action::PATCH_JUMP:
+				program.patch_jump(static_cast<size_t>(reg[next.m_register]));
+				break;
+			case action::SAVE_DEPTH:
+				reg[next.m_register] = program.m_currentStackDepth;
+				break;
+			case action::RESTORE_DEPTH:
+				program.m_currentStackDepth = reg[next.m_register];
+				break;
+			case action::SAVE_READY:
+				reg[next.m_register] = static_cast<int64_t>(m_readyNodes.size());
+				break;
+			case action::FORGET_READY:
+				forget_ready_nodes(static_cast<size_t>(reg[next.m_register]));
+				break;
+		}
+	}
+}
+
+//--------------------------------------------------
+bool te_parser::load_ready_temp(const node_index texp, te_program &program) const
+{
+	const auto &sharing = m_nodeSharing[texp];
+	if (!sharing.m_ready)
+	{
+		return false;
+	}
+	program.emit(
+	    {te_program::opcode::OP_LOAD_TEMP, static_cast<uint32_t>(sharing.m_temp), 0, nullptr}, 1);
+	return true;
+}
+
+//--------------------------------------------------
+bool te_parser::needs_temp(const node_index texp) const noexcept
+{
+	return (m_nodeSharing[texp].m_uses > 1 && !is_constant(m_nodes[texp].m_value) &&
+	        !is_variable(m_nodes[texp].m_value));
+}
+
+//--------------------------------------------------
+void te_parser::store_temp(const node_index texp, te_program &program)
+{
+	auto &sharing = m_nodeSharing[texp];
+	if (sharing.m_temp < 0)
+	{
+		sharing.m_temp = program.add_temp();
+	}
+	program.emit(
+	    {te_program::opcode::OP_STORE_TEMP, static_cast<uint32_t>(sharing.m_temp), 0, nullptr}, 0);
+	sharing.m_ready = true;
+	m_readyNodes.push_back(texp);
+}
+
+//--------------------------------------------------
+void te_parser::emit_builtin_call2(const te_fun2 func, te_program &program)
+{
+	const te_variant_type funcValue{func};
+	te_program::call      combine{funcValue, te_call_thunks[funcValue.index()]};
+	combine.m_arity = 2;
+	combine.m_fun2  = func;
+	program.emit_call(std::move(combine), te_program::opcode::OP_CALL2);
+}
+
+//--------------------------------------------------
+void te_parser::record_constant_use(const te_program &program, const node_index texp,
+                                    const bool negated)
+{
+	if (m_constantPatches.get_origin(texp) != 0)
+	{
+		m_constantPatches.m_uses.push_back({program.m_code.size() - 1, texp, negated});
+	}
+}
+
+//--------------------------------------------------
+bool te_parser::patch_constant(const std::string_view name, const te_type value)
+{
+	auto &patches = m_constantPatches;
+	if (!patches.m_valid || m_compiledExpression == nullptr)
+	{
+		return false;
+	}
+
+	// update the nodes that were read from the constant
+	std::vector<uint8_t> changed(m_nodes.size(), 0);
+	bool                 found{false};
+	for (const auto &[leaf, leafName] : patches.m_leaves)
+	{
+		if (!te_string_less{}(leafName, name) && !te_string_less{}(name, leafName))
+		{
+			m_nodes[leaf].m_value = value;
+			changed[leaf]         = 1;
+			found                 = true;
+		}
+	}
+	if (!found)
+	{
+		return true;
+	}
+
+	// fold the nodes that depend on them again, in the order that they were folded
+	try
+	{
+		for (const auto &[folded, original] : patches.m_foldedNodes)
+		{
+			const auto foldedNode = m_nodes[folded];
+			m_nodes[folded]       = original;
+			const auto params     = m_nodes.args(folded);
+			if (std::any_of(params.begin(), params.end(),
+			                [&changed](const node_index param) { return changed[param] != 0; }))
+			{
+				const auto foldedValue  = te_eval(folded);
+				m_nodes[folded]         = foldedNode;
+				m_nodes[folded].m_value = foldedValue;
+				changed[folded]         = 1;
+			}
+			else
+			{
+				m_nodes[folded] = foldedNode;
+			}
+		}
+	}
+	catch (const std::exception &)
+	{
+		return false;
+	}
+
+	// write the new values into the instructions (copying the expression first if it is
+	// shared, such as with the compile cache or a caller that kept it)
+	// (or its program, if that is shared with a literal hoisting template)
+	std::shared_ptr<te_compiled_expression> compiled =
+	    (m_compiledExpression.use_count() > 1) ?
+	        std::make_shared<te_compiled_expression>(*m_compiledExpression) :
+	        std::const_pointer_cast<te_compiled_expression>(m_compiledExpression);
+	std::shared_ptr<te_program> program =
+	    (compiled->m_program.use_count() > 1) ?
+	        std::make_shared<te_program>(*compiled->m_program) :
+	        std::const_pointer_cast<te_program>(compiled->m_program);
+	for (const auto &use : patches.m_uses)
+	{
+		if (changed[use.m_node] != 0)
+		{
+			const auto constant = get_constant(m_nodes[use.m_node].m_value);
+			program->m_code[use.m_instruction].m_constant = use.m_negated ? -constant : constant;
+		}
+	}
+	compiled->m_program  = std::move(program);
+	m_compiledExpression = std::move(compiled);
+	// the cached subtrees may have read the old value
+	clear_subtree_cache();
+	m_result = te_nan;
+	return true;
+}
+
+//--------------------------------------------------
+void te_parser::forget_ready_nodes(const size_t readyCount)
+{
+	// the temporaries computed since then are not stored if that code is skipped
+	while (m_readyNodes.size() > readyCount)
+	{
+		m_nodeSharing[m_readyNodes.back()].m_ready = false;
+		m_readyNodes.pop_back();
+	}
+}
+
+//--------------------------------------------------
+template <typename PlanT>
+void te_parser::plan_node_lowering(const node_index texp, PlanT &plan) const
+{
+	using opcode = te_program::opcode;
+
+	// (missing arguments refer to a NaN constant node)
+	const auto &node = m_nodes[texp];
+	if (is_constant(node.m_value))
+	{
+		plan.emit({opcode::OP_CONSTANT, 0, get_constant(node.m_value), nullptr}, 1, texp);
+		return;
+	}
+	if (is_variable(node.m_value))
+	{
+		plan.emit({opcode::OP_VARIABLE, 0, 0, get_variable(node.m_value)}, 1);
+		return;
+	}
+
+	const auto isConstant = [](const te_variant_type &value) { return is_constant(value); };
+	const auto isVariable = [](const te_variant_type &value) { return is_variable(value); };
+	// (a shared multiplication is kept whole, so that its value can be re-read)
+	const auto isMultiply = [this](const node_index param)
+	{
+		return (is_function2(m_nodes[param].m_value) &&
+		        get_function2(m_nodes[param].m_value) == te_builtins::te_mul &&
+		        m_nodeSharing[param].m_uses <= 1 && !m_nodeSharing[param].m_cached);
+	};
+
+	// arithmetic operators (and their fused forms)
+	if (is_function2(node.m_value) && node.m_argCount == 2)
+	{
+		const auto  func     = get_function2(node.m_value);
+		const auto  lhs      = m_nodes.arg(texp, 0);
+		const auto  rhs      = m_nodes.arg(texp, 1);
+		const auto &lhsValue = m_nodes[lhs].m_value;
+		const auto &rhsValue = m_nodes[rhs].m_value;
+		if (func == te_builtins::te_add)
+		{
+			if (isVariable(lhsValue) && isConstant(rhsValue))
+			{
+				plan.emit({opcode::OP_VARIABLE_ADD_CONSTANT, 0, get_constant(rhsValue),
+				           get_variable(lhsValue)},
+				          1, rhs);
+			}
+			else if (isConstant(lhsValue) && isVariable(rhsValue))
+			{
+				plan.emit({opcode::OP_VARIABLE_ADD_CONSTANT, 0, get_constant(lhsValue),
+				           get_variable(rhsValue)},
+				          1, lhs);
+			}
+			else if (isMultiply(lhs))
+			{
+				plan.lower(m_nodes.arg(lhs, 0));
+				plan.lower(m_nodes.arg(lhs, 1));
+				plan.lower(rhs);
+				plan.emit({opcode::OP_MUL_ADD, 0, 0, nullptr}, -2);
+			}
+			else if (isMultiply(rhs))
+			{
+				plan.lower(lhs);
+				plan.lower(m_nodes.arg(rhs, 0));
+				plan.lower(m_nodes.arg(rhs, 1));
+				plan.emit({opcode::OP_ADD_MUL, 0, 0, nullptr}, -2);
+			}
+			else if (isConstant(rhsValue))
+			{
+				plan.lower(lhs);
+				plan.emit({opcode::OP_ADD_CONSTANT, 0, get_constant(rhsValue), nullptr}, 0, rhs);
+			}
+			else if (isConstant(lhsValue))
+			{
+				plan.lower(rhs);
+				plan.emit({opcode::OP_ADD_CONSTANT, 0, get_constant(lhsValue), nullptr}, 0, lhs);
+			}
+			else if (isVariable(rhsValue))
+			{
+				plan.lower(lhs);
+				plan.emit({opcode::OP_ADD_VARIABLE, 0, 0, get_variable(rhsValue)}, 0);
+			}
+			else
+			{
+				plan.lower(lhs);
+				plan.lower(rhs);
+				plan.emit({opcode::OP_ADD, 0, 0, nullptr}, -1);
+			}
+			return;
+		}
+		if (func == te_builtins::te_sub)
+		{
+			plan.lower(lhs);
+			// x-c is the same as x+(-c) in IEEE arithmetic
+			if (isConstant(rhsValue))
+			{
+				plan.emit({opcode::OP_ADD_CONSTANT, 0, -get_constant(rhsValue), nullptr}, 0, rhs,
+				          true);
+			}
+			else if (isVariable(rhsValue))
+			{
+				plan.emit({opcode::OP_SUB_VARIABLE, 0, 0, get_variable(rhsValue)}, 0);
+			}
+			else
+			{
+				plan.lower(rhs);
+				plan.emit({opcode::OP_SUB, 0, 0, nullptr}, -1);
+			}
+			return;
+		}
+		if (func == te_builtins::te_mul)
+		{
+			if (isVariable(lhsValue) && isConstant(rhsValue))
+			{
+				plan.emit({opcode::OP_VARIABLE_MUL_CONSTANT, 0, get_constant(rhsValue),
+				           get_variable(lhsValue)},
+				          1, rhs);
+			}
+			else if (isConstant(lhsValue) && isVariable(rhsValue))
+			{
+				plan.emit({opcode::OP_VARIABLE_MUL_CONSTANT, 0, get_constant(lhsValue),
+				           get_variable(rhsValue)},
+				          1, lhs);
+			}
+			else if (isConstant(rhsValue))
+			{
+				plan.lower(lhs);
+				plan.emit({opcode::OP_MUL_CONSTANT, 0, get_constant(rhsValue), nullptr}, 0, rhs);
+			}
+			else if (isConstant(lhsValue))
+			{
+				plan.lower(rhs);
+				plan.emit({opcode::OP_MUL_CONSTANT, 0, get_constant(lhsValue), nullptr}, 0, lhs);
+			}
+			else if (isVariable(rhsValue))
+			{
+				plan.lower(lhs);
+				plan.emit({opcode::OP_MUL_VARIABLE, 0, 0, get_variable(rhsValue)}, 0);
+			}
+			else
+			{
+				plan.lower(lhs);
+				plan.lower(rhs);
+				plan.emit({opcode::OP_MUL, 0, 0, nullptr}, -1);
+			}
+			return;
+		}
+		if (func == te_builtins::te_divide)
+		{
+			plan.lower(lhs);
+			plan.lower(rhs);
+			plan.emit({opcode::OP_DIVIDE, 0, 0, nullptr}, -1);
+			return;
+		}
+	}
+	if (is_function1(node.m_value) && get_function1(node.m_value) == te_builtins::te_negate)
+	{
+		plan.lower(m_nodes.arg(texp, 0));
+		plan.emit({opcode::OP_NEGATE, 0, 0, nullptr}, 0);
+		return;
+	}
+
+	if (plan_lazy_lowering(texp, plan))
+	{
+		return;
+	}
+
+	// everything else is a function (or closure) call
+	for (const auto param : m_nodes.args(texp))
+	{
+		plan.lower(param);
+	}
+	plan.emit_call(texp);
+}
+
+//--------------------------------------------------
+void te_parser::emit_node_call(const node_index texp, te_program &program) const
+{
+	using opcode = te_program::opcode;
+
+	const auto      &node = m_nodes[texp];
+	te_program::call func{node.m_value, te_call_thunks[node.m_value.index()]};
+	func.m_arity   = node.m_argCount;
+	func.m_context = node.m_context;
+
+	if (is_function0(node.m_value))
+	{
+		func.m_fun0 = get_function0(node.m_value);
+		program.emit_call(std::move(func), opcode::OP_CALL0);
+	}
+	else if (is_function1(node.m_value))
+	{
+		func.m_fun1    = get_function1(node.m_value);
+		func.m_kernel1 = te_simd::find_kernel(func.m_fun1, m_approximateBatchMath);
+		program.emit_call(std::move(func), opcode::OP_CALL1);
+	}
+	else if (is_function2(node.m_value))
+	{
+		func.m_fun2    = get_function2(node.m_value);
+		func.m_kernel2 = te_simd::find_kernel(func.m_fun2);
+		program.emit_call(std::move(func), opcode::OP_CALL2);
+	}
+	else if (is_function_variadic(node.m_value))
+	{
+		func.m_funv = get_function_variadic(node.m_value);
+		program.emit_call(std::move(func), opcode::OP_CALLV);
+	}
+	else
+	{
+		program.emit_call(std::move(func), opcode::OP_CALL);
+	}
+}
+
+//--------------------------------------------------
+template <typename PlanT>
+bool te_parser::plan_lazy_lowering(const node_index texp, PlanT &plan) const
+{
+	using opcode = te_program::opcode;
+
+	const auto &node  = m_nodes[texp];
+	const auto  param = [this, texp](const size_t index) { return m_nodes.arg(texp, index); };
+
+	if (is_function2(node.m_value) && (get_function2(node.m_value) == te_builtins::te_and ||
+	                                    get_function2(node.m_value) == te_builtins::te_or))
+	{
+		// if the left side is finite and false (or true for ||), then that decides the result
+		const auto func = get_function2(node.m_value);
+		plan.lower(param(0));
+		const auto skipRight = plan.emit_jump(
+		    (func == te_builtins::te_and) ? opcode::OP_AND_JUMP : opcode::OP_OR_JUMP, 0);
+		plan.lower_conditionally(param(1));
+		plan.emit_call2(func);
+		plan.patch_jump(skipRight);
+		return true;
+	}
+
+	const auto *const func3 = std::get_if<te_fun3>(&node.m_value);
+	if (func3 != nullptr && *func3 == te_builtins::te_if)
+	{
+		plan.lower(param(0));
+		const auto skipTrue  = plan.emit_jump(opcode::OP_JUMP_IF_FALSE, -1);
+		const auto baseDepth = plan.save_depth();
+		plan.lower_conditionally(param(1));
+		const auto skipFalse = plan.emit_jump(opcode::OP_JUMP, 0);
+		plan.patch_jump(skipTrue);
+		// only one of the branches pushes its value
+		plan.restore_depth(baseDepth);
+		plan.lower_conditionally(param(2));
+		plan.patch_jump(skipFalse);
+		return true;
+	}
+
+	if (!is_function_variadic(node.m_value))
+	{
+		return false;
+	}
+	const auto funcVariadic = get_function_variadic(node.m_value);
+	const auto argCount     = node.m_argCount;
+	if (funcVariadic == te_builtins::te_ifs)
+	{
+		// test each condition in turn, stopping at the first true one
+		// (a condition is only reached if all of the ones before it were)
+		const auto          baseDepth = plan.save_depth();
+		std::vector<size_t> skipToEnd;
+		size_t              readyCount{0};
+		for (size_t i = 0; i < argCount; i += 2)
+		{
+			plan.lower(param(i));
+			if (i == 0)
+			{
+				readyCount = plan.save_ready_count();
+			}
+			const auto skipValue = plan.emit_jump(opcode::OP_JUMP_IF_FALSE, -1);
+			plan.lower_conditionally(param(i + 1));
+			skipToEnd.push_back(plan.emit_jump(opcode::OP_JUMP, 0));
+			plan.patch_jump(skipValue);
+			plan.restore_depth(baseDepth);
+		}
+		plan.forget_ready_nodes(readyCount);
+		// none of the conditions were met
+		plan.emit({opcode::OP_CONSTANT, 0, te_nan, nullptr}, 1);
+		for (const auto jump : skipToEnd)
+		{
+			plan.patch_jump(jump);
+		}
+		return true;
+	}
+	if (funcVariadic == te_builtins::te_and_variadic ||
+	    funcVariadic == te_builtins::te_or_variadic)
+	{
+		// fold the arguments into a boolean one at a time, stopping once the result is known
+		// (the first argument must be finite, and a lone one is folded with a missing one)
+		const bool isAnd{funcVariadic == te_builtins::te_and_variadic};
+		plan.lower(param(0));
+		// (an argument is only reached if all of the ones before it were)
+		const auto          readyCount = plan.save_ready_count();
+		std::vector<size_t> skipToEnd{plan.emit_jump(opcode::OP_NAN_JUMP, 0)};
+		for (size_t i = 1; i < std::max<size_t>(argCount, 2); ++i)
+		{
+			skipToEnd.push_back(
+			    plan.emit_jump(isAnd ? opcode::OP_AND_JUMP : opcode::OP_OR_JUMP, 0));
+			plan.lower(param(i));
+			plan.emit_call2(isAnd ? te_builtins::te_and_maybe_nan : te_builtins::te_or_maybe_nan);
+		}
+		plan.forget_ready_nodes(readyCount);
+		for (const auto jump : skipToEnd)
+		{
+			plan.patch_jump(jump);
+		}
+		return true;
+	}
+	return false;
+}
+
+//--------------------------------------------------
+te_type te_program::evaluate() const
+{
+	return run_on_stack([](const instruction &instr) { return *instr.m_variable; });
+}
+
+//--------------------------------------------------
+te_type te_program::evaluate_with_parameters(std::span<const te_type> parameters) const
+{
+	assert(parameters.size() >= m_parameterCount);
+	if (m_parameterCount == 0)
+	{
+		return evaluate();
+	}
+	return run_on_stack([this, parameters](const instruction &instr)
+	                    { return read_bound(instr.m_index, parameters); });
+}
+
+//--------------------------------------------------
+te_type te_program::evaluate(std::span<const te_type> frame) const
+{
+	assert(frame.size() >= m_variables.size());
+	return run_on_stack([frame](const instruction &instr) { return frame[instr.m_index]; });
+}
+
+//--------------------------------------------------
+te_type te_program::evaluate_cached(std::span<cached_value> caches,
+                                    std::span<const te_type> parameters) const
+{
+	assert(caches.size() >= get_cache_count());
+	assert(parameters.size() >= m_parameterCount);
+	if (m_parameterCount == 0)
+	{
+		return run_on_stack([](const instruction &instr) { return *instr.m_variable; }, {},
+		                    caches.data());
+	}
+	return run_on_stack([this, parameters](const instruction &instr)
+	                    { return read_bound(instr.m_index, parameters); },
+	                    {}, caches.data());
+}
+
+//--------------------------------------------------
+void te_program::evaluate_all(std::span<te_type> results) const
+{
+	run_on_stack([](const instruction &instr) { return *instr.m_variable; }, results);
+}
+
+//--------------------------------------------------
+void te_program::evaluate_all(std::span<const te_type> frame, std::span<te_type> results) const
+{
+	assert(frame.size() >= m_variables.size());
+	run_on_stack([frame](const instruction &instr) { return frame[instr.m_index]; }, results);
+}
+
+//--------------------------------------------------
+int64_t te_program::find_slot(const std::string_view name) const
+{
+	for (const auto &[slotName, slot] : m_variableSlots)
+	{
+		if (!te_string_less{}(slotName, name) && !te_string_less{}(name, slotName))
+		{
+			return static_cast<int64_t>(slot);
+		}
+	}
+	return -1;
+}
+
+//--------------------------------------------------
+std::vector<te_type> te_program::make_frame(std::span<const te_type> parameters) const
+{
+	assert(parameters.size() >= m_parameterCount);
+	std::vector<te_type> frame(m_variables.size());
+	for (size_t slot = 0; slot < frame.size(); ++slot)
+	{
+		frame[slot] = read_bound(slot, parameters);
+	}
+	return frame;
+}
+
+//--------------------------------------------------
+template <typename VariableReader>
+te_type te_program::run_on_stack(const VariableReader &readVariable, std::span<te_type> results,
+                                 cached_value *caches) const
+{
+	if (empty())
+	{
+		std::fill(results.begin(), results.end(), te_parser::te_nan);
+		return te_parser::te_nan;
+	}
+	// each formula lowered into the program leaves its result on the stack
+	assert(results.size() <= static_cast<size_t>(m_maxStackDepth));
+
+	// small programs (i.e., most of them) can run on a stack-allocated buffer
+	constexpr size_t LOCAL_STACK_SIZE{64};
+	if (get_frame_size() <= LOCAL_STACK_SIZE)
+	{
+		// NOLINTNEXTLINE(cppcoreguidelines-pro-type-member-init)
+		std::array<te_type, LOCAL_STACK_SIZE> stack;
+		const auto result = run(stack.data(), readVariable, caches);
+		std::copy_n(stack.cbegin(), results.size(), results.begin());
+		return result;
+	}
+	std::vector<te_type> stack(get_frame_size());
+	const auto           result = run(stack.data(), readVariable, caches);
+	std::copy_n(stack.cbegin(), results.size(), results.begin());
+	return result;
+}
+
+//--------------------------------------------------
+template <typename VariableReader>
+te_type te_program::run(te_type *stack, const VariableReader &readVariable,
+                        cached_value *caches) const
+{
+	// top points to the next free slot on the stack
+	te_type                 *top{stack};
+	te_type *const           temps{stack + m_maxStackDepth};
+	const instruction       *next{m_code.data()};
+	const instruction *const end{m_code.data() + m_code.size()};
+	while (next != end)
+	{
+		const auto &instr = *next++;
+		switch (instr.m_opcode)
+		{
+			case opcode::OP_CONSTANT:
+				*top++ = instr.m_constant;
+				break;
+			case opcode::OP_VARIABLE:
+				*top++ = readVariable(instr);
+				break;
+			case opcode::OP_VARIABLE_ADD_CONSTANT:
+				*top++ = readVariable(instr) + instr.m_constant;
+				break;
+			case opcode::OP_VARIABLE_MUL_CONSTANT:
+				*top++ = readVariable(instr) * instr.m_constant;
+				break;
+			case opcode::OP_ADD:
+				--top;
+				top[-1] += *top;
+				break;
+			case opcode::OP_SUB:
+				--top;
+				top[-1] -= *top;
+				break;
+			case opcode::OP_MUL:
+				--top;
+				top[-1] *= *top;
+				break;
+			case opcode::OP_DIVIDE:
+				--top;
+				top[-1] = te_builtins::te_divide(top[-1], *top);
+				break;
+			case opcode::OP_ADD_CONSTANT:
+				top[-1] += instr.m_constant;
+				break;
+			case opcode::OP_MUL_CONSTANT:
+				top[-1] *= instr.m_constant;
+				break;
+			case opcode::OP_ADD_VARIABLE:
+				top[-1] += readVariable(instr);
+				break;
+			case opcode::OP_SUB_VARIABLE:
+				top[-1] -= readVariable(instr);
+				break;
+			case opcode::OP_MUL_VARIABLE:
+				top[-1] *= readVariable(instr);
+				break;
+			case opcode::OP_MUL_ADD:
+				top -= 2;
+				top[-1] = (top[-1] * top[0]) + top[1];
+				break;
+			case opcode::OP_ADD_MUL:
+				top -= 2;
+				top[-1] = top[-1] + (top[0] * top[1]);
+				break;
+			case opcode::OP_NEGATE:
+				top[-1] = -top[-1];
+				break;
+			case opcode::OP_CALL0:
+				*top++ = m_calls[instr.m_index].m_fun0();
+				break;
+			case opcode::OP_CALL1:
+				top[-1] = m_calls[instr.m_index].m_fun1(top[-1]);
+				break;
+			case opcode::OP_CALL2:
+				--top;
+				top[-1] = m_calls[instr.m_index].m_fun2(top[-1], *top);
+				break;
+			case opcode::OP_CALL:
+			{
+				const auto &func = m_calls[instr.m_index];
+				top -= func.m_arity;
+				*top = func.m_thunk(func.m_function, func.m_context, top);
+				++top;
+				break;
+			}
+			case opcode::OP_CALLV:
+			{
+				const auto &func = m_calls[instr.m_index];
+				top -= func.m_arity;
+				*top = func.m_funv(top, func.m_arity);
+				++top;
+				break;
+			}
+			case opcode::OP_JUMP:
+				next = m_code.data() + instr.m_index;
+				break;
+			case opcode::OP_JUMP_IF_FALSE:
+				--top;
+				if (!te_parser::number_to_bool(*top))
+				{
+					next = m_code.data() + instr.m_index;
+				}
+				break;
+			case opcode::OP_AND_JUMP:
+				if (std::isfinite(top[-1]) && !te_parser::number_to_bool(top[-1]))
+				{
+					top[-1] = 0;
+					next    = m_code.data() + instr.m_index;
+				}
+				break;
+			case opcode::OP_OR_JUMP:
+				if (std::isfinite(top[-1]) && te_parser::number_to_bool(top[-1]))
+				{
+					top[-1] = 1;
+					next    = m_code.data() + instr.m_index;
+				}
+				break;
+			case opcode::OP_NAN_JUMP:
+				if (!std::isfinite(top[-1]))
+				{
+					top[-1] = te_parser::te_nan;
+					next    = m_code.data() + instr.m_index;
+				}
+				break;
+			case opcode::OP_STORE_TEMP:
+				temps[instr.m_index] = top[-1];
+				break;
+			case opcode::OP_LOAD_TEMP:
+				*top++ = temps[instr.m_index];
+				break;
+			case opcode::OP_CACHE_LOAD:
+				if (caches != nullptr && caches[instr.m_index].m_valid)
+				{
+					*top++ = caches[instr.m_index].m_value;
+					next   = m_code.data() + m_cacheEnds[instr.m_index];
+				}
+				break;
+			case opcode::OP_CACHE_STORE:
+				if (caches != nullptr)
+				{
+					caches[instr.m_index] = {top[-1], true};
+				}
+				break;
+		}
+	}
+	return top[-1];
+}
+
+//--------------------------------------------------
+size_t te_program::evaluate_batch(const std::vector<const te_type *> &columns,
+                                  std::span<te_type> results, std::string &errorMessage,
+                                  std::span<const te_type> parameters) const
+{
+	assert(columns.size() == m_variables.size());
+	assert(parameters.size() >= m_parameterCount);
+	if (empty())
+	{
+		std::fill(results.begin(), results.end(), te_parser::te_nan);
+		return results.size();
+	}
+
+	std::vector<te_type> rowStack(get_frame_size());
+	std::vector<te_type> frame(m_variables.size());
+	size_t               failedRows{0};
+	const auto           runRows = [&](const size_t first, const size_t count)
+	{
+		for (size_t row = first; row < first + count; ++row)
+		{
+			for (size_t slot = 0; slot < frame.size(); ++slot)
+			{
+				frame[slot] = (columns[slot] != nullptr) ? columns[slot][row] :
+				                                           read_bound(slot, parameters);
+			}
+			try
+			{
+				results[row] = run(rowStack.data(), [&frame](const instruction &instr)
+				                   { return frame[instr.m_index]; });
+			}
+			catch (const std::exception &expt)
+			{
+				results[row] = te_parser::te_nan;
+				if (failedRows++ == 0)
+				{
+					errorMessage = expt.what();
+				}
+			}
+		}
+	};
+
+	// rows may take different branches, so those programs can't run in blocks
+	if (m_hasBranches)
+	{
+		runRows(0, results.size());
+		return failedRows;
+	}
+
+	// (fused variable instructions need an extra block to load the variable into)
+	std::vector<te_type> blockStack((get_frame_size() + 1) * BATCH_BLOCK_SIZE);
+	for (size_t first = 0; first < results.size(); first += BATCH_BLOCK_SIZE)
+	{
+		const auto blockResults =
+		    results.subspan(first, std::min(BATCH_BLOCK_SIZE, results.size() - first));
+		try
+		{
+			run_block(blockStack.data(), columns, first, blockResults, parameters);
+		}
+		catch (const std::exception &)
+		{
+			// re-run the block one row at a time, so that only the rows that failed are NaN
+			runRows(first, blockResults.size());
+		}
+	}
+	return failedRows;
+}
+
+//--------------------------------------------------
+void te_program::run_block(te_type *stack, const std::vector<const te_type *> &columns,
+                           const size_t first, std::span<te_type> results,
+                           std::span<const te_type> parameters) const
+{
+	const size_t count{results.size()};
+
+	// each stack entry is a block of rows; top points to the next free one
+	// (and the temporaries' blocks follow the stack's)
+	te_type       *top{stack};
+	te_type *const temps{stack + ((static_cast<size_t>(m_maxStackDepth) + 1) * BATCH_BLOCK_SIZE)};
+
+	const auto pushVariable = [&](const instruction &instr)
+	{
+		if (columns[instr.m_index] != nullptr)
+		{
+			std::copy_n(columns[instr.m_index] + first, count, top);
+		}
+		else
+		{
+			std::fill_n(top, count, read_bound(instr.m_index, parameters));
+		}
+		top += BATCH_BLOCK_SIZE;
+	};
+	// applies an operation in place to the top block
+	const auto unary = [&](const auto &operation)
+	{
+		te_type *val{top - BATCH_BLOCK_SIZE};
+		for (size_t i = 0; i < count; ++i)
+		{
+			val[i] = operation(val[i]);
+		}
+	};
+	// pops the top block and combines it into the one below it
+	const auto binary = [&](const auto &operation)
+	{
+		top -= BATCH_BLOCK_SIZE;
+		te_type *lhs{top - BATCH_BLOCK_SIZE};
+		for (size_t i = 0; i < count; ++i)
+		{
+			lhs[i] = operation(lhs[i], top[i]);
+		}
+	};
+	// pops the top two blocks and combines them into the one below them
+	const auto ternary = [&](const auto &operation)
+	{
+		top -= 2 * BATCH_BLOCK_SIZE;
+		te_type *first3{top - BATCH_BLOCK_SIZE};
+		for (size_t i = 0; i < count; ++i)
+		{
+			first3[i] = operation(first3[i], top[i], top[BATCH_BLOCK_SIZE + i]);
+		}
+	};
+
+	std::vector<te_type> args;
+	for (const auto &instr : m_code)
+	{
+		switch (instr.m_opcode)
+		{
+			case opcode::OP_CONSTANT:
+				std::fill_n(top, count, instr.m_constant);
+				top += BATCH_BLOCK_SIZE;
+				break;
+			case opcode::OP_VARIABLE:
+				pushVariable(instr);
+				break;
+			case opcode::OP_VARIABLE_ADD_CONSTANT:
+				pushVariable(instr);
+				unary([&instr](const te_type val) { return val + instr.m_constant; });
+				break;
+			case opcode::OP_VARIABLE_MUL_CONSTANT:
+				pushVariable(instr);
+				unary([&instr](const te_type val) { return val * instr.m_constant; });
+				break;
+			case opcode::OP_ADD:
+				binary([](const te_type lhs, const te_type rhs) { return lhs + rhs; });
+				break;
+			case opcode::OP_SUB:
+				binary([](const te_type lhs, const te_type rhs) { return lhs - rhs; });
+				break;
+			case opcode::OP_MUL:
+				binary([](const te_type lhs, const te_type rhs) { return lhs * rhs; });
+				break;
+			case opcode::OP_DIVIDE:
+				if (std::find(top - BATCH_BLOCK_SIZE, top - BATCH_BLOCK_SIZE + count,
+				              static_cast<te_type>(0)) != top - BATCH_BLOCK_SIZE + count)
+				{
+					throw std::runtime_error("Division by zero.");
+				}
+				binary([](const te_type lhs, const te_type rhs) { return lhs / rhs; });
+				break;
+			case opcode::OP_ADD_CONSTANT:
+				unary([&instr](const te_type val) { return val + instr.m_constant; });
+				break;
+			case opcode::OP_MUL_CONSTANT:
+				unary([&instr](const te_type val) { return val * instr.m_constant; });
+				break;
+			case opcode::OP_ADD_VARIABLE:
+				pushVariable(instr);
+				binary([](const te_type lhs, const te_type rhs) { return lhs + rhs; });
+				break;
+			case opcode::OP_SUB_VARIABLE:
+				pushVariable(instr);
+				binary([](const te_type lhs, const te_type rhs) { return lhs - rhs; });
+				break;
+			case opcode::OP_MUL_VARIABLE:
+				pushVariable(instr);
+				binary([](const te_type lhs, const te_type rhs) { return lhs * rhs; });
+				break;
+			case opcode::OP_MUL_ADD:
+				ternary([](const te_type val1, const te_type val2, const te_type val3)
+				        { return (val1 * val2) + val3; });
+				break;
+			case opcode::OP_ADD_MUL:
+				ternary([](const te_type val1, const te_type val2, const te_type val3)
+				        { return val1 + (val2 * val3); });
+				break;
+			case opcode::OP_NEGATE:
+				unary([](const te_type val) { return -val; });
+				break;
+			case opcode::OP_CALL0:
+				for (size_t i = 0; i < count; ++i)
+				{
+					top[i] = m_calls[instr.m_index].m_fun0();
+				}
+				top += BATCH_BLOCK_SIZE;
+				break;
+			case opcode::OP_CALL1:
+			{
+				const auto &func = m_calls[instr.m_index];
+				if (func.m_kernel1 != nullptr)
+				{
+					func.m_kernel1(top - BATCH_BLOCK_SIZE, count);
+				}
+				else
+				{
+					unary(func.m_fun1);
+				}
+				break;
+			}
+			case opcode::OP_CALL2:
+			{
+				const auto &func = m_calls[instr.m_index];
+				if (func.m_kernel2 != nullptr)
+				{
+					top -= BATCH_BLOCK_SIZE;
+					func.m_kernel2(top - BATCH_BLOCK_SIZE, top, count);
+				}
+				else
+				{
+					binary(func.m_fun2);
+				}
+				break;
+			}
+			case opcode::OP_CALL:
+			{
+				const auto &func = m_calls[instr.m_index];
+				top -= func.m_arity * BATCH_BLOCK_SIZE;
+				args.resize(func.m_arity);
+				for (size_t i = 0; i < count; ++i)
+				{
+					// gather the row's arguments from their blocks
+					for (size_t arg = 0; arg < func.m_arity; ++arg)
+					{
+						args[arg] = top[(arg * BATCH_BLOCK_SIZE) + i];
+					}
+					top[i] = func.m_thunk(func.m_function, func.m_context, args.data());
+				}
+				top += BATCH_BLOCK_SIZE;
+				break;
+			}
+			case opcode::OP_CALLV:
+			{
+				const auto &func = m_calls[instr.m_index];
+				top -= func.m_arity * BATCH_BLOCK_SIZE;
+				args.resize(func.m_arity);
+				for (size_t i = 0; i < count; ++i)
+				{
+					for (size_t arg = 0; arg < func.m_arity; ++arg)
+					{
+						args[arg] = top[(arg * BATCH_BLOCK_SIZE) + i];
+					}
+					top[i] = func.m_funv(args.data(), args.size());
+				}
+				top += BATCH_BLOCK_SIZE;
+				break;
+			}
+			case opcode::OP_JUMP:
+			case opcode::OP_JUMP_IF_FALSE:
+			case opcode::OP_AND_JUMP:
+			case opcode::OP_OR_JUMP:
+			case opcode::OP_NAN_JUMP:
+				// programs with branches are run one row at a time
+				assert(false && "Branches cannot be run in blocks.");
+				break;
+			case opcode::OP_STORE_TEMP:
+				std::copy_n(top - BATCH_BLOCK_SIZE, count, temps + (instr.m_index * BATCH_BLOCK_SIZE));
+				break;
+			case opcode::OP_LOAD_TEMP:
+				std::copy_n(temps + (instr.m_index * BATCH_BLOCK_SIZE), count, top);
+				top += BATCH_BLOCK_SIZE;
+				break;
+			case opcode::OP_CACHE_LOAD:
+			case opcode::OP_CACHE_STORE:
+				// (rows don't share cached values, so the subtrees are always evaluated)
+				break;
+		}
+	}
+	std::copy_n(top - BATCH_BLOCK_SIZE, count, results.begin());
+}
+
+//--------------------------------------------------
+te_type te_compiled_expression::evaluate() const noexcept
+{
+	try
+	{
+		return m_program->evaluate_with_parameters(m_literals);
+	}
+	catch (...)
+	{
+		return te_parser::te_nan;
+	}
+}
+
+//--------------------------------------------------
+te_type te_compiled_expression::evaluate(std::string &errorMessage) const
+{
+	errorMessage.clear();
+	try
+	{
+		return m_program->evaluate_with_parameters(m_literals);
+	}
+	catch (const std::exception &expt)
+	{
+		errorMessage = expt.what();
+		return te_parser::te_nan;
+	}
+}
+
+//--------------------------------------------------
+int64_t te_compiled_expression::find_slot(const std::string_view name) const
+{
+	return m_program->find_slot(name);
+}
+
+//--------------------------------------------------
+std::vector<te_type> te_compiled_expression::make_frame() const
+{
+	return m_program->make_frame(m_literals);
+}
+
+//--------------------------------------------------
+te_type te_compiled_expression::evaluate(std::span<const te_type> frame) const
+{
+	std::string errorMessage;
+	return evaluate(frame, errorMessage);
+}
+
+//--------------------------------------------------
+te_type te_compiled_expression::evaluate(std::span<const te_type> frame,
+                                         std::string &errorMessage) const
+{
+	if (frame.size() < get_slot_count())
+	{
+		throw std::runtime_error("Frame has fewer values than the expression has variables.");
+	}
+	errorMessage.clear();
+	try
+	{
+		return m_program->evaluate(frame);
+	}
+	catch (const std::exception &expt)
+	{
+		errorMessage = expt.what();
+		return te_parser::te_nan;
+	}
+}
+
+//--------------------------------------------------
+bool te_compiled_expression::evaluate_batch(std::span<const te_column> columns,
+                                            std::span<te_type> results,
+                                            std::string &errorMessage) const
+{
+	// map the columns to the program's variable slots
+	std::vector<const te_type *> slotColumns(m_program->m_variables.size(), nullptr);
+	for (const auto &column : columns)
+	{
+		if (column.m_values.size() < results.size())
+		{
+			throw std::runtime_error(std::string("Batch column has fewer values than rows: ") +
+			                         std::string{column.m_name});
+		}
+		if (const auto slot = find_slot(column.m_name); slot >= 0)
+		{
+			slotColumns[static_cast<size_t>(slot)] = column.m_values.data();
+		}
+	}
+
+	errorMessage.clear();
+	return (m_program->evaluate_batch(slotColumns, results, errorMessage, m_literals) == 0);
+}
+
+//--------------------------------------------------
+template <typename ProgramEvaluator>
+bool te_compiled_formulas::evaluate_separately(const ProgramEvaluator &evaluateProgram,
+                                               std::span<te_type> results,
+                                               std::string &errorMessage) const
+{
+	size_t failedFormulas{0};
+	for (size_t i = 0; i < m_formulaPrograms.size(); ++i)
+	{
+		try
+		{
+			results[i] = evaluateProgram(m_formulaPrograms[i]);
+		}
+		catch (const std::exception &expt)
+		{
+			results[i] = te_parser::te_nan;
+			if (failedFormulas++ == 0)
+			{
+				errorMessage = expt.what();
+			}
+		}
+	}
+	return (failedFormulas == 0);
+}
+
+//--------------------------------------------------
+bool te_compiled_formulas::evaluate(std::span<te_type> results, std::string &errorMessage) const
+{
+	if (results.size() < get_formula_count())
+	{
+		throw std::runtime_error("Results have fewer values than there are formulas.");
+	}
+	errorMessage.clear();
+	try
+	{
+		m_program.evaluate_all(results.first(get_formula_count()));
+		return true;
+	}
+	catch (const std::exception &)
+	{
+		return evaluate_separately([](const te_program &program) { return program.evaluate(); },
+		                           results, errorMessage);
+	}
+}
+
+//--------------------------------------------------
+bool te_compiled_formulas::evaluate(std::span<const te_type> frame, std::span<te_type> results,
+                                    std::string &errorMessage) const
+{
+	if (frame.size() < get_slot_count())
+	{
+		throw std::runtime_error("Frame has fewer values than the formulas have variables.");
+	}
+	if (results.size() < get_formula_count())
+	{
+		throw std::runtime_error("Results have fewer values than there are formulas.");
+	}
+	errorMessage.clear();
+	try
+	{
+		m_program.evaluate_all(frame, results.first(get_formula_count()));
+		return true;
+	}
+	catch (const std::exception &)
+	{
+		return evaluate_separately([frame](const te_program &program)
+		                           { return program.evaluate(frame); },
+		                           results, errorMessage);
+	}
+}
+
+//--------------------------------------------------
+void te_symbol_index::rebuild(const std::set<te_variable> &vars)
+{
+	m_slots.clear();
+	m_size = 0;
+	reserve(vars.size());
+	for (auto var = vars.cbegin(); var != vars.cend(); ++var)
+	{
+		insert(var);
+	}
+}
+
+//--------------------------------------------------
+void te_symbol_index::insert(const iterator var)
+{
+	reserve(m_size + 1);
+	const auto hashValue = hash(var->m_name);
+	auto      &entry     = m_slots[find_slot(var->m_name, hashValue)];
+	if (entry.m_hash == 0)
+	{
+		++m_size;
+	}
+	entry = {hashValue, var};
+}
+
+//--------------------------------------------------
+void te_symbol_index::erase(const std::string_view name)
+{
+	if (m_size == 0)
+	{
+		return;
+	}
+	const size_t mask = m_slots.size() - 1;
+	size_t       hole = find_slot(name, hash(name));
+	if (m_slots[hole].m_hash == 0)
+	{
+		return;
+	}
+	m_slots[hole] = slot{};
+	--m_size;
+
+	// shift back any entries in the same probe sequence, so that lookups
+	// don't stop early at the slot that was just emptied
+	for (size_t next = (hole + 1) & mask; m_slots[next].m_hash != 0; next = (next + 1) & mask)
+	{
+		const size_t home = m_slots[next].m_hash & mask;
+		// move the entry unless its home is cyclically within (hole, next]
+		const bool inPlace = (hole <= next) ? (hole < home && home <= next) :
+		                                      (hole < home || home <= next);
+		if (!inPlace)
+		{
+			m_slots[hole] = m_slots[next];
+			m_slots[next] = slot{};
+			hole          = next;
+		}
+	}
+}
+
+//--------------------------------------------------
+std::optional<te_symbol_index::iterator>
+te_symbol_index::find(const std::string_view name) const
+{
+	if (m_size == 0)
+	{
+		return std::nullopt;
+	}
+	const auto &entry = m_slots[find_slot(name, hash(name))];
+	return (entry.m_hash != 0) ? std::optional<iterator>{entry.m_var} : std::nullopt;
+}
+
+//--------------------------------------------------
+size_t te_symbol_index::find_slot(const std::string_view name,
+                                  const size_t hashValue) const noexcept
+{
+	const size_t mask = m_slots.size() - 1;
+	for (size_t position = hashValue & mask;; position = (position + 1) & mask)
+	{
+		const auto &entry = m_slots[position];
+		if (entry.m_hash == 0 ||
+		    (entry.m_hash == hashValue && !te_string_less{}(entry.m_var->m_name, name) &&
+		     !te_string_less{}(name, entry.m_var->m_name)))
+		{
+			return position;
+		}
+	}
+}
+
+//--------------------------------------------------
+void te_symbol_index::reserve(const size_t count)
+{
+	if (count * 2 <= m_slots.size())
+	{
+		return;
+	}
+	size_t capacity{16};
+	while (capacity < count * 2)
+	{
+		capacity *= 2;
+	}
+	std::vector<slot> oldSlots(capacity);
+	oldSlots.swap(m_slots);
+	const size_t mask = m_slots.size() - 1;
+	for (const auto &entry : oldSlots)
+	{
+		if (entry.m_hash != 0)
+		{
+			size_t position = entry.m_hash & mask;
+			while (m_slots[position].m_hash != 0)
+			{
+				position = (position + 1) & mask;
+			}
+			m_slots[position] = entry;
+		}
+	}
+}
+
+//--------------------------------------------------
+const char *te_parser::read_number(const char *start, const char *end, te_type &value) const
+{
+	const char decimalSeparator{get_decimal_separator()};
+	const auto isDigit = [](const char ch) noexcept { return ch >= '0' && ch <= '9'; };
+	const auto isHexDigit = [&isDigit](const char ch) noexcept
+	{ return isDigit(ch) || (ch >= 'a' && ch <= 'f') || (ch >= 'A' && ch <= 'F'); };
+
+	// hex literals (e.g., 0x1F) can also have a fraction and a binary exponent (e.g., 0x1.8p3)
+	const bool isHex = (end - start > 2 && start[0] == '0' && (start[1] == 'x' || start[1] == 'X') &&
+	                    (isHexDigit(start[2]) ||
+	                     (start[2] == decimalSeparator && end - start > 3 && isHexDigit(start[3]))));
+	const auto isMantissaDigit = [isHex, &isDigit, &isHexDigit](const char ch) noexcept
+	{ return isHex ? isHexDigit(ch) : isDigit(ch); };
+	const char *const first{isHex ? start + 2 : start};
+
+	// Scans the literal, along with its order of magnitude (in digits) in case it is out of range.
+	const char *next{first};
+	const char *separator{nullptr};
+	int64_t magnitude{0};
+	bool hasDigits{false};
+	bool hasSignificantDigits{false};
+	while (next != end && isMantissaDigit(*next))
+	{
+		hasSignificantDigits = hasSignificantDigits || *next != '0';
+		magnitude += hasSignificantDigits ? 1 : 0;
+		hasDigits = true;
+		std::advance(next, 1);
+	}
+	if (next != end && *next == decimalSeparator)
+	{
+		separator = next;
+		std::advance(next, 1);
+		while (next != end && isMantissaDigit(*next))
+		{
+			hasSignificantDigits = hasSignificantDigits || *next != '0';
+			magnitude -= hasSignificantDigits ? 0 : 1;
+			hasDigits = true;
+			std::advance(next, 1);
+		}
+	}
+	if (!hasDigits)
+	{
+		return start;
+	}
+	// the exponent is only part of the literal if it has digits
+	int64_t exponent{0};
+	if (next != end && (isHex ? (*next == 'p' || *next == 'P') : (*next == 'e' || *next == 'E')))
+	{
+		const char *exponentStart{std::next(next)};
+		const bool isNegative{exponentStart != end && *exponentStart == '-'};
+		if (exponentStart != end && (*exponentStart == '+' || *exponentStart == '-'))
+		{
+			std::advance(exponentStart, 1);
+		}
+		if (exponentStart != end && isDigit(*exponentStart))
+		{
+			next = exponentStart;
+			while (next != end && isDigit(*next))
+			{
+				exponent = std::min<int64_t>(exponent * 10 + (*next - '0'), 1'000'000);
+				std::advance(next, 1);
+			}
+			exponent = isNegative ? -exponent : exponent;
+		}
+	}
+
+	// from_chars() only reads '.' as a decimal point, so other separators need a copy
+	const auto format{isHex ? std::chars_format::hex : std::chars_format::general};
+	std::from_chars_result result{};
+	if (separator != nullptr && decimalSeparator != '.')
+	{
+		std::array<char, 64> buffer{};
+		std::string longBuffer;
+		char *literal{buffer.data()};
+		const auto length{static_cast<size_t>(next - first)};
+		if (length > buffer.size())
+		{
+			longBuffer.resize(length);
+			literal = longBuffer.data();
+		}
+		std::copy(first, next, literal);
+		literal[separator - first] = '.';
+		result = std::from_chars(literal, literal + length, value, format);
+	}
+	else
+	{
+		result = std::from_chars(first, next, value, format);
+	}
+
+	if (result.ec == std::errc::result_out_of_range)
+	{
+		const bool isOverflow{hasSignificantDigits &&
+		                      (isHex ? (magnitude * 4) + exponent : magnitude + exponent) > 0};
+		value = isOverflow ? std::numeric_limits<te_type>::infinity() : 0;
+	}
+	return next;
+}
+
+//--------------------------------------------------
+std::string te_parser::get_literal_shape(const std::string_view expression,
+                                         std::vector<te_type> &literals) const
+{
+	literals.clear();
+	std::string shape;
+	shape.reserve(expression.length());
+	// (reads the literals the same way that next_token() does, stopping where it would)
+	const char       *next{expression.data()};
+	const char *const end{expression.data() + expression.length()};
+	while (next != end && *next != 0)
+	{
+		if (const char *const commentEnd = skip_comment(next); commentEnd != next)
+		{
+			// (a comment that isn't terminated fails to parse, so it can't match a template)
+			if (commentEnd == nullptr)
+			{
+				shape.append(next, end);
+				break;
+			}
+			// (the comment separates what is around it, as in next_token())
+			shape.push_back(' ');
+			next = commentEnd;
+		}
+		else if (is_letter(*next) || *next == '_')
+		{
+			const char *start{next};
+			while (next != end && is_name_char_valid(*next))
+			{
+				std::advance(next, 1);
+			}
+			shape.append(start, next);
+		}
+		else if ((*next >= '0' && *next <= '9') || *next == get_decimal_separator())
+		{
+			te_type value{0};
+			const char *numberEnd = read_number(next, end, value);
+			literals.push_back(value);
+			shape.push_back(0);
+			// (something that isn't a number is still read as one, and then fails to parse)
+			next = std::max(numberEnd, next + 1);
+		}
+		else
+		{
+			shape.push_back(*next);
+			std::advance(next, 1);
+		}
+	}
+	return shape;
+}
+
+//--------------------------------------------------
+bool te_parser::restore_from_literal_template(const std::string &shape,
+                                              const bool commentsRemoved)
+{
+	const auto found = m_literalTemplates.find(shape);
+	if (found == m_literalTemplates.end())
+	{
+		return false;
+	}
+	// the variables or functions have changed since this was compiled
+	if (found->second.m_symbolVersion != m_symbolVersion ||
+	    found->second.m_program->get_parameter_count() != m_hoistedLiterals.size())
+	{
+		m_literalTemplates.erase(found);
+		return false;
+	}
+
+	if (!commentsRemoved)
+	{
+		remove_comments(m_expression);
+	}
+	std::shared_ptr<te_compiled_expression> compiled{new te_compiled_expression};
+	compiled->m_expression = m_expression;
+	compiled->m_program    = found->second.m_program;
+	compiled->m_literals   = m_hoistedLiterals;
+	m_compiledExpression   = std::move(compiled);
+#ifndef TE_NO_BOOKKEEPING
+	m_usedFunctions = found->second.m_usedFunctions;
+	m_usedVars      = found->second.m_usedVars;
+#endif
+	return true;
+}
+
+//--------------------------------------------------
+std::optional<te_parser::node_index> te_parser::te_compile(const std::string_view expression,
+                                                           std::set<te_variable> &variables,
+                                                           const bool hoistLiterals)
+{
+	state theState(expression, TE_DEFAULT, variables);
+	theState.m_hoistLiterals = hoistLiterals;
+	m_hoistedLiteralCount    = 0;
+	if (m_useSymbolIndex && &variables == &m_customFuncsAndVars)
+	{
+		update_symbol_index();
+		theState.m_lookupIndex = &m_symbolIndex;
+	}
+
+	next_token(&theState);
+	const auto root = parse(&theState);
+
+	if (theState.m_type != te_parser::state::token_type::TOK_END)
+	{
+		if (theState.m_depthExceeded)
+		{
+			m_lastErrorMessage = "Expression is nested more deeply than the maximum depth of " +
+			                     std::to_string(m_maxDepth) + ".";
+		}
+		// (the position in the expression without its comments)
+		m_errorPos = (theState.m_next - theState.m_start) - theState.m_commentLength;
+		if (m_errorPos > 0)
+		{
+			--m_errorPos;
+		}
+		return std::nullopt;
+	}
+
+	// note which nodes were read from custom constants, before folding them
+	m_constantPatches.m_origins.resize(m_nodes.size(), 0);
+	for (size_t i = 0; i < m_constantPatches.m_leaves.size(); ++i)
+	{
+		m_constantPatches.m_origins[m_constantPatches.m_leaves[i].first] =
+		    static_cast<uint32_t>(i + 1);
+	}
+
+	optimize(root);
+	if (m_reassociation)
+	{
+		reassociate(root);
+	}
+
+	m_errorPos = te_parser::npos;
+	return root;
+}
+
+//--------------------------------------------------
+const char *te_parser::skip_comment(const char *next) noexcept
+{
+	if (next[0] != '/')
+	{
+		return next;
+	}
+	// multi-line comments
+	if (next[1] == '*')
+	{
+		const char *const commentEnd = std::strstr(next + 1, "*/");
+		return (commentEnd != nullptr) ? commentEnd + 2 : nullptr;
+	}
+	// single-line comments (the end of the line is left to be read as whitespace)
+	if (next[1] == '/')
+	{
+		return next + 2 + std::strcspn(next + 2, "\n\r");
+	}
+	return next;
+}
+
+//--------------------------------------------------
+bool te_parser::comments_join_tokens(const std::string_view formula) noexcept
+{
+	const auto isSpace = [](const char chr)
+	{ return (chr == ' ' || chr == '\t' || chr == '\n' || chr == '\r'); };
+	for (size_t position = formula.find('/'); position != std::string_view::npos;
+	     position        = formula.find('/', position + 1))
+	{
+		const char *const commentStart = formula.data() + position;
+		const char *const commentEnd   = skip_comment(commentStart);
+		// (a comment that isn't terminated fails to parse either way)
+		if (commentEnd == nullptr)
+		{
+			return false;
+		}
+		if (commentEnd == commentStart)
+		{
+			continue;
+		}
+		// (this is conservative: "f(/**/x)" is read without its comments too, harmlessly)
+		const auto endPosition = static_cast<size_t>(commentEnd - formula.data());
+		if (position > 0 && !isSpace(formula[position - 1]) && endPosition < formula.length() &&
+		    !isSpace(formula[endPosition]))
+		{
+			return true;
+		}
+		position = endPosition - 1;
+	}
+	return false;
+}
+
+//--------------------------------------------------
+void te_parser::remove_comments(std::string &expression)
+{
+	// the text is moved down over the comments, so that each character is copied once
+	const auto        formula = get_formula(expression);
+	const char       *next{formula.data()};
+	const char *const end{formula.data() + formula.length()};
+	size_t            length{0};
+	bool              terminated{true};
+	while (next != end)
+	{
+		// (everything after a comment that isn't terminated is left in place)
+		const char *const commentEnd = terminated ? skip_comment(next) : next;
+		if (commentEnd == nullptr)
+		{
+			terminated = false;
+		}
+		else if (commentEnd != next)
+		{
+			next = commentEnd;
+			continue;
+		}
+		expression[length++] = *next++;
+	}
+	expression.resize(length);
+}
+
+//--------------------------------------------------
+void te_parser::prepare_lowering(const std::span<const node_index> roots)
+{
+	m_nodeSharing.assign(m_nodes.size(), node_sharing{});
+	m_readyNodes.clear();
+	for (const auto root : roots)
+	{
+		count_node_uses(root);
+	}
+}
+
+//--------------------------------------------------
+void te_parser::record_variable_slots(te_program &program)
+{
+	// (each variable is only recorded once, however many times it was read)
+	std::sort(m_readVariables.begin(), m_readVariables.end());
+	m_readVariables.erase(std::unique(m_readVariables.begin(), m_readVariables.end()),
+	                      m_readVariables.end());
+	for (const auto *var : m_readVariables)
+	{
+		if (const auto slot = program.find_variable(get_variable(var->m_value)); slot >= 0)
+		{
+			program.m_variableSlots.emplace_back(var->m_name, static_cast<size_t>(slot));
+		}
+	}
+}
+
+//--------------------------------------------------
+bool te_parser::compile(const std::string_view expression)
+{
+	reset_state();
+	if (get_list_separator() == get_decimal_separator())
+	{
+		throw std::runtime_error("List and decimal separators cannot be the same.");
+	}
+	if (expression.empty())
+	{
+		m_expression.clear();
+		m_errorPos = 0;
+		return false;
+	}
+	m_expression.assign(expression);
+
+	// (comments are skipped while parsing, and then removed from the expression's text,
+	//  unless removing one joins the text around it, which is then read without them)
+	bool commentsRemoved{comments_join_tokens(get_formula(m_expression))};
+	if (commentsRemoved)
+	{
+		remove_comments(m_expression);
+	}
+	try
+	{
+		const auto formula =
+		    commentsRemoved ? std::string_view{m_expression} : get_formula(m_expression);
+		// expressions that only differ in their literals can share a program
+		std::string shape;
+		if (m_literalHoisting)
+		{
+			shape = get_literal_shape(formula, m_hoistedLiterals);
+			if (restore_from_literal_template(shape, commentsRemoved))
+			{
+				m_parseSuccess = true;
+				return true;
+			}
+		}
+
+		const auto symbolVersion = m_symbolVersion;
+		const auto root          = te_compile(formula, m_customFuncsAndVars, m_literalHoisting);
+		m_parseSuccess           = root.has_value();
+		if (!commentsRemoved)
+		{
+			remove_comments(m_expression);
+			commentsRemoved = true;
+		}
+		if (root.has_value())
+		{
+			// merge repeated subexpressions, and note which ones are needed more than once
+			node_index sharedRoot{*root};
+			if (can_share_subexpressions())
+			{
+				reset_shared_nodes();
+				sharedRoot = share_subexpressions(*root);
+			}
+			prepare_lowering({&sharedRoot, 1});
+			if (m_subtreeCaching)
+			{
+				m_nodeVariables.assign(m_nodes.size(), {});
+				std::vector<uint8_t> purity(m_nodes.size(), 0);
+				// (the whole expression is cached too, for when nothing changed)
+				if (mark_cached_subtrees(sharedRoot, purity) &&
+				    m_nodes[sharedRoot].m_argCount > 0)
+				{
+					m_nodeSharing[sharedRoot].m_cached = true;
+				}
+			}
+
+			auto program = std::make_shared<te_program>();
+			if (m_literalHoisting)
+			{
+				// the literals take the first slots, in the order that they appear
+				assert(m_hoistedLiteralCount == m_hoistedLiterals.size());
+				for (const auto &literal : m_hoistedLiterals)
+				{
+					program->add_variable(&literal);
+				}
+			}
+			te_lower(sharedRoot, *program);
+			// remember the names of the variables that were used (for batch evaluation)
+			record_variable_slots(*program);
+			if (m_literalHoisting)
+			{
+				// each expression sharing the program binds its own values to the literals
+				program->m_parameterCount = m_hoistedLiterals.size();
+				for (auto &instr : program->m_code)
+				{
+					if (instr.m_variable != nullptr && instr.m_index < program->m_parameterCount)
+					{
+						instr.m_variable = nullptr;
+					}
+				}
+				std::fill_n(program->m_variables.begin(), program->m_parameterCount, nullptr);
+				for (const auto &literal : m_hoistedLiterals)
+				{
+					program->m_variableIndex.erase(&literal);
+				}
+				// volatile resolved variables must be resolved again on every use
+				if (m_keepResolvedVariables || symbolVersion == m_symbolVersion)
+				{
+#ifndef TE_NO_BOOKKEEPING
+					m_literalTemplates.insert_or_assign(
+					    std::move(shape),
+					    literal_template{m_symbolVersion, program, m_usedFunctions, m_usedVars});
+#else
+					m_literalTemplates.insert_or_assign(std::move(shape),
+					                                    literal_template{m_symbolVersion, program});
+#endif
+				}
+			}
+
+			std::shared_ptr<te_compiled_expression> compiled{new te_compiled_expression};
+			compiled->m_expression    = m_expression;
+			compiled->m_program       = std::move(program);
+			compiled->m_literals      = m_hoistedLiterals;
+			m_compiledExpression      = std::move(compiled);
+			m_constantPatches.m_valid = true;
+		}
+	}
+	catch (const std::exception &expt)
+	{
+		m_parseSuccess     = false;
+		m_result           = te_nan;
+		m_lastErrorMessage = expt.what();
+		if (!commentsRemoved)
+		{
+			remove_comments(m_expression);
+		}
+	}
+	// the tree is no longer needed once it has been lowered (or failed to compile),
+	// unless set_constant() may need to fold it again
+	if (!m_constantPatches.m_valid || m_constantPatches.m_leaves.empty())
+	{
+		m_nodes.clear();
+	}
+	m_nodeVariables.clear();
+
+	reset_usr_resolved_if_necessary();
+
+	return m_parseSuccess;
+}
+
+//--------------------------------------------------
+std::shared_ptr<const te_compiled_formulas>
+te_parser::compile_formulas(std::span<const std::string> expressions)
+{
+	reset_state();
+	m_expression.clear();
+	if (get_list_separator() == get_decimal_separator())
+	{
+		throw std::runtime_error("List and decimal separators cannot be the same.");
+	}
+
+	std::shared_ptr<te_compiled_formulas> compiled{new te_compiled_formulas};
+	try
+	{
+		// parse all of the formulas into the same tree, so that they can share nodes
+		std::vector<node_index> roots;
+		roots.reserve(expressions.size());
+		for (const auto &expression : expressions)
+		{
+			std::string formula{expression};
+			std::optional<node_index> root;
+			if (formula.empty())
+			{
+				m_errorPos = 0;
+			}
+			else
+			{
+				// (see compile())
+				const bool commentsRemoved = comments_join_tokens(get_formula(formula));
+				if (commentsRemoved)
+				{
+					remove_comments(formula);
+				}
+				root = te_compile(commentsRemoved ? std::string_view{formula} : get_formula(formula),
+				                  m_customFuncsAndVars);
+				if (!commentsRemoved)
+				{
+					remove_comments(formula);
+				}
+			}
+			if (!root.has_value())
+			{
+				m_lastErrorMessage =
+				    "Formula " + std::to_string(roots.size()) + " failed to compile.";
+				break;
+			}
+			roots.push_back(*root);
+			compiled->m_expressions.push_back(std::move(formula));
+		}
+
+		if (roots.size() == expressions.size())
+		{
+			// merge the subexpressions that are repeated within and across formulas
+			// (a subtree can repeat across formulas without much of a tree around it,
+			//  so this doesn't skip small ones like compile() does)
+			reset_shared_nodes();
+			for (auto &root : roots)
+			{
+				root = share_subexpressions(root);
+			}
+
+			// lower the formulas one after the other into the same program, where each one
+			// leaves its result on the stack (and can re-read the temporaries of the others)
+			prepare_lowering(roots);
+			for (const auto root : roots)
+			{
+				te_lower(root, compiled->m_program);
+			}
+			record_variable_slots(compiled->m_program);
+
+			// also lower each formula on its own, for when the shared program fails
+			compiled->m_formulaPrograms.reserve(roots.size());
+			for (const auto root : roots)
+			{
+				auto &program = compiled->m_formulaPrograms.emplace_back();
+				// use the same variable slots, so that they can read the same frames
+				program.m_variables     = compiled->m_program.m_variables;
+				program.m_variableIndex = compiled->m_program.m_variableIndex;
+				prepare_lowering({&root, 1});
+				te_lower(root, program);
+			}
+			m_parseSuccess = true;
+		}
+	}
+	catch (const std::exception &expt)
+	{
+		m_parseSuccess     = false;
+		m_lastErrorMessage = expt.what();
+	}
+	m_nodes.clear();
+
+	reset_usr_resolved_if_necessary();
+
+	return m_parseSuccess ? compiled : nullptr;
+}
+
+//--------------------------------------------------
+te_type te_parser::evaluate()
+{
+	try
+	{
+		if (m_expression.empty())
+		{
+			m_parseSuccess     = false;
+			m_errorPos         = 0;
+			m_lastErrorMessage = "Expression is emtpy.";
+		}
+		if (m_compiledExpression == nullptr)
+		{
+			m_result = te_nan;
+		}
+		else if (const auto &program = *m_compiledExpression->m_program;
+		         program.get_cache_count() > 0)
+		{
+			// start over with empty caches if the expression changed
+			if (m_subtreeCacheProgram != &program)
+			{
+				m_subtreeCache.assign(program.get_cache_count(), {});
+				m_subtreeCacheProgram = &program;
+			}
+			m_result = program.evaluate_cached(m_subtreeCache, m_compiledExpression->m_literals);
+		}
+		else
+		{
+			m_result = program.evaluate_with_parameters(m_compiledExpression->m_literals);
+		}
+	}
+	catch (const std::exception &expt)
+	{
+		m_parseSuccess     = false;
+		m_result           = te_nan;
+		m_lastErrorMessage = expt.what();
+	}
+
+	reset_usr_resolved_if_necessary();
+
+	return m_result;
+}
+
+//--------------------------------------------------
+void te_parser::mark_variables_changed(std::span<const std::string_view> names)
+{
+	if (m_compiledExpression == nullptr ||
+	    m_subtreeCacheProgram != m_compiledExpression->m_program.get())
+	{
+		return;
+	}
+	for (const auto name : names)
+	{
+		const auto var = std::as_const(*this).find_variable_or_function(name);
+		if (var != m_customFuncsAndVars.cend() && is_variable(var->m_value))
+		{
+			m_subtreeCacheProgram->invalidate_caches(m_subtreeCache, get_variable(var->m_value));
+		}
+	}
+}
+
+//--------------------------------------------------
+bool te_parser::evaluate_batch(std::span<const te_column> columns, std::span<te_type> results)
+{
+	if (m_compiledExpression == nullptr)
+	{
+		if (m_expression.empty())
+		{
+			m_lastErrorMessage = "Expression is emtpy.";
+		}
+		std::fill(results.begin(), results.end(), te_nan);
+		return results.empty();
+	}
+	const te_program &program = *m_compiledExpression->m_program;
+
+	// map the columns to the program's variable slots
+	std::vector<const te_type *> slotColumns(program.m_variables.size(), nullptr);
+	for (const auto &column : columns)
+	{
+		const auto var = find_variable_or_function(column.m_name);
+		if (var == m_customFuncsAndVars.cend() || !is_variable(var->m_value))
+		{
+			throw std::runtime_error(std::string("Batch column is not a variable: ") +
+			                         std::string{column.m_name});
+		}
+		if (column.m_values.size() < results.size())
+		{
+			throw std::runtime_error(std::string("Batch column has fewer values than rows: ") +
+			                         std::string{column.m_name});
+		}
+		// variables that the expression does not use can be ignored
+		if (const auto slot = program.find_variable(get_variable(var->m_value)); slot >= 0)
+		{
+			slotColumns[static_cast<size_t>(slot)] = column.m_values.data();
+		}
+	}
+
+	const auto failedRows = program.evaluate_batch(slotColumns, results, m_lastErrorMessage,
+	                                               m_compiledExpression->m_literals);
+
+	reset_usr_resolved_if_necessary();
+
+	return (failedRows == 0);
+}
+
+//--------------------------------------------------
+te_type
+    te_parser::evaluate(const std::string_view expression)        // NOLINT(-readability-identifier-naming)
+{
+	if (m_compileCacheSize > 0 && !expression.empty())
+	{
+		if (restore_from_compile_cache(expression))
+		{
+			return evaluate();
+		}
+		// (copied before compiling, in case the expression is viewing m_expression)
+		std::string cacheKey{expression};
+		const auto  symbolVersion = m_symbolVersion;
+		if (compile(cacheKey))
+		{
+			// volatile resolved variables must be resolved again on every use
+			if (m_keepResolvedVariables || symbolVersion == m_symbolVersion)
+			{
+				add_to_compile_cache(std::move(cacheKey));
+			}
+			return evaluate();
+		}
+	}
+	else if (compile(expression))
+	{
+		return evaluate();
+	}
+
+	if (expression.empty())
+	{
+		m_parseSuccess     = false;
+		m_errorPos         = 0;
+		m_lastErrorMessage = "Expression is emtpy.";
+	}
+
+	return te_nan;
+}
+
+//--------------------------------------------------
+bool te_parser::restore_from_compile_cache(const std::string_view expression)
+{
+	const auto cached = m_compileCacheIndex.find(expression);
+	if (cached == m_compileCacheIndex.end())
+	{
+		++m_compileCacheMisses;
+		return false;
+	}
+	// the variables or functions have changed since this was compiled
+	if (cached->second->m_symbolVersion != m_symbolVersion)
+	{
+		const auto entry = cached->second;
+		m_compileCacheIndex.erase(cached);
+		m_compileCache.erase(entry);
+		++m_compileCacheMisses;
+		return false;
+	}
+
+	++m_compileCacheHits;
+	// move to the front, as the most recently used
+	m_compileCache.splice(m_compileCache.begin(), m_compileCache, cached->second);
+	const auto &entry = m_compileCache.front();
+
+	reset_state();
+	m_compiledExpression = entry.m_compiledExpression;
+	m_expression         = m_compiledExpression->get_expression();
+	m_parseSuccess       = true;
+#ifndef TE_NO_BOOKKEEPING
+	m_usedFunctions = entry.m_usedFunctions;
+	m_usedVars      = entry.m_usedVars;
+#endif
+	return true;
+}
+
+//--------------------------------------------------
+void te_parser::add_to_compile_cache(std::string expression)
+{
+	// remove any outdated version of the expression
+	if (const auto cached = m_compileCacheIndex.find(expression);
+	    cached != m_compileCacheIndex.end())
+	{
+		const auto entry = cached->second;
+		m_compileCacheIndex.erase(cached);
+		m_compileCache.erase(entry);
+	}
+
+#ifndef TE_NO_BOOKKEEPING
+	m_compileCache.push_front({std::move(expression), m_symbolVersion, m_compiledExpression,
+	                           m_usedFunctions, m_usedVars});
+#else
+	m_compileCache.push_front({std::move(expression), m_symbolVersion, m_compiledExpression});
+#endif
+	m_compileCacheIndex.emplace(m_compileCache.front().m_expression, m_compileCache.begin());
+	trim_compile_cache();
+}
+
+//--------------------------------------------------
+void te_parser::trim_compile_cache()
+{
+	while (m_compileCache.size() > m_compileCacheSize)
+	{
+		m_compileCacheIndex.erase(m_compileCache.back().m_expression);
+		m_compileCache.pop_back();
+	}
+}
+
+//--------------------------------------------------
+// cppcheck-suppress unusedFunction
+std::string te_parser::list_available_functions_and_variables()
+{
+	std::string report = "Built-in Functions:\n";
+	for (const auto &func : te_builtin_functions)
+	{
+		report.append(func.m_name).append("\n");
+	}
+	report.append("\nCustom Functions & Variables:\n");
+	for (const auto &func : m_customFuncsAndVars)
+	{
+		report.append(func.m_name).append("\n");
+	}
+	return report;
+}
+
+//--------------------------------------------------
+// cppcheck-suppress unusedFunction
+std::string te_parser::info()
+{
+	std::string sysInfo{"tinyexpr++ system info:\n=======================\n"};
+#ifdef TE_FLOAT
+	sysInfo += "Data type:                float\n";
+#elif defined(TE_LONG_DOUBLE)
+	sysInfo += "Data type:                long double\n";
+#else
 	sysInfo += "Data type:                double\n";
 #endif
 	if constexpr (supports_32bit())
@@ -2617,5 +5812,497 @@ std::string te_parser::info()
 #else
 	sysInfo += "Function-use tracking:    enabled\n";
 #endif
+	sysInfo += "SIMD batch kernels:       " + std::string{te_simd::get_kernels().m_name} + "\n";
 	return sysInfo;
 }
+
+#ifndef TE_NO_BOOKKEEPING
+/// @brief Threads that are kept waiting between recalculations, and that run a job
+///     alongside the calling thread when asked to.
+class te_formula_graph::worker_pool
+{
+  public:
+	worker_pool()                               = default;
+	worker_pool(const worker_pool &)            = delete;
+	worker_pool &operator=(const worker_pool &) = delete;
+
+	~worker_pool()
+	{
+		{
+			const std::lock_guard lock{m_mutex};
+			m_stopping = true;
+		}
+		m_jobReady.notify_all();
+		// (the threads are joined as they are destroyed)
+	}
+
+	/// @brief Starts more threads, if there are fewer than @c threadCount.
+	void reserve(const size_t threadCount)
+	{
+		m_threads.reserve(threadCount);
+		while (m_threads.size() < threadCount)
+		{
+			m_threads.emplace_back(&worker_pool::work, this, m_threads.size(), m_generation);
+		}
+	}
+
+	/// @brief Runs @c job on the calling thread and on the first @c helperCount threads,
+	///     and returns when they have all finished it.
+	/// @note @c job must not throw.
+	void run(const size_t helperCount, const std::function<void()> &job)
+	{
+		assert(helperCount <= m_threads.size());
+		{
+			const std::lock_guard lock{m_mutex};
+			m_job         = &job;
+			m_helperCount = helperCount;
+			m_running     = helperCount;
+			++m_generation;
+		}
+		m_jobReady.notify_all();
+		job();
+		std::unique_lock lock{m_mutex};
+		m_jobDone.wait(lock, [this]() { return m_running == 0; });
+	}
+
+  private:
+	void work(const size_t id, uint64_t seenGeneration)
+	{
+		std::unique_lock lock{m_mutex};
+		while (true)
+		{
+			const auto hasNewJob = [this, id, seenGeneration]()
+			{ return m_stopping || (m_generation != seenGeneration && id < m_helperCount); };
+			m_jobReady.wait(lock, hasNewJob);
+			if (m_stopping)
+			{
+				return;
+			}
+			seenGeneration  = m_generation;
+			const auto &job = *m_job;
+			lock.unlock();
+			job();
+			lock.lock();
+			if (--m_running == 0)
+			{
+				m_jobDone.notify_one();
+			}
+		}
+	}
+
+	std::mutex                   m_mutex;
+	std::condition_variable      m_jobReady;
+	std::condition_variable      m_jobDone;
+	const std::function<void()> *m_job{nullptr};
+	/// @brief The number of threads that the current job is for.
+	size_t m_helperCount{0};
+	/// @brief The number of those threads that haven't finished it yet.
+	size_t m_running{0};
+	/// @brief Incremented for each job, so that a thread doesn't run the same one twice.
+	uint64_t m_generation{0};
+	bool     m_stopping{false};
+	// (last, so that the threads are joined before the rest is destroyed)
+	std::vector<std::jthread> m_threads;
+};
+
+//--------------------------------------------------
+te_formula_graph::te_formula_graph() { m_parser.set_symbol_index_enabled(true); }
+
+//--------------------------------------------------
+te_formula_graph::~te_formula_graph() = default;
+
+//--------------------------------------------------
+void te_formula_graph::set_input(const std::string_view name, const te_type value)
+{
+	const auto index = find_or_add_cell(name);
+	auto &input      = m_cells[index];
+	if (input.m_isFormula)
+	{
+		throw std::runtime_error(std::string("Cannot set a formula as an input: ") +
+		                         std::string{name});
+	}
+	*input.m_value = value;
+	mark_dirty(index);
+}
+
+//--------------------------------------------------
+bool te_formula_graph::set_formula(const std::string_view name, const std::string_view expression)
+{
+	const auto index = find_or_add_cell(name);
+	m_cells[index].m_isFormula = true;
+	m_cells[index].m_expression.assign(expression);
+	compile_cell(index);
+	mark_dirty(index);
+	return (m_cells[index].m_compiled != nullptr);
+}
+
+//--------------------------------------------------
+void te_formula_graph::remove(const std::string_view name)
+{
+	const auto position = m_cellIndices.find(name);
+	if (position == m_cellIndices.end())
+	{
+		return;
+	}
+	const auto index = position->second;
+	unlink_cell(index);
+	m_cellIndices.erase(position);
+	m_parser.remove_variable_or_function(name);
+
+	auto &removed     = m_cells[index];
+	removed.m_removed = true;
+	removed.m_compiled.reset();
+	// the formulas that used it can no longer be compiled
+	const auto dependents = std::move(removed.m_dependents);
+	removed.m_dependents.clear();
+	for (const auto dependent : dependents)
+	{
+		compile_cell(dependent);
+		mark_dirty(dependent);
+	}
+}
+
+//--------------------------------------------------
+void te_formula_graph::add_variable_or_function(te_variable var)
+{
+	if (m_cellIndices.find(var.m_name) != m_cellIndices.end())
+	{
+		throw std::runtime_error(std::string("Name is already used by an input or formula: ") +
+		                         var.m_name);
+	}
+	m_parser.add_variable_or_function(std::move(var));
+	retry_failed_formulas();
+}
+
+//--------------------------------------------------
+size_t te_formula_graph::recalculate()
+{
+	std::vector<size_t> order;
+	std::vector<size_t> levelStarts;
+	schedule_dirty_cells(order, levelStarts);
+	for (const auto index : order)
+	{
+		evaluate_cell(index);
+	}
+	return order.size();
+}
+
+//--------------------------------------------------
+size_t te_formula_graph::recalculate_parallel(size_t threadCount)
+{
+	std::vector<size_t> order;
+	std::vector<size_t> levelStarts;
+	schedule_dirty_cells(order, levelStarts);
+
+	if (threadCount == 0)
+	{
+		threadCount = std::max<size_t>(std::thread::hardware_concurrency(), 1);
+	}
+	threadCount =
+	    std::min(threadCount, (order.size() + PARALLEL_CHUNK_SIZE - 1) / PARALLEL_CHUNK_SIZE);
+	if (threadCount <= 1)
+	{
+		for (const auto index : order)
+		{
+			evaluate_cell(index);
+		}
+		return order.size();
+	}
+
+	if (m_workers == nullptr)
+	{
+		m_workers = std::make_unique<worker_pool>();
+	}
+	m_workers->reserve(threadCount - 1);
+
+	std::exception_ptr firstException;
+	std::mutex         exceptionMutex;
+	const auto         evaluateCells = [&](const size_t first, const size_t last)
+	{
+		for (size_t i = first; i < last; ++i)
+		{
+			try
+			{
+				evaluate_cell(order[i]);
+			}
+			catch (...)
+			{
+				const std::lock_guard lock{exceptionMutex};
+				if (firstException == nullptr)
+				{
+					firstException = std::current_exception();
+				}
+			}
+		}
+	};
+
+	// the threads take chunks of the current level until there are none left
+	size_t                      levelFirst{0};
+	size_t                      levelLast{0};
+	std::atomic<size_t>         nextChunk{0};
+	const std::function<void()> takeChunks = [&]()
+	{
+		while (true)
+		{
+			const auto first = levelFirst + nextChunk.fetch_add(PARALLEL_CHUNK_SIZE);
+			if (first >= levelLast)
+			{
+				break;
+			}
+			evaluateCells(first, std::min(first + PARALLEL_CHUNK_SIZE, levelLast));
+		}
+	};
+
+	for (size_t level = 0; level + 1 < levelStarts.size(); ++level)
+	{
+		levelFirst = levelStarts[level];
+		levelLast  = levelStarts[level + 1];
+		if (levelLast - levelFirst > PARALLEL_CHUNK_SIZE)
+		{
+			nextChunk = 0;
+			// (no more threads than the level has chunks for)
+			m_workers->run(std::min(threadCount - 1, (levelLast - levelFirst - 1) /
+			                                             PARALLEL_CHUNK_SIZE),
+			               takeChunks);
+		}
+		else
+		{
+			evaluateCells(levelFirst, levelLast);
+		}
+	}
+
+	if (firstException != nullptr)
+	{
+		std::rethrow_exception(firstException);
+	}
+	return order.size();
+}
+
+//--------------------------------------------------
+void te_formula_graph::schedule_dirty_cells(std::vector<size_t> &order,
+                                            std::vector<size_t> &levelStarts)
+{
+	// every dependent of a dirty cell is dirty too, so the dirty cells can be sorted
+	// topologically by only counting the dirty precedents of each one
+	for (const auto index : m_dirtyCells)
+	{
+		for (const auto dependent : m_cells[index].m_dependents)
+		{
+			assert(m_cells[dependent].m_dirty);
+			++m_cells[dependent].m_pendingPrecedents;
+		}
+	}
+	std::vector<size_t> level;
+	std::copy_if(m_dirtyCells.cbegin(), m_dirtyCells.cend(), std::back_inserter(level),
+	             [this](const size_t index) { return m_cells[index].m_pendingPrecedents == 0; });
+
+	std::vector<size_t> nextLevel;
+	while (!level.empty())
+	{
+		const auto levelStart = order.size();
+		for (const auto index : level)
+		{
+			auto &current   = m_cells[index];
+			current.m_dirty = false;
+			// (inputs are only scheduled to release their dependents)
+			if (current.m_isFormula && !current.m_removed)
+			{
+				order.push_back(index);
+			}
+			for (const auto dependent : current.m_dependents)
+			{
+				if (--m_cells[dependent].m_pendingPrecedents == 0)
+				{
+					nextLevel.push_back(dependent);
+				}
+			}
+		}
+		if (order.size() > levelStart)
+		{
+			levelStarts.push_back(levelStart);
+		}
+		level.swap(nextLevel);
+		nextLevel.clear();
+	}
+	levelStarts.push_back(order.size());
+	m_dirtyCells.clear();
+}
+
+//--------------------------------------------------
+void te_formula_graph::evaluate_cell(const size_t index)
+{
+	auto &formula = m_cells[index];
+	if (formula.m_compiled != nullptr)
+	{
+		*formula.m_value = formula.m_compiled->evaluate(formula.m_error);
+	}
+	else
+	{
+		*formula.m_value = te_parser::te_nan;
+	}
+}
+
+//--------------------------------------------------
+te_type te_formula_graph::get_value(const std::string_view name) const
+{
+	const auto position = m_cellIndices.find(name);
+	return (position != m_cellIndices.cend()) ? *m_cells[position->second].m_value :
+	                                            te_parser::te_nan;
+}
+
+//--------------------------------------------------
+const std::string &te_formula_graph::get_error(const std::string_view name) const
+{
+	static const std::string noError;
+	const auto               position = m_cellIndices.find(name);
+	return (position != m_cellIndices.cend()) ? m_cells[position->second].m_error : noError;
+}
+
+//--------------------------------------------------
+size_t te_formula_graph::find_or_add_cell(const std::string_view name)
+{
+	if (const auto position = m_cellIndices.find(name); position != m_cellIndices.end())
+	{
+		return position->second;
+	}
+	// (looked up through the const parser, since the non-const accessors
+	//  invalidate its symbol index and compile cache)
+	const auto &symbols = std::as_const(m_parser).get_variables_and_functions();
+	if (symbols.find(name) != symbols.cend())
+	{
+		throw std::runtime_error(std::string("Name is already used by a variable or function: ") +
+		                         std::string{name});
+	}
+
+	auto &added = m_cells.emplace_back();
+	m_parser.add_variable_or_function({te_variable::name_type{name}, added.m_value.get()});
+	const auto index = m_cells.size() - 1;
+	m_cellIndices.emplace(te_variable::name_type{name}, index);
+	retry_failed_formulas();
+	return index;
+}
+
+//--------------------------------------------------
+void te_formula_graph::compile_cell(const size_t index)
+{
+	unlink_cell(index);
+	auto &formula = m_cells[index];
+	formula.m_compiled.reset();
+	formula.m_error.clear();
+
+	if (!m_parser.compile(formula.m_expression))
+	{
+		formula.m_error = !m_parser.get_last_error_message().empty() ?
+		                      m_parser.get_last_error_message() :
+		                      "Syntax error at position " +
+		                          std::to_string(m_parser.get_last_error_position()) + ".";
+		m_failedFormulas.push_back(index);
+		return;
+	}
+
+	std::vector<size_t> precedents;
+	for (const auto &name : m_parser.get_variables_used())
+	{
+		if (const auto position = m_cellIndices.find(name); position != m_cellIndices.cend())
+		{
+			precedents.push_back(position->second);
+		}
+	}
+	if (creates_cycle(index, precedents))
+	{
+		formula.m_error = "Circular reference.";
+		m_failedFormulas.push_back(index);
+		return;
+	}
+
+	for (const auto precedent : precedents)
+	{
+		m_cells[precedent].m_dependents.push_back(index);
+	}
+	formula.m_precedents = std::move(precedents);
+	formula.m_compiled   = m_parser.share_compiled_expression();
+}
+
+//--------------------------------------------------
+void te_formula_graph::unlink_cell(const size_t index)
+{
+	for (const auto precedent : m_cells[index].m_precedents)
+	{
+		auto &dependents = m_cells[precedent].m_dependents;
+		dependents.erase(std::remove(dependents.begin(), dependents.end(), index),
+		                 dependents.end());
+	}
+	m_cells[index].m_precedents.clear();
+}
+
+//--------------------------------------------------
+bool te_formula_graph::creates_cycle(const size_t index, const std::vector<size_t> &precedents)
+{
+	// look for the precedents downstream of the formula
+	// (marks from earlier searches are always older than these two)
+	m_visitGeneration += 2;
+	const auto precedentMark = m_visitGeneration - 1;
+	const auto visitedMark   = m_visitGeneration;
+	for (const auto precedent : precedents)
+	{
+		m_cells[precedent].m_visitMark = precedentMark;
+	}
+	std::vector<size_t> pending{index};
+	while (!pending.empty())
+	{
+		auto &current = m_cells[pending.back()];
+		pending.pop_back();
+		if (current.m_visitMark == precedentMark)
+		{
+			return true;
+		}
+		current.m_visitMark = visitedMark;
+		for (const auto dependent : current.m_dependents)
+		{
+			if (m_cells[dependent].m_visitMark != visitedMark)
+			{
+				pending.push_back(dependent);
+			}
+		}
+	}
+	return false;
+}
+
+//--------------------------------------------------
+void te_formula_graph::mark_dirty(const size_t index)
+{
+	std::vector<size_t> pending{index};
+	while (!pending.empty())
+	{
+		const auto current = pending.back();
+		pending.pop_back();
+		if (m_cells[current].m_dirty)
+		{
+			continue;
+		}
+		m_cells[current].m_dirty = true;
+		m_dirtyCells.push_back(current);
+		pending.insert(pending.end(), m_cells[current].m_dependents.cbegin(),
+		               m_cells[current].m_dependents.cend());
+	}
+}
+
+//--------------------------------------------------
+void te_formula_graph::retry_failed_formulas()
+{
+	auto failedFormulas = std::move(m_failedFormulas);
+	m_failedFormulas.clear();
+	std::sort(failedFormulas.begin(), failedFormulas.end());
+	failedFormulas.erase(std::unique(failedFormulas.begin(), failedFormulas.end()),
+	                     failedFormulas.end());
+	for (const auto index : failedFormulas)
+	{
+		// (formulas that were removed or fixed since then are skipped)
+		if (!m_cells[index].m_removed && m_cells[index].m_compiled == nullptr)
+		{
+			compile_cell(index);
+			mark_dirty(index);
+		}
+	}
+}
+#endif
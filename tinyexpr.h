@@ -6,6 +6,7 @@
 #include <cctype>
 #include <cfloat>
 #include <cmath>
+#include <cstddef>
 #include <cstdint>
 #include <cstdio>
 #include <cstdlib>
@@ -14,8 +15,13 @@
 #include <functional>
 #include <initializer_list>
 #include <limits>
+#include <list>
+#include <map>
+#include <memory>
+#include <optional>
 #include <random>
 #include <set>
+#include <span>
 #include <stdexcept>
 #include <string>
 #include <string_view>
@@ -28,6 +34,7 @@
 // type_traits to get n_args.
 #include <tuple>
 #include <type_traits>
+#include <unordered_map>
 
 class te_parser;
 
@@ -108,6 +115,8 @@ using te_confun21 = te_type (*)(const te_expr*, te_type, te_type, te_type, te_ty
 using te_confun22 = te_type (*)(const te_expr*, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type);
 using te_confun23 = te_type (*)(const te_expr*, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type);
 using te_confun24 = te_type (*)(const te_expr*, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type, te_type);
+// variadic functions (which are passed their arguments as an array, with any number of them)
+using te_funv = te_type (*)(const te_type*, size_t);
 // clang-format on
 template <typename FuncType>
 struct te_fun_traits;
@@ -182,7 +191,8 @@ using te_variant_type =
                  te_confun0, te_confun1, te_confun2, te_confun3, te_confun4, te_confun5, te_confun6,
                  te_confun7, te_confun8, te_confun9, te_confun10, te_confun11, te_confun12,
                  te_confun13, te_confun14, te_confun15, te_confun16, te_confun17, te_confun18,
-                 te_confun19, te_confun20, te_confun21, te_confun22, te_confun23, te_confun24>;
+                 te_confun19, te_confun20, te_confun21, te_confun22, te_confun23, te_confun24,
+                 te_funv>;
 
 /// @brief A variable's flags, effecting how it is evaluated.
 /// @note This is a bitmask, so flags (TE_PURE and TE_VARIADIC) can be OR'ed.
@@ -196,15 +206,21 @@ enum te_variable_flags
 	///     (i.e., only updated when expression is compiled).
 	TE_PURE = (1 << 0),
 	/// @brief Function that can take 1-7 argument (unused arguments are set to NaN).
+	/// @note A te_funv function is always variadic and is only passed the arguments
+	///     that it was called with.
 	TE_VARIADIC = (1 << 1)
 };
 
 /// @private
+/// @note This is transparent, so that names can be looked up as string views
+///     without copying them into strings first.
 class te_string_less
 {
   public:
+	using is_transparent = void;
+
 	[[nodiscard]]
-	bool operator()(const std::string &lhv, const std::string &rhv) const
+	constexpr bool operator()(const std::string_view lhv, const std::string_view rhv) const noexcept
 	{
 		const auto minStrLen = std::min(lhv.length(), rhv.length());
 		for (size_t i = 0; i < minStrLen; ++i)
@@ -229,9 +245,11 @@ class te_string_less
 	}
 };
 
-/// @brief A compiled expression.
-/// @details Can also be an additional object that can be passed to
-///     te_confun0-te_confun7 functions via a te_variable.
+/// @brief An additional object that can be passed to closures
+///     (te_confun0-te_confun24 functions) via a te_variable.
+/// @details Derive from this to pass your own data to your closures.
+///     (Expressions are compiled into te_node trees and te_program bytecode,
+///     so this is only used for closures' context objects.)
 class te_expr
 {
   public:
@@ -263,7 +281,7 @@ class te_expr
 	/// @brief The te_type constant, te_type pointer, or function to bind to.
 	te_variant_type m_value{static_cast<te_type>(0.0)};
 	/// @brief Additional parameters.
-	std::vector<te_expr *> m_parameters{nullptr};
+	std::vector<te_expr *> m_parameters;
 };
 
 /// @brief Custom variable or function that can be added to a te_parser.
@@ -292,6 +310,872 @@ class te_variable
 	te_expr *m_context{nullptr};
 };
 
+/// @brief A built-in function or constant.
+/// @details Unlike te_variable, this is a literal type, so that the builtins can be
+///     stored in a table that is built at compile time.
+/// @private
+struct te_builtin
+{
+	/// @brief The name as it would appear in a formula.
+	std::string_view m_name;
+	/// @brief The te_type constant or function to bind the name to.
+	te_variant_type m_value;
+	/// @brief The type that m_value represents.
+	te_variable_flags m_type{TE_DEFAULT};
+	/// @brief Builtins are never closures, so this is always null
+	///     (it mirrors te_variable's context).
+	te_expr *m_context{nullptr};
+};
+
+namespace std
+{
+/// @private
+/// @brief Orders variables by name (case insensitively), and allows looking them up by
+///     name alone (e.g., `std::set<te_variable>::find(std::string_view)`).
+template <>
+struct less<te_variable>
+{
+	using is_transparent = void;
+
+	[[nodiscard]]
+	bool operator()(const te_variable &lhv, const te_variable &rhv) const noexcept
+	{
+		return te_string_less{}(lhv.m_name, rhv.m_name);
+	}
+
+	[[nodiscard]]
+	bool operator()(const te_variable &lhv, const std::string_view rhv) const noexcept
+	{
+		return te_string_less{}(lhv.m_name, rhv);
+	}
+
+	[[nodiscard]]
+	bool operator()(const std::string_view lhv, const te_variable &rhv) const noexcept
+	{
+		return te_string_less{}(lhv, rhv.m_name);
+	}
+};
+}        // namespace std
+
+/// @brief A column of values to bind to a variable in te_parser::evaluate_batch().
+class te_column
+{
+  public:
+	/// @brief The name of the variable.
+	std::string_view m_name;
+	/// @brief The variable's values, one per row.
+	std::span<const te_type> m_values;
+};
+
+/// @brief A compiled expression, lowered into flat, stack-based bytecode.
+/// @details te_parser::compile() lowers its optimized expression tree into a program,
+///     which evaluate() then runs in a single dispatch loop (rather than recursively
+///     visiting every node of the tree).
+/// @private
+class te_program
+{
+	friend class te_parser;
+	friend class te_compiled_expression;
+	friend class te_compiled_formulas;
+
+  public:
+	/// @brief The signature of the trampolines used to call functions
+	///     with their arguments read from the evaluation stack.
+	using call_thunk = te_type (*)(const te_variant_type &, const te_expr *, const te_type *);
+	/// @brief The signature of vectorized kernels that apply a function in place
+	///     to a block of values.
+	using unary_kernel = void (*)(te_type *, size_t);
+	/// @brief The signature of vectorized kernels that combine a block of values
+	///     into a block of left-hand values.
+	using binary_kernel = void (*)(te_type *, const te_type *, size_t);
+
+	/// @brief The last value of a cached subtree, kept by the caller between evaluations.
+	struct cached_value
+	{
+		te_type m_value{0};
+		bool    m_valid{false};
+	};
+
+	/// @returns @c true if nothing has been compiled into the program.
+	[[nodiscard]]
+	bool empty() const noexcept
+	{
+		return m_code.empty();
+	}
+
+	/// @brief Removes all instructions from the program.
+	void clear() noexcept
+	{
+		m_code.clear();
+		m_calls.clear();
+		m_variables.clear();
+		m_variableIndex.clear();
+		m_variableSlots.clear();
+		m_cacheEnds.clear();
+		m_slotCaches.clear();
+		m_currentStackDepth = m_maxStackDepth = 0;
+		m_tempCount         = 0;
+		m_parameterCount    = 0;
+		m_hasBranches       = false;
+	}
+
+	/// @returns The number of literal parameters that the program reads
+	///     (see te_parser::set_literal_hoisting_enabled()).
+	[[nodiscard]]
+	size_t get_parameter_count() const noexcept
+	{
+		return m_parameterCount;
+	}
+
+	/// @returns The number of subtrees whose values can be cached between evaluations.
+	[[nodiscard]]
+	size_t get_cache_count() const noexcept
+	{
+		return m_cacheEnds.size();
+	}
+
+	/** @brief Runs the program, re-using the values of cached subtrees that are still valid.
+	    @param caches The values of the cached subtrees (one per get_cache_count()),
+	        which are updated for the subtrees that are evaluated.
+	    @param parameters The values of the literal parameters (one per get_parameter_count()).
+	    @returns The result, or NaN if the program is empty.
+	    @throws std::runtime_error Throws an exception if a function throws
+	        (e.g., on division by zero).*/
+	[[nodiscard]]
+	te_type evaluate_cached(std::span<cached_value> caches,
+	                        std::span<const te_type> parameters = {}) const;
+
+	/// @brief Invalidates the cached subtrees that read a variable.
+	/// @param caches The values of the cached subtrees.
+	/// @param var The variable that changed.
+	void invalidate_caches(std::span<cached_value> caches, const te_type *var) const noexcept
+	{
+		const auto slot = find_variable(var);
+		if (slot >= 0 && static_cast<size_t>(slot) < m_slotCaches.size())
+		{
+			for (const auto cache : m_slotCaches[static_cast<size_t>(slot)])
+			{
+				caches[cache].m_valid = false;
+			}
+		}
+	}
+
+	/** @brief Runs the program.
+	    @returns The result, or NaN if the program is empty.
+	    @throws std::runtime_error Throws an exception if a function throws
+	        (e.g., on division by zero).*/
+	[[nodiscard]]
+	te_type evaluate() const;
+
+	/** @brief Runs the program with its literal parameters bound to values.
+	    @param parameters The values of the literal parameters (one per get_parameter_count()).
+	    @returns The result, or NaN if the program is empty.
+	    @throws std::runtime_error Throws an exception if a function throws
+	        (e.g., on division by zero).*/
+	[[nodiscard]]
+	te_type evaluate_with_parameters(std::span<const te_type> parameters) const;
+
+	/** @brief Runs the program, reading variables from a frame instead of
+	        from their bound addresses.
+	    @param frame The variables' values, indexed by their slots in the variable table.
+	    @returns The result, or NaN if the program is empty.
+	    @throws std::runtime_error Throws an exception if a function throws
+	        (e.g., on division by zero).*/
+	[[nodiscard]]
+	te_type evaluate(std::span<const te_type> frame) const;
+
+	/** @brief Runs a program that several formulas were lowered into.
+	    @param[out] results Where to write the formulas' results, in the order
+	        that they were lowered.
+	    @throws std::runtime_error Throws an exception if a function throws
+	        (e.g., on division by zero).*/
+	void evaluate_all(std::span<te_type> results) const;
+
+	/** @brief Runs a program that several formulas were lowered into,
+	        reading variables from a frame.
+	    @param frame The variables' values, indexed by their slots in the variable table.
+	    @param[out] results Where to write the formulas' results, in the order
+	        that they were lowered.
+	    @throws std::runtime_error Throws an exception if a function throws
+	        (e.g., on division by zero).*/
+	void evaluate_all(std::span<const te_type> frame, std::span<te_type> results) const;
+
+	/// @returns The slot that a variable is read from in frames,
+	///     or @c -1 if the program does not use the variable.
+	/// @param name The name of the variable.
+	[[nodiscard]]
+	int64_t find_slot(std::string_view name) const;
+
+	/// @returns A frame filled with the variables' currently bound values
+	///     (and the literal parameters' values, which come first).
+	/// @param parameters The values of the literal parameters (one per get_parameter_count()).
+	[[nodiscard]]
+	std::vector<te_type> make_frame(std::span<const te_type> parameters = {}) const;
+
+  private:
+	/// @brief The instructions that the program can execute.
+	/// @details Along with the basic operations, common patterns (e.g., `a+5` or `a*b+c`)
+	///     are fused into single superinstructions.
+	enum class opcode : uint8_t
+	{
+		/// @brief Pushes a constant.
+		OP_CONSTANT,
+		/// @brief Pushes a variable's value.
+		OP_VARIABLE,
+		/// @brief Pushes a variable's value plus a constant.
+		OP_VARIABLE_ADD_CONSTANT,
+		/// @brief Pushes a variable's value times a constant.
+		OP_VARIABLE_MUL_CONSTANT,
+		OP_ADD,
+		OP_SUB,
+		OP_MUL,
+		OP_DIVIDE,
+		/// @brief Adds a constant to the top of the stack.
+		OP_ADD_CONSTANT,
+		/// @brief Multiplies the top of the stack by a constant.
+		OP_MUL_CONSTANT,
+		/// @brief Adds a variable's value to the top of the stack.
+		OP_ADD_VARIABLE,
+		/// @brief Subtracts a variable's value from the top of the stack.
+		OP_SUB_VARIABLE,
+		/// @brief Multiplies the top of the stack by a variable's value.
+		OP_MUL_VARIABLE,
+		/// @brief Pops `a`, `b`, and `c`, and pushes `(a*b)+c`.
+		OP_MUL_ADD,
+		/// @brief Pops `a`, `b`, and `c`, and pushes `a+(b*c)`.
+		OP_ADD_MUL,
+		OP_NEGATE,
+		/// @brief Calls a function without any arguments.
+		OP_CALL0,
+		/// @brief Calls a function with one argument.
+		OP_CALL1,
+		/// @brief Calls a function with two arguments.
+		OP_CALL2,
+		/// @brief Calls any other function or closure (through its thunk).
+		OP_CALL,
+		/// @brief Calls a variadic function with however many arguments it was given.
+		OP_CALLV,
+		/// @brief Jumps to another instruction.
+		OP_JUMP,
+		/// @brief Pops a condition and jumps if it is false.
+		OP_JUMP_IF_FALSE,
+		/// @brief If the top of the stack is a finite, false value, replaces it
+		///     with @c 0 and jumps; otherwise, leaves it in place.
+		/// @details Skips the rest of an AND whose result is already known.
+		OP_AND_JUMP,
+		/// @brief If the top of the stack is a finite, true value, replaces it
+		///     with @c 1 and jumps; otherwise, leaves it in place.
+		/// @details Skips the rest of an OR whose result is already known.
+		OP_OR_JUMP,
+		/// @brief If the top of the stack is not finite, replaces it with NaN
+		///     and jumps; otherwise, leaves it in place.
+		OP_NAN_JUMP,
+		/// @brief Copies the top of the stack into a temporary (leaving it in place).
+		OP_STORE_TEMP,
+		/// @brief Pushes a temporary's value.
+		OP_LOAD_TEMP,
+		/// @brief If a cached subtree's value is valid, pushes it and jumps past the subtree.
+		OP_CACHE_LOAD,
+		/// @brief Copies the top of the stack into a subtree's cached value (leaving it in place).
+		OP_CACHE_STORE
+	};
+
+	struct instruction
+	{
+		opcode m_opcode{opcode::OP_CONSTANT};
+		/// @brief Index into the call table (for function calls), the variable table
+		///     (for variables), the code (for jumps), or the temporaries.
+		uint32_t       m_index{0};
+		te_type        m_constant{0};
+		const te_type *m_variable{nullptr};
+	};
+
+	struct call
+	{
+		te_variant_type m_function;
+		call_thunk      m_thunk{nullptr};
+		te_fun0         m_fun0{nullptr};
+		te_fun1         m_fun1{nullptr};
+		te_fun2         m_fun2{nullptr};
+		te_funv         m_funv{nullptr};
+		const te_expr  *m_context{nullptr};
+		size_t          m_arity{0};
+		/// @brief Vectorized versions of @c m_fun1 and @c m_fun2 (if available)
+		///     for batch evaluation.
+		unary_kernel  m_kernel1{nullptr};
+		binary_kernel m_kernel2{nullptr};
+	};
+
+	/// @brief Appends an instruction.
+	/// @param instr The instruction.
+	/// @param stackEffect The number of values the instruction pushes onto
+	///     (or, if negative, pops from) the stack.
+	void emit(instruction instr, const int64_t stackEffect)
+	{
+		if (instr.m_variable != nullptr)
+		{
+			instr.m_index = add_variable(instr.m_variable);
+		}
+		m_code.push_back(instr);
+		m_currentStackDepth += stackEffect;
+		m_maxStackDepth = std::max(m_maxStackDepth, m_currentStackDepth);
+	}
+
+	/// @brief Appends a function call.
+	/// @param func The function's information.
+	/// @param op The call opcode to use.
+	void emit_call(call func, const opcode op)
+	{
+		const auto arity = static_cast<int64_t>(func.m_arity);
+		m_calls.push_back(std::move(func));
+		emit({op, static_cast<uint32_t>(m_calls.size() - 1), 0, nullptr}, 1 - arity);
+	}
+
+	/// @brief Appends a jump whose target is filled in later by patch_jump().
+	/// @param op The jump opcode to use.
+	/// @param stackEffect The number of values the jump pops from the stack (as a negative).
+	/// @returns The jump's position in the code.
+	[[nodiscard]]
+	size_t emit_jump(const opcode op, const int64_t stackEffect)
+	{
+		emit({op, 0, 0, nullptr}, stackEffect);
+		m_hasBranches = true;
+		return m_code.size() - 1;
+	}
+
+	/// @brief Points a jump at the next instruction to be appended.
+	/// @param jump The jump's position in the code, as returned by emit_jump().
+	void patch_jump(const size_t jump) noexcept
+	{
+		m_code[jump].m_index = static_cast<uint32_t>(m_code.size());
+	}
+
+	/// @returns A new temporary, for a value that is computed once and then re-read.
+	[[nodiscard]]
+	uint32_t add_temp() noexcept
+	{
+		return static_cast<uint32_t>(m_tempCount++);
+	}
+
+	/// @returns The number of values that a run needs room for:
+	///     the stack, followed by the temporaries.
+	[[nodiscard]]
+	size_t get_frame_size() const noexcept
+	{
+		return static_cast<size_t>(m_maxStackDepth) + m_tempCount;
+	}
+
+	/// @returns A new cached subtree, whose code is emitted next.
+	[[nodiscard]]
+	uint32_t add_cache()
+	{
+		m_cacheEnds.push_back(0);
+		return static_cast<uint32_t>(m_cacheEnds.size() - 1);
+	}
+
+	/** @brief Ends a cached subtree, after its code was emitted.
+	    @param cache The cached subtree, from add_cache().
+	    @param variables The variables that the subtree's value depends on.*/
+	void end_cache(const uint32_t cache, const std::vector<const te_type *> &variables)
+	{
+		emit({opcode::OP_CACHE_STORE, cache, 0, nullptr}, 0);
+		m_cacheEnds[cache] = static_cast<uint32_t>(m_code.size());
+		m_slotCaches.resize(m_variables.size());
+		for (const auto var : variables)
+		{
+			// (the subtree's variables have all been emitted, by it or an earlier subtree)
+			const auto slot = find_variable(var);
+			assert(slot >= 0);
+			m_slotCaches[static_cast<size_t>(slot)].push_back(cache);
+		}
+	}
+
+	/// @returns The slot in the variable table of @c var, adding it if it is not there yet.
+	/// @param var The variable to look for.
+	uint32_t add_variable(const te_type *var)
+	{
+		const auto [slot, added] =
+		    m_variableIndex.try_emplace(var, static_cast<uint32_t>(m_variables.size()));
+		if (added)
+		{
+			m_variables.push_back(var);
+		}
+		return slot->second;
+	}
+
+	/// @returns The slot in the variable table of @c var, or @c -1 if not used by the program.
+	/// @param var The variable to look for.
+	[[nodiscard]]
+	int64_t find_variable(const te_type *var) const noexcept
+	{
+		const auto slot = m_variableIndex.find(var);
+		return (slot == m_variableIndex.cend()) ? -1 : static_cast<int64_t>(slot->second);
+	}
+
+	/** @brief Runs the program over a batch of rows.
+	    @param columns For each slot in the variable table, either the column of values
+	        to read the variable from, or null to read its bound value instead.
+	    @param results Where to write the rows' results.
+	    @param[out] errorMessage The message from the first row that failed.
+	    @param parameters The values of the literal parameters (one per get_parameter_count()).
+	    @returns The number of rows that failed (and were set to NaN).*/
+	size_t evaluate_batch(const std::vector<const te_type *> &columns, std::span<te_type> results,
+	                      std::string &errorMessage, std::span<const te_type> parameters = {}) const;
+
+	/// @brief Allocates a stack and runs the program on it.
+	/// @param[out] results Where to copy the values left at the bottom of the stack
+	///     (i.e., the results of the formulas that were lowered into the program).
+	/// @param caches The values of the cached subtrees, or null to evaluate them.
+	template <typename VariableReader>
+	te_type run_on_stack(const VariableReader &readVariable, std::span<te_type> results = {},
+	                     cached_value *caches = nullptr) const;
+
+	template <typename VariableReader>
+	[[nodiscard]]
+	te_type run(te_type *stack, const VariableReader &readVariable,
+	            cached_value *caches = nullptr) const;
+
+	void run_block(te_type *stack, const std::vector<const te_type *> &columns, const size_t first,
+	               std::span<te_type> results, std::span<const te_type> parameters) const;
+
+	/// @returns The value of a variable slot when it is not read from a frame or column.
+	[[nodiscard]]
+	te_type read_bound(const size_t slot, std::span<const te_type> parameters) const noexcept
+	{
+		return (slot < m_parameterCount) ? parameters[slot] : *m_variables[slot];
+	}
+
+	/// @brief The number of rows that evaluate_batch() runs each instruction over at a time.
+	constexpr static size_t BATCH_BLOCK_SIZE{128};
+
+	std::vector<instruction>     m_code;
+	std::vector<call>            m_calls;
+	std::vector<const te_type *> m_variables;
+	int64_t                      m_currentStackDepth{0};
+	int64_t                      m_maxStackDepth{0};
+	size_t                       m_tempCount{0};
+	/// @brief The slot of each variable in @c m_variables.
+	std::unordered_map<const te_type *, uint32_t> m_variableIndex;
+	/// @brief The names of the variables used by the program, and their slots
+	///     in its variable table.
+	std::vector<std::pair<te_variable::name_type, size_t>> m_variableSlots;
+	/// @brief Where each cached subtree's code ends, which OP_CACHE_LOAD jumps to.
+	std::vector<uint32_t> m_cacheEnds;
+	/// @brief The cached subtrees that read each variable slot.
+	std::vector<std::vector<uint32_t>> m_slotCaches;
+	/// @brief The number of slots at the front of the variable table that are literal
+	///     parameters, whose values are bound by each expression sharing the program
+	///     (their instructions and table entries have no address to read from).
+	size_t m_parameterCount{0};
+	/// @brief Whether any instructions are skipped conditionally, in which case
+	///     evaluate_batch() has to run the rows one at a time.
+	bool m_hasBranches{false};
+};
+
+/// @brief An immutable, compiled expression.
+/// @details Returned by te_parser::share_compiled_expression() after a successful compile().
+///     Evaluating it does not change any state, so one compiled expression can be
+///     shared between (and evaluated concurrently by) multiple threads, each getting
+///     its own result and error message.\n
+///     Variables are read from the addresses that they were bound to when the expression
+///     was compiled (and closures get the same context objects), so those must outlive
+///     the compiled expression; threads evaluating different rows should use
+///     evaluate_batch() with their own columns rather than writing to shared variables.
+class te_compiled_expression
+{
+	friend class te_parser;
+
+  public:
+	/// @returns The expression that was compiled (with any comments removed).
+	[[nodiscard]]
+	const std::string &get_expression() const noexcept
+	{
+		return m_expression;
+	}
+
+	/** @brief Evaluates the expression.
+	    @returns The result, or NaN on error (e.g., division by zero).*/
+	[[nodiscard]]
+	te_type evaluate() const noexcept;
+
+	/** @brief Evaluates the expression.
+	    @param[out] errorMessage Where to write why the evaluation failed
+	        (this is cleared if it succeeded).
+	    @returns The result, or NaN on error (e.g., division by zero).*/
+	[[nodiscard]]
+	te_type evaluate(std::string &errorMessage) const;
+
+	/// @returns The number of variable slots, which is the size of the frames
+	///     that evaluate(frame) reads.
+	/// @note If the expression was compiled with literal hoisting, then the first slots
+	///     hold its numeric literals (see te_parser::set_literal_hoisting_enabled()).
+	[[nodiscard]]
+	size_t get_slot_count() const noexcept
+	{
+		return m_program->m_variables.size();
+	}
+
+	/// @returns The values of the numeric literals that the expression binds to its
+	///     shared program, if it was compiled with literal hoisting.
+	[[nodiscard]]
+	const std::vector<te_type> &get_literals() const noexcept
+	{
+		return m_literals;
+	}
+
+	/// @returns @c true if this expression shares its compiled program with another.
+	/// @note Expressions compiled with literal hoisting that only differ in their
+	///     numeric literals share the same program.
+	[[nodiscard]]
+	bool shares_program_with(const te_compiled_expression &that) const noexcept
+	{
+		return (m_program == that.m_program);
+	}
+
+	/// @returns The slot that a variable is read from in frames,
+	///     or @c -1 if the expression does not use the variable.
+	/// @param name The name of the variable.
+	[[nodiscard]]
+	int64_t find_slot(std::string_view name) const;
+
+	/// @returns A frame filled with the variables' currently bound values (and the
+	///     expression's literals), which can be used as a template for frames passed
+	///     to evaluate(frame).
+	[[nodiscard]]
+	std::vector<te_type> make_frame() const;
+
+	/** @brief Evaluates the expression with its variables' values taken from a frame.
+	    @details Compiling assigns each variable that the expression uses a slot
+	        (see find_slot()), so the same compiled expression can be evaluated against
+	        any number of records without rebinding variables or recompiling.
+	    @param frame The variables' values, indexed by their slots.
+	    @returns The result, or NaN on error (e.g., division by zero).
+	    @throws std::runtime_error Throws an exception if @c frame has fewer values
+	        than get_slot_count().*/
+	[[nodiscard]]
+	te_type evaluate(std::span<const te_type> frame) const;
+
+	/** @brief Evaluates the expression with its variables' values taken from a frame.
+	    @param frame The variables' values, indexed by their slots.
+	    @param[out] errorMessage Where to write why the evaluation failed
+	        (this is cleared if it succeeded).
+	    @returns The result, or NaN on error (e.g., division by zero).
+	    @throws std::runtime_error Throws an exception if @c frame has fewer values
+	        than get_slot_count().*/
+	[[nodiscard]]
+	te_type evaluate(std::span<const te_type> frame, std::string &errorMessage) const;
+
+	/** @brief Evaluates the expression over columns of variable values.
+	    @details This works like te_parser::evaluate_batch(), except that columns
+	        for variables that the expression does not use are ignored.\n
+	        The results are bit-identical to those of evaluate(), unless the parser had
+	        te_parser::set_approximate_batch_math_enabled() turned on when compiling,
+	        in which case rows calling @c exp(), @c ln(), @c sin(), or @c cos()
+	        can be off by 1 ulp.
+	    @param columns The variables' names and their values.
+	    @param results Where to write the results, one per row.
+	    @param[out] errorMessage Where to write why the first failed row failed
+	        (this is cleared if every row succeeded).
+	    @returns @c true if every row was evaluated successfully. Rows that failed will be NaN.
+	    @throws std::runtime_error Throws an exception if a column has fewer values
+	        than @c results.*/
+	bool evaluate_batch(std::span<const te_column> columns, std::span<te_type> results,
+	                    std::string &errorMessage) const;
+
+	/// @private
+	bool evaluate_batch(std::initializer_list<te_column> columns, std::span<te_type> results,
+	                    std::string &errorMessage) const
+	{
+		return evaluate_batch(std::span<const te_column>{columns.begin(), columns.size()},
+		                      results, errorMessage);
+	}
+
+  private:
+	te_compiled_expression() = default;
+
+	std::string                       m_expression;
+	std::shared_ptr<const te_program> m_program;
+	/// @brief The values of the program's literal parameters.
+	std::vector<te_type> m_literals;
+};
+
+/// @brief An immutable set of formulas that were compiled together.
+/// @details Returned by te_parser::compile_formulas(). The formulas are lowered into
+///     a single program, in which subexpressions that several formulas share are only
+///     computed once per evaluation; one evaluation fills in the results of all of them.\n
+///     Like te_compiled_expression, it can be evaluated concurrently by multiple threads,
+///     and the variables that it was compiled with must outlive it.
+class te_compiled_formulas
+{
+	friend class te_parser;
+
+  public:
+	/// @returns The number of formulas, which is the number of results
+	///     that each evaluation writes.
+	[[nodiscard]]
+	size_t get_formula_count() const noexcept
+	{
+		return m_expressions.size();
+	}
+
+	/// @returns A formula that was compiled (with any comments removed).
+	/// @param index The formula's index in the list that was compiled.
+	[[nodiscard]]
+	const std::string &get_expression(const size_t index) const
+	{
+		return m_expressions.at(index);
+	}
+
+	/// @returns The number of variable slots, which is the size of the frames
+	///     that evaluate(frame, results, errorMessage) reads.
+	[[nodiscard]]
+	size_t get_slot_count() const noexcept
+	{
+		return m_program.m_variables.size();
+	}
+
+	/// @returns The slot that a variable is read from in frames,
+	///     or @c -1 if none of the formulas use the variable.
+	/// @param name The name of the variable.
+	[[nodiscard]]
+	int64_t find_slot(const std::string_view name) const
+	{
+		return m_program.find_slot(name);
+	}
+
+	/// @returns A frame filled with the variables' currently bound values.
+	[[nodiscard]]
+	std::vector<te_type> make_frame() const
+	{
+		return m_program.make_frame();
+	}
+
+	/** @brief Evaluates all of the formulas.
+	    @param[out] results Where to write the formulas' results, by their indices.
+	    @param[out] errorMessage Where to write why the first failed formula failed
+	        (this is cleared if every formula succeeded).
+	    @returns @c true if every formula was evaluated successfully.
+	        Formulas that failed (e.g., from a division by zero) will be NaN.
+	    @throws std::runtime_error Throws an exception if @c results has fewer values
+	        than get_formula_count().*/
+	bool evaluate(std::span<te_type> results, std::string &errorMessage) const;
+
+	/** @brief Evaluates all of the formulas with the variables' values taken from a frame.
+	    @param frame The variables' values, indexed by their slots (see find_slot()).
+	    @param[out] results Where to write the formulas' results, by their indices.
+	    @param[out] errorMessage Where to write why the first failed formula failed
+	        (this is cleared if every formula succeeded).
+	    @returns @c true if every formula was evaluated successfully.
+	        Formulas that failed (e.g., from a division by zero) will be NaN.
+	    @throws std::runtime_error Throws an exception if @c frame has fewer values
+	        than get_slot_count(), or @c results has fewer values than get_formula_count().*/
+	bool evaluate(std::span<const te_type> frame, std::span<te_type> results,
+	              std::string &errorMessage) const;
+
+  private:
+	te_compiled_formulas() = default;
+
+	/* Evaluates each formula's own program, after the shared program failed, so that
+	   only the formulas that fail are NaN. */
+	template <typename ProgramEvaluator>
+	bool evaluate_separately(const ProgramEvaluator &evaluateProgram, std::span<te_type> results,
+	                         std::string &errorMessage) const;
+
+	std::vector<std::string> m_expressions;
+	/// @brief All of the formulas, sharing their common subexpressions.
+	te_program m_program;
+	/// @brief Each formula on its own (with the same variable slots as @c m_program).
+	std::vector<te_program> m_formulaPrograms;
+};
+
+/// @brief A node of the expression tree that te_parser builds while compiling.
+/// @details Nodes refer to their arguments by their indices in a te_node_arena,
+///     so a node owns no memory and (with the default te_type) fits in 32 bytes.
+/// @private
+struct te_node
+{
+	/// @brief The te_type constant, te_type pointer, or function.
+	te_variant_type m_value{static_cast<te_type>(0.0)};
+	/// @brief The object passed to a closure.
+	const te_expr *m_context{nullptr};
+	/// @brief Where the node's arguments start in the arena's argument list.
+	uint32_t m_firstArg{0};
+	/// @brief The number of arguments.
+	uint32_t m_argCount : 24 {0};
+	/// @brief The function's te_variable_flags.
+	uint32_t m_flags : 8 {TE_DEFAULT};
+};
+
+/// @brief Holds the nodes of the expression trees that a te_parser compiles.
+/// @details Nodes and their argument lists are stored contiguously and refer to each
+///     other by 32-bit indices. clear() releases them all at once, but keeps the memory
+///     for the next expression to reuse.
+/// @private
+class te_node_arena
+{
+  public:
+	using index = uint32_t;
+
+	/// @brief The node that missing arguments refer to, which is a NaN constant.
+	constexpr static index MISSING{0};
+	/// @brief The most arguments that a node can have.
+	constexpr static size_t MAX_ARGUMENTS{(1 << 24) - 1};
+
+	te_node_arena()
+	{
+		clear();
+	}
+
+	/// @brief Adds a node.
+	/// @param value The node's constant, variable, or function.
+	/// @param flags The function's flags.
+	/// @param argCount The number of arguments, which are initially missing.
+	/// @returns The new node's index.
+	[[nodiscard]]
+	index add(const te_variant_type &value, const te_variable_flags flags,
+	          const size_t argCount)
+	{
+		assert(argCount <= MAX_ARGUMENTS);
+		te_node node{value};
+		node.m_firstArg = static_cast<uint32_t>(m_args.size());
+		node.m_argCount = static_cast<uint32_t>(argCount);
+		node.m_flags    = static_cast<uint32_t>(flags);
+		m_args.resize(m_args.size() + argCount, MISSING);
+		m_nodes.push_back(node);
+		return static_cast<index>(m_nodes.size() - 1);
+	}
+
+	/// @brief Removes all nodes, other than the one for missing arguments.
+	void clear()
+	{
+		m_nodes.clear();
+		m_args.clear();
+		m_nodes.push_back(te_node{std::numeric_limits<te_type>::quiet_NaN()});
+	}
+
+	/// @returns The number of nodes (including the one for missing arguments).
+	[[nodiscard]]
+	size_t size() const noexcept
+	{
+		return m_nodes.size();
+	}
+
+	/// @note Adding nodes invalidates references to others.
+	[[nodiscard]]
+	te_node &operator[](const index node) noexcept
+	{
+		return m_nodes[node];
+	}
+
+	[[nodiscard]]
+	const te_node &operator[](const index node) const noexcept
+	{
+		return m_nodes[node];
+	}
+
+	/// @returns A node's arguments.
+	[[nodiscard]]
+	std::span<index> args(const index node) noexcept
+	{
+		return {m_args.data() + m_nodes[node].m_firstArg, m_nodes[node].m_argCount};
+	}
+
+	[[nodiscard]]
+	std::span<const index> args(const index node) const noexcept
+	{
+		return {m_args.data() + m_nodes[node].m_firstArg, m_nodes[node].m_argCount};
+	}
+
+	/// @returns A node's argument, or MISSING if it has fewer arguments.
+	[[nodiscard]]
+	index arg(const index node, const size_t position) const noexcept
+	{
+		return (position < m_nodes[node].m_argCount) ?
+		           m_args[m_nodes[node].m_firstArg + position] :
+		           MISSING;
+	}
+
+  private:
+	std::vector<te_node> m_nodes;
+	std::vector<index>   m_args;
+};
+
+/// @brief An open-addressing hash index over a set of custom variables and functions.
+/// @details Entries are keyed by the hashes of the variables' case-folded names and
+///     point back into the set (whose iterators stay valid as it grows). Lookups probe
+///     linearly from a name's hash and only compare names whose hashes match, so their
+///     cost does not grow with the number of variables.
+/// @private
+class te_symbol_index
+{
+  public:
+	using iterator = std::set<te_variable>::const_iterator;
+
+	/// @returns The hash of a name, ignoring its case.
+	/// @note This is never zero, which marks an empty slot.
+	[[nodiscard]]
+	constexpr static size_t hash(const std::string_view name) noexcept
+	{
+		// FNV-1a
+		uint64_t hashValue{14695981039346656037ULL};
+		for (const auto ch : name)
+		{
+			hashValue ^= static_cast<unsigned char>(te_string_less::tolower(ch));
+			hashValue *= 1099511628211ULL;
+		}
+		return static_cast<size_t>(hashValue) | 1;
+	}
+
+	/// @brief Indexes every variable and function in a set (replacing what was indexed).
+	/// @param vars The set to index.
+	void rebuild(const std::set<te_variable> &vars);
+
+	/// @brief Indexes a variable or function.
+	/// @param var The variable's position in the indexed set.
+	void insert(const iterator var);
+
+	/// @brief Removes a variable or function from the index.
+	/// @param name The name of the variable or function.
+	void erase(const std::string_view name);
+
+	/// @returns The position of the variable or function in the indexed set,
+	///     or nothing if it is not in the index.
+	/// @param name The name of the variable or function.
+	[[nodiscard]]
+	std::optional<iterator> find(const std::string_view name) const;
+
+	/// @returns The number of variables and functions in the index.
+	[[nodiscard]]
+	size_t size() const noexcept
+	{
+		return m_size;
+	}
+
+	/// @brief Removes everything from the index (and frees its memory).
+	void clear() noexcept
+	{
+		m_slots.clear();
+		m_slots.shrink_to_fit();
+		m_size = 0;
+	}
+
+  private:
+	struct slot
+	{
+		size_t   m_hash{0};
+		iterator m_var;
+	};
+
+	/// @returns The slot that holds @c name, or else the empty slot where it would go.
+	[[nodiscard]]
+	size_t find_slot(const std::string_view name, const size_t hashValue) const noexcept;
+	/// @brief Makes room for at least @c count entries, keeping the table at most half full.
+	void reserve(const size_t count);
+
+	std::vector<slot> m_slots;
+	size_t            m_size{0};
+};
+
 /// @brief Math formula parser.
 class te_parser
 {
@@ -303,11 +1187,15 @@ class te_parser
 	// cppcheck-suppress uninitMemberVar
 	te_parser(const te_parser &that) :
 	    m_customFuncsAndVars(that.m_customFuncsAndVars),
+	    m_useSymbolIndex(that.m_useSymbolIndex),
 	    m_unknownSymbolResolve(that.m_unknownSymbolResolve),
 	    m_keepResolvedVariables(that.m_keepResolvedVariables),
 	    m_decimalSeparator(that.m_decimalSeparator),
 	    m_listSeparator(that.m_listSeparator),
-	    m_expression(that.m_expression)
+	    m_expression(that.m_expression), m_literalHoisting(that.m_literalHoisting),
+	    m_subtreeCaching(that.m_subtreeCaching), m_reassociation(that.m_reassociation),
+	    m_approximateBatchMath(that.m_approximateBatchMath),
+	    m_compileCacheSize(that.m_compileCacheSize), m_maxDepth(that.m_maxDepth)
 	{
 		try
 		{
@@ -334,6 +1222,17 @@ class te_parser
 		m_decimalSeparator      = that.m_decimalSeparator;
 		m_listSeparator         = that.m_listSeparator;
 		m_expression            = that.m_expression;
+		m_compileCacheSize      = that.m_compileCacheSize;
+		m_useSymbolIndex        = that.m_useSymbolIndex;
+		m_symbolIndexStale      = true;
+		m_literalHoisting       = that.m_literalHoisting;
+		m_subtreeCaching        = that.m_subtreeCaching;
+		m_reassociation         = that.m_reassociation;
+		m_approximateBatchMath  = that.m_approximateBatchMath;
+		m_maxDepth              = that.m_maxDepth;
+		clear_compile_cache();
+		clear_literal_templates();
+		symbols_changed();
 
 		// re-run the expression that was copied over
 		reset_state();
@@ -357,16 +1256,15 @@ class te_parser
 	}
 
 	/// @private
-	~te_parser()
-	{
-		te_free(m_compiledExpression);
-	}
+	~te_parser() = default;
 
 	/// @brief NaN (not-a-number) constant to indicate an invalid value.
 	constexpr static auto te_nan = std::numeric_limits<te_type>::quiet_NaN();
 	/// @brief No position, which is what get_last_error_position() returns
 	///     when there was no parsing error.
 	constexpr static int64_t npos = -1;
+	/// @brief The default for how deeply expressions can be nested (see set_max_depth()).
+	constexpr static size_t DEFAULT_MAX_DEPTH{10'000};
 	/// @private
 	// (2^48)-1
 	constexpr static double MAX_BITOPS_VAL{281474976710655};        // NOLINT
@@ -416,6 +1314,23 @@ class te_parser
 	    @throws std::runtime_error Throws an exception in the case of arithmetic overflows
 	        (e.g., `1 << 64` would cause an overflow).*/
 	bool compile(const std::string_view expression);
+	/** @brief Compiles a set of formulas together, so that they can all be evaluated
+	        in a single pass.
+	    @details Subexpressions that appear in more than one formula (e.g., the same
+	        call to a pure function with the same arguments) are only computed once
+	        each time the formulas are evaluated.\n
+	        Like compile(), this replaces the parser's compiled expression (which will be
+	        null afterwards), and is_variable_used() and is_function_used() will
+	        report what any of the formulas used.
+	    @param expressions The formulas to compile.
+	    @returns The compiled formulas, or null if any of them failed to compile.
+	        In that case, get_last_error_message() will say which formula failed and
+	        get_last_error_position() will be the position of the error in that formula.
+	    @throws std::runtime_error Throws an exception in the case of arithmetic overflows
+	        (e.g., `1 << 64` would cause an overflow).*/
+	[[nodiscard]]
+	std::shared_ptr<const te_compiled_formulas>
+	compile_formulas(std::span<const std::string> expressions);
 	/** @brief Evaluates expression passed to compile() previously and returns its result.
 	    @returns The result, or NaN on error.
 	    @throws std::runtime_error Throws an exception in the case of arithmetic overflows
@@ -425,12 +1340,84 @@ class te_parser
 	/** @brief Compiles and evaluates an expression and returns its result.
 	    @param expression The formula to compile and evaluate.
 	    @returns The result, or NaN on error.
-	    @note Returns NaN if division or modulus by zero occurs.
+	    @note Returns NaN if division or modulus by zero occurs.\n
+	        If the compile cache is enabled (see set_compile_cache_size()),
+	        then an expression that was compiled recently will not be parsed again.
 	    @throws std::runtime_error Throws an exception in the case of arithmetic overflows
 	        (e.g., `1 << 64` would cause an overflow).*/
 	[[nodiscard]]
 	te_type evaluate(const std::string_view expression);
 
+	/** @brief Sets how many compiled expressions evaluate(expression) should keep,
+	        so that formulas that are evaluated repeatedly are only parsed once.
+	    @details The cache is keyed by the text of the expression, and its entries are
+	        invalidated whenever the custom variables and functions (or any other
+	        setting that affects parsing) change. When it is full, the least recently
+	        used expression is removed.\n
+	        Expressions that needed the unknown symbol resolver are only cached if
+	        resolved variables are being kept.
+	    @param size The maximum number of expressions to keep. The default is @c 0,
+	        which disables the cache.*/
+	void set_compile_cache_size(const size_t size)
+	{
+		m_compileCacheSize = size;
+		trim_compile_cache();
+	}
+
+	/// @returns The maximum number of expressions that the compile cache keeps.
+	[[nodiscard]]
+	size_t get_compile_cache_size() const noexcept
+	{
+		return m_compileCacheSize;
+	}
+
+	/// @brief Removes all expressions from the compile cache.
+	void clear_compile_cache() noexcept
+	{
+		m_compileCacheIndex.clear();
+		m_compileCache.clear();
+	}
+
+	/// @returns The number of times that evaluate(expression) used a cached expression.
+	[[nodiscard]]
+	size_t get_compile_cache_hits() const noexcept
+	{
+		return m_compileCacheHits;
+	}
+
+	/// @returns The number of times that evaluate(expression) had to compile an
+	///     expression while the compile cache was enabled.
+	[[nodiscard]]
+	size_t get_compile_cache_misses() const noexcept
+	{
+		return m_compileCacheMisses;
+	}
+
+	/** @brief Evaluates the expression passed to compile() previously over
+	        columns of variable values.
+	    @details Row @c i of @c results is the expression evaluated with each variable
+	        in @c columns bound to the @c i-th value of its column. Variables without
+	        a column use their currently bound values.\n
+	        This is much faster than rebinding variables and calling evaluate() for each row.\n
+	        The results are bit-identical to those of evaluate(), unless
+	        set_approximate_batch_math_enabled() is turned on, in which case rows calling
+	        @c exp(), @c ln(), @c sin(), or @c cos() can be off by 1 ulp.
+	    @param columns The variables' names and their values.
+	    @param results Where to write the results, one per row.
+	    @returns @c true if every row was evaluated successfully. Rows that failed
+	        (e.g., from a division by zero) will be NaN, and get_last_error_message()
+	        will describe the first failure.
+	    @throws std::runtime_error Throws an exception if a column is not named after
+	        a variable or has fewer values than @c results.*/
+	bool evaluate_batch(std::span<const te_column> columns, std::span<te_type> results);
+
+	/// @private
+	bool evaluate_batch(std::initializer_list<te_column> columns, std::span<te_type> results)
+	{
+		return evaluate_batch(std::span<const te_column>{columns.begin(), columns.size()},
+		                      results);
+	}
+
 	/// @returns The last call to evaluate()'s result (which will be NaN on error).
 	[[nodiscard]]
 	te_type get_result() const noexcept
@@ -438,6 +1425,19 @@ class te_parser
 		return m_result;
 	}
 
+	/** @returns The expression from the last call to compile() (or evaluate(expression)),
+	        or null if it failed to compile.
+	    @details The compiled expression is immutable and can be shared between threads.
+	        It also stays valid after this parser compiles something else
+	        (or is destroyed).
+	    @note This replaces `get_compiled_expression()`, which returned a pointer into the
+	        parser's own expression tree; compiled expressions are now bytecode.*/
+	[[nodiscard]]
+	std::shared_ptr<const te_compiled_expression> share_compiled_expression() const noexcept
+	{
+		return m_compiledExpression;
+	}
+
 	/// @private
 	[[nodiscard]]
 	te_type get_result() const volatile noexcept
@@ -450,75 +1450,309 @@ class te_parser
 	[[nodiscard]]
 	bool success() const noexcept
 	{
-		return m_parseSuccess;
+		return m_parseSuccess;
+	}
+
+	[[nodiscard]]
+	bool success() const volatile noexcept
+	{
+		return m_parseSuccess;
+	}
+
+	/// @returns The zero-based index into the last parsed expression where the parse failed,
+	///     or te_parser::npos if no error occurred.
+	/// @note Call success() to see if the last parse succeeded or not.
+	[[nodiscard]]
+	int64_t get_last_error_position() const noexcept
+	{
+		return m_errorPos;
+	}
+
+	/// @private
+	[[nodiscard]]
+	int64_t get_last_error_position() const volatile noexcept
+	{
+		return m_errorPos;
+	}
+
+	/// @returns Any error message from the last parse.
+	[[nodiscard]]
+	const std::string &get_last_error_message() const noexcept
+	{
+		return m_lastErrorMessage;
+	}
+
+	/// @brief Sets the list of custom variables and functions.
+	/// @param vars The list of variables and functions.
+	/// @note Valid variable and function names must begin with a letter from a-z (A-Z),
+	///     followed by additional English letters, numbers, periods, or underscores.
+	/// @throws std::runtime_error Throws an exception if an illegal character is found
+	///     in any variable name.
+	void set_variables_and_functions(std::set<te_variable> vars)
+	{
+		for (const auto &var : vars)
+		{
+			validate_name(var);
+		}
+		m_customFuncsAndVars = std::move(vars);
+		m_symbolIndexStale   = true;
+		symbols_changed();
+	}
+
+	/// @brief Adds a custom variable or function.
+	/// @param var The variable/function to add.
+	/// @note Prefer using set_variables_and_functions() or add_variables_and_functions()
+	///     when adding many variables, as they will be more optimal.
+	/// @throws std::runtime_error Throws an exception if an illegal character is found
+	///     in the variable name.
+	void add_variable_or_function(te_variable var)
+	{
+		validate_name(var);
+		const auto [position, inserted] = m_customFuncsAndVars.insert(std::move(var));
+		if (inserted && is_symbol_index_current())
+		{
+			m_symbolIndex.insert(position);
+		}
+		symbols_changed();
+	}
+
+	/// @brief Adds a list of custom variables and functions.
+	/// @param vars The variables/functions to add. Any whose names are already in use
+	///     are ignored.
+	/// @note The variables are sorted first and then inserted in order, which is faster
+	///     than adding them one at a time (especially into a large list).
+	/// @throws std::runtime_error Throws an exception if an illegal character is found
+	///     in any variable name.
+	void add_variables_and_functions(std::vector<te_variable> vars)
+	{
+		for (const auto &var : vars)
+		{
+			validate_name(var);
+		}
+		std::stable_sort(vars.begin(), vars.end());
+		auto hint = m_customFuncsAndVars.end();
+		for (auto &var : vars)
+		{
+			hint = std::next(m_customFuncsAndVars.insert(hint, std::move(var)));
+		}
+		m_symbolIndexStale = true;
+		symbols_changed();
+	}
+
+	/// @brief Removes a custom variable or function.
+	/// @param var The variable/function to remove (by name).
+	void remove_variable_or_function(const std::string_view var)
+	{
+		auto foundVar = m_customFuncsAndVars.find(var);
+		if (foundVar != m_customFuncsAndVars.cend())
+		{
+			if (is_symbol_index_current())
+			{
+				m_symbolIndex.erase(var);
+			}
+			m_customFuncsAndVars.erase(foundVar);
+			symbols_changed();
+		}
+	}
+
+	/** @brief Sets whether custom variables and functions should be looked up through
+	        a hash index, rather than by searching the (sorted) list of them.
+	    @details This is meant for parsers with a very large number (e.g., many thousands)
+	        of custom variables, where looking up each name in a formula would otherwise
+	        need a string comparison for every level of the list's tree.\n
+	        The index is kept up to date by add_variable_or_function() and
+	        remove_variable_or_function(); after set_variables_and_functions(),
+	        add_variables_and_functions(), or editing get_variables_and_functions() directly,
+	        it is rebuilt in one pass when the next expression is compiled.
+	    @param enable @c true to use the index. The default is @c false.*/
+	void set_symbol_index_enabled(const bool enable)
+	{
+		m_useSymbolIndex   = enable;
+		m_symbolIndexStale = true;
+		if (!enable)
+		{
+			m_symbolIndex.clear();
+		}
+	}
+
+	/// @returns @c true if custom variables and functions are looked up through a hash index.
+	[[nodiscard]]
+	bool is_symbol_index_enabled() const noexcept
+	{
+		return m_useSymbolIndex;
+	}
+
+	/** @brief Sets whether compiled expressions should keep the values of their
+	        subtrees between calls to evaluate().
+	    @details Each pure subtree that reads fewer variables than the expression around it
+	        keeps its last value, which evaluate() re-uses until mark_variables_changed()
+	        is called with one of the variables that it reads. This is meant for large
+	        expressions where only a few of many variables change between evaluations.
+	    @warning When this is enabled, variables must not change without being passed to
+	        mark_variables_changed(); otherwise, evaluate() may return results computed
+	        from their old values.
+	    @param enable @c true to cache subtrees. The default is @c false.*/
+	void set_subtree_caching_enabled(const bool enable)
+	{
+		m_subtreeCaching = enable;
+		symbols_changed();
+		// if previously compiled, then re-compile with (or without) the caches
+		if (m_expression.length())
+		{
+			compile(m_expression);
+		}
+	}
+
+	/// @returns @c true if subtree caching is enabled.
+	[[nodiscard]]
+	bool is_subtree_caching_enabled() const noexcept
+	{
+		return m_subtreeCaching;
+	}
+
+	/** @brief Sets whether compile() should rebuild long chains of additions or
+	        multiplications (e.g., `a1 + a2 + ... + a1000`) into balanced trees.
+	    @details A chain is read as a left-deep tree, so each step waits on the one before it.
+	        Balanced, neighboring terms are combined in pairs, and then the pairs in pairs,
+	        which shortens that chain of dependencies (and the depth of the tree)
+	        from @c n steps to about @c log2(n).
+
+	        The terms are still combined in the order that they are written, only grouped
+	        differently. Floating-point addition and multiplication are not associative,
+	        though, so the results can differ in their last bits from those of the left-to-right
+	        grouping (and, when terms cancel out, by more; e.g., `a + b + c + d` with
+	        `b = 1e16` and `c = -1e16`). Pairwise sums usually have a smaller rounding error.
+	    @param enable @c true to rebuild chains of at least four terms. The default is @c false.*/
+	void set_reassociation_enabled(const bool enable)
+	{
+		m_reassociation = enable;
+		symbols_changed();
+		// if previously compiled, then re-compile with (or without) the balanced trees
+		if (m_expression.length())
+		{
+			compile(m_expression);
+		}
+	}
+
+	/// @returns @c true if long chains of additions or multiplications are balanced.
+	[[nodiscard]]
+	bool is_reassociation_enabled() const noexcept
+	{
+		return m_reassociation;
+	}
+
+	/** @brief Sets whether evaluate_batch() may use vectorized versions of @c exp(), @c ln(),
+	        @c sin(), and @c cos() that are faster, but not bit-identical to the scalar functions.
+	    @details The approximate versions are within 1 ulp of the scalar results (and are off
+	        by that in up to about 15% of rows, depending on the function). Arguments that they
+	        do not handle (e.g., NaN, infinities, @c exp() arguments beyond +/-708, or @c sin()
+	        and @c cos() arguments beyond +/-2^19) are passed to the scalar functions, so those
+	        always match. Which versions are used depends on the instruction sets that the CPU
+	        supports (see info()), so the results can also differ between machines.\n
+	        The other vectorized builtins (e.g., @c sqrt(), @c abs(), and the comparisons)
+	        are exact and always used.
+	    @param enable @c true to use the approximate versions. The default is @c false.*/
+	void set_approximate_batch_math_enabled(const bool enable)
+	{
+		m_approximateBatchMath = enable;
+		symbols_changed();
+		// if previously compiled, then re-compile with (or without) the approximate versions
+		if (m_expression.length())
+		{
+			compile(m_expression);
+		}
+	}
+
+	/// @returns @c true if evaluate_batch() may use approximate vectorized functions.
+	[[nodiscard]]
+	bool is_approximate_batch_math_enabled() const noexcept
+	{
+		return m_approximateBatchMath;
+	}
+
+	/** @brief Declares that variables have changed since the last call to evaluate(),
+	        so that the cached subtrees that read them are evaluated again.
+	    @param names The names of the variables that changed. Names that are not
+	        variables (or not used by the expression) are ignored.
+	    @sa set_subtree_caching_enabled().*/
+	void mark_variables_changed(std::span<const std::string_view> names);
+
+	/// @private
+	void mark_variables_changed(std::initializer_list<std::string_view> names)
+	{
+		mark_variables_changed(std::span<const std::string_view>{names.begin(), names.size()});
 	}
 
-	[[nodiscard]]
-	bool success() const volatile noexcept
+	/// @brief Discards the values of all cached subtrees, so that the next call
+	///     to evaluate() computes the whole expression.
+	void clear_subtree_cache() noexcept
 	{
-		return m_parseSuccess;
+		for (auto &cache : m_subtreeCache)
+		{
+			cache.m_valid = false;
+		}
 	}
 
-	/// @returns The zero-based index into the last parsed expression where the parse failed,
-	///     or te_parser::npos if no error occurred.
-	/// @note Call success() to see if the last parse succeeded or not.
-	[[nodiscard]]
-	int64_t get_last_error_position() const noexcept
+	/** @brief Sets whether compile() should turn numeric literals into parameters,
+	        so that expressions which only differ in their numbers share one program.
+	    @details The program compiled for an expression is kept as a template for its shape
+	        (its text with the literals taken out), and later expressions with the same shape
+	        re-use it with their own literals bound to it instead of being compiled again.
+	        For example, `a*0.031 + b*12` and `a*0.5 + b*7` share a program.\n
+	        Literals are no longer folded into constants (e.g., `2*3` is multiplied on every
+	        evaluation), so this is meant for large sets of formulas made from a few templates.
+	    @param enable @c true to hoist literals. The default is @c false.*/
+	void set_literal_hoisting_enabled(const bool enable)
 	{
-		return m_errorPos;
+		m_literalHoisting = enable;
+		if (!enable)
+		{
+			m_literalTemplates.clear();
+		}
+		symbols_changed();
+		// if previously compiled, then re-compile with (or without) the parameters
+		if (m_expression.length())
+		{
+			compile(m_expression);
+		}
 	}
 
-	/// @private
+	/// @returns @c true if literal hoisting is enabled.
 	[[nodiscard]]
-	int64_t get_last_error_position() const volatile noexcept
+	bool is_literal_hoisting_enabled() const noexcept
 	{
-		return m_errorPos;
+		return m_literalHoisting;
 	}
 
-	/// @returns Any error message from the last parse.
+	/// @returns The number of programs kept as templates for literal hoisting.
 	[[nodiscard]]
-	const std::string &get_last_error_message() const noexcept
+	size_t get_literal_template_count() const noexcept
 	{
-		return m_lastErrorMessage;
+		return m_literalTemplates.size();
 	}
 
-	/// @brief Sets the list of custom variables and functions.
-	/// @param vars The list of variables and functions.
-	/// @note Valid variable and function names must begin with a letter from a-z (A-Z),
-	///     followed by additional English letters, numbers, periods, or underscores.
-	/// @throws std::runtime_error Throws an exception if an illegal character is found
-	///     in any variable name.
-	void set_variables_and_functions(std::set<te_variable> vars)
+	/// @brief Discards the programs kept as templates for literal hoisting.
+	void clear_literal_templates() noexcept
 	{
-		for (const auto &var : vars)
-		{
-			validate_name(var);
-		}
-		m_customFuncsAndVars = std::move(vars);
+		m_literalTemplates.clear();
 	}
 
-	/// @brief Adds a custom variable or function.
-	/// @param var The variable/function to add.
-	/// @note Prefer using set_variables_and_functions() as it will be more optimal
-	///     (less sorts will need to be performed).
-	/// @throws std::runtime_error Throws an exception if an illegal character is found
-	///     in the variable name.
-	void add_variable_or_function(te_variable var)
+	/** @brief Sets how deeply the parentheses, function calls, and right-to-left operators
+	        in an expression can be nested.
+	    @details Expressions are parsed and compiled without recursing, so this only guards
+	        against unreasonably deep input; anything nested more deeply fails to compile.
+	    @param depth The maximum depth. The default is @c DEFAULT_MAX_DEPTH.*/
+	void set_max_depth(const size_t depth) noexcept
 	{
-		validate_name(var);
-		m_customFuncsAndVars.insert(std::move(var));
+		m_maxDepth = depth;
+		symbols_changed();
 	}
 
-	/// @brief Removes a custom variable or function.
-	/// @param var The variable/function to remove (by name).
-	void remove_variable_or_function(te_variable::name_type var)
+	/// @returns The maximum depth that expressions can be nested.
+	[[nodiscard]]
+	size_t get_max_depth() const noexcept
 	{
-		auto foundVar = m_customFuncsAndVars.find(
-		    te_variable{std::move(var), static_cast<te_type>(0.0), TE_DEFAULT, nullptr});
-		if (foundVar != m_customFuncsAndVars.cend())
-		{
-			m_customFuncsAndVars.erase(foundVar);
-		}
+		return m_maxDepth;
 	}
 
 	/** @brief Sets a custom function to resolve unknown symbols in an expression.
@@ -535,6 +1769,7 @@ class te_parser
 	{
 		m_unknownSymbolResolve  = usr;
 		m_keepResolvedVariables = keepResolvedVariables;
+		symbols_changed();
 	}
 
 	/// @private
@@ -545,9 +1780,13 @@ class te_parser
 	}
 
 	/// @returns The list of custom variables and functions.
+	/// @note Because the list can be edited through this, calling it
+	///     invalidates the compile cache.
 	[[nodiscard]]
 	std::set<te_variable> &get_variables_and_functions() noexcept
 	{
+		m_symbolIndexStale = true;
+		symbols_changed();
 		return m_customFuncsAndVars;
 	}
 
@@ -575,6 +1814,7 @@ class te_parser
 			throw std::runtime_error("Decimal separator must be either a '.' or ','.");
 		}
 		m_decimalSeparator = sep;
+		symbols_changed();
 	}
 
 	/// @private
@@ -585,6 +1825,7 @@ class te_parser
 			throw std::runtime_error("Decimal separator must be either a '.' or ','.");
 		}
 		m_decimalSeparator = sep;
+		m_symbolVersion = m_symbolVersion + 1;
 	}
 
 	/// @brief Sets a constant variable's value.
@@ -596,19 +1837,24 @@ class te_parser
 	///     then this will be ignored.
 	void set_constant(const std::string_view name, const te_type value)
 	{
-		auto cvar = find_variable_or_function(name);
-		if (cvar == get_variables_and_functions().end())
+		const auto cvar = std::as_const(*this).find_variable_or_function(name);
+		if (cvar == m_customFuncsAndVars.cend())
 		{
 			add_variable_or_function({te_variable::name_type{name}, value});
 		}
 		else if (is_constant(cvar->m_value))
 		{
-			auto nh            = get_variables_and_functions().extract(cvar);
-			nh.value().m_value = value;
-			get_variables_and_functions().insert(std::move(nh));
-			// if previously compiled, then re-compile since this
-			// constant would have been optimized
-			if (m_expression.length())
+			auto nh             = m_customFuncsAndVars.extract(cvar);
+			nh.value().m_value  = value;
+			const auto position = m_customFuncsAndVars.insert(std::move(nh)).position;
+			if (is_symbol_index_current())
+			{
+				m_symbolIndex.insert(position);
+			}
+			symbols_changed();
+			// if previously compiled, then update the constants that were read (or folded)
+			// from it, or re-compile if that isn't possible
+			if (m_expression.length() && !patch_constant(position->m_name, value))
 			{
 				compile(m_expression);
 			}
@@ -660,6 +1906,7 @@ class te_parser
 			throw std::runtime_error("List separator must be either a ',' or ';'.");
 		}
 		m_listSeparator = sep;
+		symbols_changed();
 	}
 
 	/// @private
@@ -670,6 +1917,7 @@ class te_parser
 			throw std::runtime_error("List separator must be either a ',' or ';'.");
 		}
 		m_listSeparator = sep;
+		m_symbolVersion = m_symbolVersion + 1;
 	}
 #ifndef TE_NO_BOOKKEEPING
 	/// @returns @c true if @c name is a function that had been used in the last parsed formula.
@@ -678,7 +1926,7 @@ class te_parser
 	[[nodiscard]]
 	bool is_function_used(const std::string_view name) const
 	{
-		return m_usedFunctions.find(te_variable::name_type{name}) != m_usedFunctions.cend();
+		return m_usedFunctions.find(name) != m_usedFunctions.cend();
 	}
 
 	/// @returns @c true if @c name is a variable that had been used in the last parsed formula.
@@ -687,7 +1935,15 @@ class te_parser
 	[[nodiscard]]
 	bool is_variable_used(const std::string_view name) const
 	{
-		return m_usedVars.find(te_variable::name_type{name}) != m_usedVars.cend();
+		return m_usedVars.find(name) != m_usedVars.cend();
+	}
+
+	/// @returns The variables that had been used in the last parsed formula.
+	/// @sa compile() and evaluate().
+	[[nodiscard]]
+	const std::set<te_variable::name_type, te_string_less> &get_variables_used() const noexcept
+	{
+		return m_usedVars;
 	}
 #endif
 	/// @returns A report of all available functions and variables.
@@ -726,17 +1982,60 @@ class te_parser
 		m_lastErrorMessage.clear();
 		m_result       = te_nan;
 		m_parseSuccess = false;
-		te_free(m_compiledExpression);
-		m_compiledExpression = nullptr;
-		m_currentVar         = m_functions.cend();
-		m_varFound           = false;
+		m_compiledExpression.reset();
+		m_subtreeCacheProgram = nullptr;
+		m_constantPatches     = constant_patches{};
+		m_nodes.clear();
+		m_hoistedLiterals.clear();
+		m_currentVarType      = TE_DEFAULT;
+		m_varFound            = false;
 #ifndef TE_NO_BOOKKEEPING
 		m_usedFunctions.clear();
 		m_usedVars.clear();
 #endif
 		m_resolvedVariables.clear();
+		m_readVariables.clear();
+	}
+
+	/// @brief Invalidates the compile cache's entries, after the custom variables
+	///     and functions (or any other setting that affects parsing) change.
+	void symbols_changed() noexcept
+	{
+		++m_symbolVersion;
+	}
+
+	/// @returns @c true if the symbol index is enabled and up to date.
+	[[nodiscard]]
+	bool is_symbol_index_current() const noexcept
+	{
+		return (m_useSymbolIndex && !m_symbolIndexStale);
+	}
+
+	/// @brief Rebuilds the symbol index (if enabled) after the custom variables and
+	///     functions were replaced or edited directly.
+	void update_symbol_index()
+	{
+		if (m_useSymbolIndex && m_symbolIndexStale)
+		{
+			m_symbolIndex.rebuild(m_customFuncsAndVars);
+			m_symbolIndexStale = false;
+		}
 	}
 
+	/// @brief Looks for an expression in the compile cache and,
+	///     if found, restores the state that compiling it would have left.
+	/// @param expression The expression's text.
+	/// @returns @c true if the expression was found.
+	bool restore_from_compile_cache(const std::string_view expression);
+
+	/// @brief Adds the compiled expression to the compile cache.
+	/// @param expression The expression's text.
+	void add_to_compile_cache(std::string expression);
+
+	/// @brief Removes the least recently used expressions from the compile cache
+	///     until it is within its size limit.
+	void trim_compile_cache();
+
 	/// @brief Resets any resolved variables from USR if not being cached.
 	void reset_usr_resolved_if_necessary()
 	{
@@ -750,22 +2049,6 @@ class te_parser
 		}
 	}
 
-	/// @brief Gets the compiled expression, which will be the optimized version
-	///     of the original expression.
-	/// @returns The compiled expression.
-	[[nodiscard]]
-	const te_expr *get_compiled_expression() const noexcept
-	{
-		return m_compiledExpression;
-	}
-
-	/// @private
-	[[nodiscard]]
-	const te_expr *get_compiled_expression() const volatile noexcept
-	{
-		return m_compiledExpression;
-	}
-
 	/// @brief Validates that a variable only contains legal characters
 	///     (and has a valid length).
 	/// @param var The variable to validate.
@@ -810,8 +2093,7 @@ class te_parser
 			return m_customFuncsAndVars.end();
 		}
 
-		return m_customFuncsAndVars.find(te_variable{
-		    te_variable::name_type{name}, static_cast<te_type>(0.0), TE_DEFAULT, nullptr});
+		return m_customFuncsAndVars.find(name);
 	}
 
 	/// @returns An iterator to the custom variable or function with the given @c name,
@@ -825,9 +2107,12 @@ class te_parser
 		{
 			return m_customFuncsAndVars.cend();
 		}
+		if (is_symbol_index_current())
+		{
+			return m_symbolIndex.find(name).value_or(m_customFuncsAndVars.cend());
+		}
 
-		return m_customFuncsAndVars.find(te_variable{
-		    te_variable::name_type{name}, static_cast<te_type>(0.0), TE_DEFAULT, nullptr});
+		return m_customFuncsAndVars.find(name);
 	}
 
 	[[nodiscard]]
@@ -849,8 +2134,10 @@ class te_parser
 		return std::visit(
 		    [](const auto &var_) -> size_t {
 			    using T = std::decay_t<decltype(var_)>;
-			    if constexpr (te_is_constant_v<T> || te_is_variable_v<T>)
+			    if constexpr (te_is_constant_v<T> || te_is_variable_v<T> ||
+			                  std::is_same_v<T, te_funv>)
 			    {
+				    // (variadic functions take however many arguments they are called with)
 				    return 0;
 			    }
 			    else if constexpr (te_is_closure_v<T>)
@@ -919,6 +2206,19 @@ class te_parser
 	TE_DEF_FUNCTION(2);
 #undef TE_DEF_FUNCTION
 
+	[[nodiscard]]
+	constexpr static bool is_function_variadic(const te_variant_type &var) noexcept
+	{
+		return std::holds_alternative<te_funv>(var);
+	}
+
+	[[nodiscard]]
+	constexpr static te_funv get_function_variadic(const te_variant_type &var)
+	{
+		assert(std::holds_alternative<te_funv>(var));
+		return std::get<te_funv>(var);
+	}
+
 	[[nodiscard]]
 	constexpr static bool is_closure(const te_variant_type &var) noexcept
 	{
@@ -963,44 +2263,59 @@ class te_parser
 			TOK_INFIX
 		};
 
-		state(const char *expression, te_variable_flags varType, std::set<te_variable> &vars) :
-		    m_start(expression), m_next(expression), m_varType(varType), m_lookup(vars)
+		state(const std::string_view expression, te_variable_flags varType,
+		      std::set<te_variable> &vars) :
+		    m_start(expression.data()), m_next(expression.data()),
+		    m_end(expression.data() + expression.length()), m_varType(varType), m_lookup(vars)
 		{
 		}
 
 		const char       *m_start{nullptr};
 		const char       *m_next{nullptr};
+		const char       *m_end{nullptr};
 		token_type        m_type{token_type::TOK_NULL};
 		te_variable_flags m_varType{TE_DEFAULT};
 		te_variant_type   m_value;
 		te_expr          *context{nullptr};
 
 		std::set<te_variable> &m_lookup;
+		/// @brief The hash index over m_lookup, if one is being used.
+		const te_symbol_index *m_lookupIndex{nullptr};
+		/// @brief The name of the custom constant that the current number was read from.
+		const te_variable::name_type *m_customConstant{nullptr};
+		/// @brief Whether numeric literals are read as parameters.
+		bool m_hoistLiterals{false};
+		/// @brief The length of the comments skipped so far, so that error positions
+		///     can be given in the expression without its comments.
+		int64_t m_commentLength{0};
+		/// @brief The precedence of the current infix operator (higher binds tighter),
+		///     or 0 if it can't join two operands.
+		int m_precedence{0};
+		/// @brief Whether the current infix operator groups from the right.
+		bool m_rightToLeft{false};
+		/// @brief Whether the expression was nested more deeply than the maximum depth.
+		bool m_depthExceeded{false};
 	};
 
+	using node_index = te_node_arena::index;
+
+	/// @returns A new node, with room for its function's arguments.
+	/// @note Nodes are never freed individually; they are released together once
+	///     the expression has been compiled.
 	[[nodiscard]]
-	inline static te_expr *new_expr(const te_variable_flags type, te_variant_type value,
-	                                const std::initializer_list<te_expr *> &parameters)
+	node_index new_expr(const te_variable_flags type, const te_variant_type &value,
+	                    const std::initializer_list<node_index> &parameters)
 	{
-		te_expr *ret = new te_expr{type, std::move(value)};
-		ret->m_parameters.resize(
-		    std::max<size_t>(std::max<size_t>(parameters.size(), get_arity(ret->m_value)) +
-		                         (is_closure(ret->m_value) ? 1 : 0),
-		                     0));
-		if (parameters.size())
-		{
-			std::copy(parameters.begin(), parameters.end(), ret->m_parameters.begin());
-		}
+		const auto ret =
+		    m_nodes.add(value, type, std::max<size_t>(parameters.size(), get_arity(value)));
+		std::copy(parameters.begin(), parameters.end(), m_nodes.args(ret).begin());
 		return ret;
 	}
 
 	[[nodiscard]]
-	inline static te_expr *new_expr(const te_variable_flags type, te_variant_type value)
+	node_index new_expr(const te_variable_flags type, const te_variant_type &value)
 	{
-		te_expr *ret = new te_expr{type, std::move(value)};
-		ret->m_parameters.resize(static_cast<size_t>(get_arity(ret->m_value)) +
-		                         (is_closure(ret->m_value) ? 1 : 0));
-		return ret;
+		return m_nodes.add(value, type, get_arity(value));
 	}
 
 	[[nodiscard]]
@@ -1013,77 +2328,495 @@ class te_parser
 	    @param expression The formula to parse.
 	    @param variables The collection of custom functions and
 	        variables to add to the parser.
-	    @returns null on error.*/
-	[[nodiscard]]
-	te_expr *te_compile(const std::string_view expression, std::set<te_variable> &variables);
-	/* Evaluates the expression. */
-	[[nodiscard]]
-	static te_type te_eval(const te_expr *texp);
-
-	/* Frees the expression. */
-	/* This is safe to call on null pointers. */
-	inline static void te_free(te_expr *texp)
+	    @param hoistLiterals @c true to read numeric literals as the parameters
+	        in m_hoistedLiterals (see set_literal_hoisting_enabled()).
+	    @returns The root node, or nothing on error.*/
+	[[nodiscard]]
+	std::optional<node_index> te_compile(const std::string_view expression,
+	                                     std::set<te_variable> &variables,
+	                                     const bool hoistLiterals = false);
+	/* Reads the number at the start of a string (which doesn't need to be null terminated),
+	   returning where it ends, or start if there isn't one there. */
+	[[nodiscard]]
+	const char *read_number(const char *start, const char *end, te_type &value) const;
+	/* Returns an expression's text with its numeric literals replaced with '\0'
+	   (which it can't contain), and reads the literals' values. */
+	[[nodiscard]]
+	std::string get_literal_shape(const std::string_view expression,
+	                              std::vector<te_type> &literals) const;
+	/* Uses the program of an earlier expression with the same shape for m_expression,
+	   binding m_hoistedLiterals to it (and removing the expression's comments, unless they
+	   already were). Returns false if there isn't one. */
+	[[nodiscard]]
+	bool restore_from_literal_template(const std::string &shape, const bool commentsRemoved);
+	/* Returns where the formula in an expression starts, which is after the '=' in front
+	   of spreadsheet formulas (e.g., "=SUM(...)"). */
+	[[nodiscard]]
+	static std::string_view get_formula(const std::string &expression) noexcept
+	{
+		return std::string_view{expression}.substr(
+		    (!expression.empty() && expression.front() == '=') ? 1 : 0);
+	}
+	/* If a comment starts at next, returns where it ends (or null if it isn't terminated);
+	   otherwise, returns next. */
+	[[nodiscard]]
+	static const char *skip_comment(const char *next) noexcept;
+	/* Returns whether removing a comment would join the text on either side of it (e.g.,
+	   a comment between two digits, which are then read as one number), which next_token()
+	   can't do while it skips comments. */
+	[[nodiscard]]
+	static bool comments_join_tokens(const std::string_view formula) noexcept;
+	/* Removes the '=' in front of spreadsheet formulas and any comments, in a single pass
+	   (leaving the rest of the expression in place after a comment that isn't terminated). */
+	static void remove_comments(std::string &expression);
+	/* Sets up the sharing information for lowering the trees of roots
+	   (which have already been through share_subexpressions()). */
+	void prepare_lowering(std::span<const node_index> roots);
+	/* Records the names of the variables that a lowered program uses
+	   (from the ones read while parsing). */
+	void record_variable_slots(te_program &program);
+	/* Records that the last instruction emitted read its constant from a node
+	   (negated, for subtractions), in case that node depends on a custom constant. */
+	void record_constant_use(const te_program &program, const node_index texp,
+	                         const bool negated = false);
+	/* Changes the value of a custom constant in the compiled expression, re-folding the
+	   constants that depend on it. Returns false if the expression must be compiled again. */
+	[[nodiscard]]
+	bool patch_constant(const std::string_view name, const te_type value);
+	/* Marks the subtrees whose values are worth caching between evaluations: pure ones
+	   that read fewer variables than their parents (so that some changes leave them valid).
+	   Returns whether texp is pure. */
+	bool mark_cached_subtrees(const node_index texp, std::vector<uint8_t> &purity);
+	/* Evaluates a node whose arguments are all constants (i.e., while folding). */
+	[[nodiscard]]
+	te_type te_eval(const node_index texp) const;
+
+	/* How deeply optimize() recurses before folding the rest of a subtree
+	   through optimize_deep(). */
+	constexpr static size_t MAX_RECURSIVE_FOLDING_DEPTH{64};
+
+	/* Folds the pure functions whose arguments are all constants. An error raised while
+	   folding an argument that IF, IFS, AND, or OR may skip is left to be raised when
+	   (and if) it is evaluated. skippable is whether texp is (or is inside) such an argument. */
+	void optimize(const node_index texp, const size_t depth = 0, const bool skippable = false);
+	/* Folds a subtree with an explicit stack of nodes, rather than by recursing. */
+	void optimize_deep(const node_index texp, const bool skippable);
+	/* Folds a pure function whose arguments are all constants into a constant
+	   (unless that raises an error and the function may be skipped). */
+	void fold_node(const node_index texp, const bool skippable);
+	/* Returns whether a function is one that plan_lazy_lowering() lowers as jumps,
+	   where only the first argument is always evaluated. */
+	[[nodiscard]]
+	static bool is_lazy_function(const te_variant_type &value) noexcept;
+	/* Rebuilds the long chains of additions or multiplications in an (optimized) tree into
+	   balanced trees, re-using their nodes (see set_reassociation_enabled()). */
+	void reassociate(const node_index texp);
+	/* Merges structurally identical pure subtrees (hash-consing), turning the tree
+	   into a DAG. Returns the node that texp was merged into. */
+	[[nodiscard]]
+	node_index share_subexpressions(const node_index texp);
+	/* Returns an existing node identical to texp (whose arguments are already merged),
+	   or registers texp as a new one in m_sharedNodes. */
+	[[nodiscard]]
+	node_index find_shared_node(const node_index texp);
+	/* Empties m_sharedNodes, making room for the nodes of the arena (keeping its memory). */
+	void reset_shared_nodes();
+	/* Returns whether the tree has enough function or operator nodes
+	   to hold a repeated subtree (i.e., whether sharing subexpressions can do anything). */
+	[[nodiscard]]
+	bool can_share_subexpressions() const noexcept;
+	/* Counts how many times each node of a DAG is referenced. */
+	void count_node_uses(const node_index texp);
+
+	/* The steps left in lowering a tree into bytecode. These are kept on an explicit stack
+	   (rather than lowering by recursing), so that deep trees can't overflow the call stack.
+	   A node is lowered by planning its steps, which can lower other nodes in turn. */
+	struct lowering_plan
 	{
-		if (texp == nullptr)
+		struct step
+		{
+			enum class action : uint8_t
+			{
+				LOWER,         /* lowers a node (or re-reads its temporary) */
+				FINISH_CACHE,  /* ends the cached subtree that a node started */
+				STORE_SHARED,  /* keeps a copy of a node's value for its other uses */
+				EMIT,          /* emits an instruction */
+				EMIT_CALL,     /* emits a call of a node's function */
+				EMIT_CALL2,    /* emits a call of a builtin binary function */
+				EMIT_JUMP,     /* emits a jump, saving its position */
+				PATCH_JUMP,    /* points a saved jump to the next instruction */
+				SAVE_DEPTH,    /* saves the stack depth */
+				RESTORE_DEPTH, /* restores a saved stack depth */
+				SAVE_READY,    /* saves the number of ready temporaries */
+				FORGET_READY   /* forgets the temporaries computed since then */
+			};
+
+			action                  m_action{action::LOWER};
+			node_index              m_node{te_node_arena::MISSING};
+			te_program::instruction m_instruction{};
+			int64_t                 m_stackEffect{0};
+			/* Where a jump's position, a stack depth, or a ready count is saved. */
+			size_t m_register{0};
+			/* Whether m_node is a constant folded into the instruction, whose use is noted. */
+			bool    m_constantUse{false};
+			bool    m_negated{false};
+			te_fun2 m_function{nullptr};
+		};
+
+		/* The steps left, the next one last. The steps planned for the node being lowered
+		   are added (in order) after m_planned, and then reversed. */
+		std::vector<step>    m_pending;
+		size_t               m_planned{0};
+		std::vector<int64_t> m_registers;
+
+		/* Removes any steps left from lowering another tree (keeping their memory). */
+		void clear() noexcept
 		{
-			return;
+			m_pending.clear();
+			m_planned = 0;
+			m_registers.clear();
 		}
-		te_free_parameters(texp);
-		delete texp;
-	}
 
-	static void te_free_parameters(te_expr *texp);
-	static void optimize(te_expr *texp);
+		/* Starts planning the steps of a node. */
+		void plan() noexcept { m_planned = m_pending.size(); }
 
-	[[nodiscard]]
-	static auto find_builtin(const std::string_view name)
+		void lower(const node_index texp) { m_pending.push_back({step::action::LOWER, texp}); }
+
+		/* Lowers a subtree that may be skipped at runtime; the temporaries that it
+		   computes cannot be re-read outside of it. */
+		void lower_conditionally(const node_index texp)
+		{
+			const auto readyCount = save(step::action::SAVE_READY);
+			lower(texp);
+			use(step::action::FORGET_READY, readyCount);
+		}
+
+		void emit(const te_program::instruction instr, const int64_t stackEffect)
+		{
+			step next{step::action::EMIT};
+			next.m_instruction = instr;
+			next.m_stackEffect = stackEffect;
+			m_pending.push_back(next);
+		}
+
+		/* Emits an instruction that a constant was folded into
+		   (noting its use, in case it came from a custom constant). */
+		void emit(const te_program::instruction instr, const int64_t stackEffect,
+		          const node_index constant, const bool negated = false)
+		{
+			emit(instr, stackEffect);
+			m_pending.back().m_node        = constant;
+			m_pending.back().m_constantUse = true;
+			m_pending.back().m_negated     = negated;
+		}
+
+		void emit_call(const node_index texp)
+		{
+			m_pending.push_back({step::action::EMIT_CALL, texp});
+		}
+
+		void emit_call2(const te_fun2 func)
+		{
+			step next{step::action::EMIT_CALL2};
+			next.m_function = func;
+			m_pending.push_back(next);
+		}
+
+		/* Returns the register that the jump's position is saved in. */
+		[[nodiscard]]
+		size_t emit_jump(const te_program::opcode op, const int64_t stackEffect)
+		{
+			const auto jump = save(step::action::EMIT_JUMP);
+			m_pending.back().m_instruction.m_opcode = op;
+			m_pending.back().m_stackEffect          = stackEffect;
+			return jump;
+		}
+
+		void patch_jump(const size_t jump) { use(step::action::PATCH_JUMP, jump); }
+
+		[[nodiscard]]
+		size_t save_depth()
+		{
+			return save(step::action::SAVE_DEPTH);
+		}
+
+		void restore_depth(const size_t depth) { use(step::action::RESTORE_DEPTH, depth); }
+
+		[[nodiscard]]
+		size_t save_ready_count()
+		{
+			return save(step::action::SAVE_READY);
+		}
+
+		void forget_ready_nodes(const size_t readyCount)
+		{
+			use(step::action::FORGET_READY, readyCount);
+		}
+
+		/* Queues the planned steps to run next. */
+		void commit()
+		{
+			std::reverse(m_pending.begin() + static_cast<std::ptrdiff_t>(m_planned),
+			             m_pending.end());
+		}
+
+	  private:
+		size_t save(const step::action act)
+		{
+			m_registers.push_back(0);
+			use(act, m_registers.size() - 1);
+			return m_registers.size() - 1;
+		}
+
+		void use(const step::action act, const size_t reg)
+		{
+			step next{act};
+			next.m_register = reg;
+			m_pending.push_back(next);
+		}
+	};
+
+	/* Takes the same steps as a lowering_plan, but runs each one as soon as it is planned
+	   (recursing to lower other nodes), which is faster for the shallow parts of a tree. */
+	struct direct_lowering
 	{
-		return m_functions.find(te_variable{te_variable::name_type{name},
-		                                    static_cast<te_type>(0.0), TE_DEFAULT, nullptr});
-	}
+		te_parser  &m_parser;
+		te_program &m_program;
+		/* How many nodes are being lowered by recursing, including this one. */
+		size_t m_depth{0};
 
-	[[nodiscard]]
-	static auto find_lookup(state *s, const std::string_view name)
+		void lower(const node_index texp) { m_parser.lower_node(texp, m_program, m_depth + 1); }
+
+		void lower_conditionally(const node_index texp)
+		{
+			const auto readyCount = save_ready_count();
+			lower(texp);
+			forget_ready_nodes(readyCount);
+		}
+
+		void emit(const te_program::instruction instr, const int64_t stackEffect)
+		{
+			m_program.emit(instr, stackEffect);
+		}
+
+		void emit(const te_program::instruction instr, const int64_t stackEffect,
+		          const node_index constant, const bool negated = false)
+		{
+			m_program.emit(instr, stackEffect);
+			m_parser.record_constant_use(m_program, constant, negated);
+		}
+
+		void emit_call(const node_index texp) { m_parser.emit_node_call(texp, m_program); }
+
+		void emit_call2(const te_fun2 func) { m_parser.emit_builtin_call2(func, m_program); }
+
+		/* Returns the jump's position. */
+		[[nodiscard]]
+		size_t emit_jump(const te_program::opcode op, const int64_t stackEffect)
+		{
+			return m_program.emit_jump(op, stackEffect);
+		}
+
+		void patch_jump(const size_t jump) { m_program.patch_jump(jump); }
+
+		[[nodiscard]]
+		size_t save_depth() const noexcept
+		{
+			return static_cast<size_t>(m_program.m_currentStackDepth);
+		}
+
+		void restore_depth(const size_t depth) noexcept
+		{
+			m_program.m_currentStackDepth = static_cast<int64_t>(depth);
+		}
+
+		[[nodiscard]]
+		size_t save_ready_count() const noexcept
+		{
+			return m_parser.m_readyNodes.size();
+		}
+
+		void forget_ready_nodes(const size_t readyCount)
+		{
+			m_parser.forget_ready_nodes(readyCount);
+		}
+	};
+
+	/* How deeply lower_node() recurses before lowering the rest of a subtree
+	   through a lowering_plan. */
+	constexpr static size_t MAX_DIRECT_LOWERING_DEPTH{64};
+
+	/* Lowers an (optimized) expression tree into bytecode. Nodes that are used more
+	   than once are computed once and then re-read from a temporary. */
+	void te_lower(const node_index texp, te_program &program);
+	/* Lowers a node (or re-reads its temporary) by recursing, or through a lowering_plan
+	   once depth reaches MAX_DIRECT_LOWERING_DEPTH. */
+	void lower_node(const node_index texp, te_program &program, const size_t depth);
+	/* Lowers a node through m_loweringPlan, without recursing. */
+	void lower_planned(const node_index texp, te_program &program);
+	/* If a node's value is already in a temporary, emits its load and returns true. */
+	bool load_ready_temp(const node_index texp, te_program &program) const;
+	/* Returns whether a node's value is stored in a temporary, for its other uses. */
+	[[nodiscard]]
+	bool needs_temp(const node_index texp) const noexcept;
+	/* Stores the value of a node that needs_temp() in its temporary. */
+	void store_temp(const node_index texp, te_program &program);
+	/* Emits the call of a builtin binary function (whose arguments have been lowered). */
+	static void emit_builtin_call2(const te_fun2 func, te_program &program);
+	/* Plans the steps that lower a node's own instructions (and its arguments),
+	   with either a lowering_plan or a direct_lowering. */
+	template <typename PlanT>
+	void plan_node_lowering(const node_index texp, PlanT &plan) const;
+	/* Plans IF, IFS, AND, and OR as jumps, so that only the arguments that
+	   are needed get evaluated. Returns false if texp is not one of them. */
+	template <typename PlanT>
+	[[nodiscard]]
+	bool plan_lazy_lowering(const node_index texp, PlanT &plan) const;
+	/* Emits the call of a node's function (whose arguments have been lowered). */
+	void emit_node_call(const node_index texp, te_program &program) const;
+	/* Marks the temporaries computed since readyCount nodes were ready as not ready. */
+	void forget_ready_nodes(const size_t readyCount);
+
+	/// @returns The builtin function or constant with the given name, or null if not found.
+	[[nodiscard]]
+	static const te_builtin *find_builtin(const std::string_view name) noexcept;
+
+	[[nodiscard]]
+	static std::set<te_variable>::const_iterator find_lookup(state *s, const std::string_view name)
 	{
-		return s->m_lookup.find(te_variable{te_variable::name_type{name},
-		                                    static_cast<te_type>(0.0), TE_DEFAULT, nullptr});
+		if (s->m_lookupIndex != nullptr)
+		{
+			return s->m_lookupIndex->find(name).value_or(s->m_lookup.cend());
+		}
+		return s->m_lookup.find(name);
 	}
 
 	void next_token(state *theState);
+	/* Reads the variable or function that the current token names. */
+	template <typename SymbolT>
+	void read_symbol(state *theState, const SymbolT &symbol);
+	/* A rule that the parser is partway through reading. */
+	struct parse_frame
+	{
+		/* The start of each rule, and the steps that they continue from
+		   after reading another rule. */
+		enum class step : uint8_t
+		{
+			LIST,
+			LIST_FIRST,
+			LIST_NEXT,
+			EXPR,
+			EXPR_OPERAND,
+			EXPR_RIGHT,
+			POWER,
+			POWER_OPERAND,
+			BASE,
+			BASE_PARENS,
+			BASE_OPERAND,
+			BASE_VARIADIC_ARG,
+			BASE_ARG
+		};
+
+		step   m_step{step::LIST};
+		size_t m_depth{0};
+		/* The node being built. */
+		node_index m_node{te_node_arena::MISSING};
+		/* For expressions: the lowest precedence to read, and the operator being read. */
+		int     m_minPrecedence{1};
+		bool    m_isFirstOperand{true};
+		bool    m_negate{false};
+		te_fun2 m_operator{nullptr};
+		/* For powers: the prefix operator (if any). */
+		te_fun1 m_prefix{nullptr};
+		/* For function calls: which argument is being read (or where the arguments of a
+		   variadic function start), and what was known about the function. */
+		size_t            m_argIndex{0};
+		size_t            m_arity{0};
+		bool              m_varValid{false};
+		te_variable_flags m_varType{TE_DEFAULT};
+		te_variant_type   m_function{};
+	};
+
+	/* How deeply the parser recurses before reading the rest of a rule through
+	   parse_deep(). */
+	constexpr static size_t MAX_RECURSIVE_PARSE_DEPTH{32};
+
+	/* Reads a list of expressions, returning its root. */
 	[[nodiscard]]
-	te_expr *base(state *theState);
-	[[nodiscard]]
-	te_expr *power(state *theState);
-	[[nodiscard]]
-	te_expr *factor(state *theState);
-	[[nodiscard]]
-	te_expr *term(state *theState);
-	[[nodiscard]]
-	te_expr *expr_level1(state *theState);
-	[[nodiscard]]
-	te_expr *expr_level2(state *theState);
+	node_index parse(state *theState);
+	/* Reads a rule that is depth levels deep: by recursing (through the functions below),
+	   or with parse_deep() once depth reaches MAX_RECURSIVE_PARSE_DEPTH.
+	   Nesting deeper than the maximum depth reads an error instead, which stops the parse. */
+	template <parse_frame::step rule>
 	[[nodiscard]]
-	te_expr *expr_level3(state *theState);
+	node_index parse_nested(state *theState, const size_t depth, const int minPrecedence = 1,
+	                        const bool liftNegation = true);
 	[[nodiscard]]
-	te_expr *expr_level4(state *theState);
+	node_index parse_list(state *theState, const size_t depth);
+	/* Reads the operators (and their operands) that bind at least as tightly as minPrecedence.
+	   liftNegation is false for the right side of a right-to-left operator. */
 	[[nodiscard]]
-	te_expr *expr_level5(state *theState);
+	node_index parse_expr(state *theState, const size_t depth, const int minPrecedence,
+	                      const bool liftNegation);
 	[[nodiscard]]
-	te_expr *expr_level6(state *theState);
+	node_index parse_power(state *theState, const size_t depth);
 	[[nodiscard]]
-	te_expr *expr_level7(state *theState);
+	node_index parse_base(state *theState, const size_t depth);
+	/* Reads a rule with an explicit stack of frames (rather than by recursing),
+	   so that deeply nested expressions can't overflow the call stack. */
 	[[nodiscard]]
-	te_expr *expr_level8(state *theState);
+	node_index parse_deep(state *theState, const parse_frame::step rule, const size_t depth,
+	                      const int minPrecedence, const bool liftNegation);
+	/* Reads a constant or variable. */
 	[[nodiscard]]
-	te_expr *expr_level9(state *theState);
+	node_index read_value(state *theState);
+	/* Reads the prefix operators in front of a power, returning the one to apply (if any). */
 	[[nodiscard]]
-	te_expr *list(state *theState);
-
-	// built-in functions
-	static const std::set<te_variable> m_functions;
+	te_fun1 read_prefix(state *theState);
+	/* Reads the closing parenthesis of a call whose last argument was argIndex
+	   (or reads an error if the call has the wrong number of arguments). */
+	void read_call_end(state *theState, const size_t argIndex, const size_t arity,
+	                   const bool varValid, const te_variable_flags varType);
+	/* Reads a closing parenthesis, or an error if there isn't one. */
+	void read_close(state *theState);
+	/* The binary operators that next_token() reads, from the lowest precedence to the highest
+	   (which read_infix() looks up their functions and precedences by). */
+	enum class infix_operator : uint8_t
+	{
+		OR,
+		AND,
+		BITWISE_OR,
+		BITWISE_XOR,
+		BITWISE_AND,
+		EQUAL,
+		NOT_EQUAL,
+		LESS_THAN,
+		LESS_THAN_EQUAL_TO,
+		GREATER_THAN,
+		GREATER_THAN_EQUAL_TO,
+		LEFT_SHIFT,
+		RIGHT_SHIFT,
+		LEFT_ROTATE,
+		RIGHT_ROTATE,
+		ADD,
+		SUB,
+		MUL,
+		DIVIDE,
+		MODULUS,
+		POW
+	};
+	/* Sets the current token to an infix operator, along with its function, precedence,
+	   and grouping (from the operator table). */
+	static void read_infix(state *theState, const infix_operator oper) noexcept;
 
 	// customizable settings
 	std::set<te_variable> m_customFuncsAndVars;
+	/// @brief The optional hash index over m_customFuncsAndVars.
+	te_symbol_index m_symbolIndex;
+	bool            m_useSymbolIndex{false};
+	/// @brief Whether the variables were replaced (or edited directly) since the index
+	///     was last built.
+	bool m_symbolIndexStale{true};
 
 	te_usr_variant_type m_unknownSymbolResolve{te_usr_noop{}};
 
@@ -1093,8 +2826,130 @@ class te_parser
 	char m_listSeparator{','};
 
 	// state information
-	std::string m_expression;
-	te_expr    *m_compiledExpression{nullptr};
+	std::string                                   m_expression;
+	std::shared_ptr<const te_compiled_expression> m_compiledExpression;
+	/// @brief The nodes of the expression tree while it is being compiled.
+	te_node_arena m_nodes;
+
+	/// @brief How a node is shared while the tree is being lowered.
+	struct node_sharing
+	{
+		/// @brief The number of nodes (or roots) that refer to it.
+		uint32_t m_uses{0};
+		/// @brief The temporary that its value is stored in, or -1.
+		int64_t m_temp{-1};
+		/// @brief Whether the temporary is known to hold the value at this point
+		///     of the program.
+		bool m_ready{false};
+		/// @brief Whether its value is kept between evaluations
+		///     (see set_subtree_caching_enabled()).
+		bool m_cached{false};
+	};
+
+	/// @brief The sharing information of each node, by the node's index.
+	std::vector<node_sharing> m_nodeSharing;
+	/// @brief The nodes whose temporaries were made ready, in order.
+	std::vector<node_index> m_readyNodes;
+
+	/// @brief A node registered for sharing, along with its hash.
+	struct shared_node
+	{
+		size_t     m_hash{0};
+		node_index m_node{te_node_arena::MISSING};
+	};
+
+	/// @brief The nodes that share_subexpressions() has registered, in an open-addressed
+	///     table (with linear probing) that is kept at most half full.
+	/// @details Empty slots hold te_node_arena::MISSING, which is never shared.
+	std::vector<shared_node> m_sharedNodes;
+
+	// Working stacks for parsing, walking, and lowering the tree. They are cleared before each
+	// use, but keep their memory, so that compiling one expression after another doesn't
+	// allocate them again.
+	/// @brief The rules that parse_deep() is partway through reading.
+	std::vector<parse_frame> m_parseFrames;
+	/// @brief The arguments read so far for the variadic functions that parse() is reading.
+	std::vector<node_index> m_variadicArgs;
+	/// @brief The nodes left to visit (and whether their arguments have been visited).
+	std::vector<std::pair<node_index, bool>> m_pendingNodes;
+	/// @brief The nodes left to visit (or the results of those visited).
+	std::vector<node_index> m_nodeStack;
+	/// @brief The steps left in lowering a tree.
+	lowering_plan m_loweringPlan;
+	/// @brief An instruction whose constant came from a node.
+	struct constant_use
+	{
+		size_t     m_instruction{0};
+		node_index m_node{0};
+		bool       m_negated{false};
+	};
+
+	/// @brief What set_constant() needs to change the value of a custom constant in the
+	///     compiled expression without compiling it again.
+	/// @details Folding and lowering only depend on which nodes are constant (not on their
+	///     values), so the constants that a custom constant was read or folded into can be
+	///     recomputed and written into the instructions that use them.
+	struct constant_patches
+	{
+		/// @brief The nodes that were read from custom constants, and the constants' names.
+		std::vector<std::pair<node_index, te_variable::name_type>> m_leaves;
+		/// @brief For each node, @c 0 if its value does not depend on a custom constant,
+		///     @c 1 + its index in @c m_leaves if it was read from one,
+		///     or FOLDED_ORIGIN if it was folded from them.
+		std::vector<uint32_t> m_origins;
+		/// @brief The nodes that were folded from custom constants, and what they were
+		///     before being folded (listed before the nodes that they were folded into).
+		std::vector<std::pair<node_index, te_node>> m_foldedNodes;
+		/// @brief The instructions whose constants came from those nodes.
+		std::vector<constant_use> m_uses;
+		/// @brief Whether these describe the compiled expression (whose tree is kept
+		///     if it read any custom constants).
+		bool m_valid{false};
+
+		constexpr static uint32_t FOLDED_ORIGIN{std::numeric_limits<uint32_t>::max()};
+
+		/// @returns Where a node's value came from.
+		[[nodiscard]]
+		uint32_t get_origin(const node_index texp) const noexcept
+		{
+			return (texp < m_origins.size()) ? m_origins[texp] : 0;
+		}
+	};
+
+	constant_patches m_constantPatches;
+
+	/// @brief The variables that each node's subtree reads (when caching subtrees).
+	std::vector<std::vector<const te_type *>> m_nodeVariables;
+
+	bool m_literalHoisting{false};
+	/// @brief The values of the literals in the expression being compiled,
+	///     whose addresses stand in for their parameter slots while it is lowered.
+	std::vector<te_type> m_hoistedLiterals;
+	/// @brief The number of literals that have been read while parsing.
+	size_t m_hoistedLiteralCount{0};
+
+	/// @brief A program shared by the expressions with the same shape.
+	struct literal_template
+	{
+		uint64_t                          m_symbolVersion{0};
+		std::shared_ptr<const te_program> m_program;
+#ifndef TE_NO_BOOKKEEPING
+		std::set<te_variable::name_type, te_string_less> m_usedFunctions;
+		std::set<te_variable::name_type, te_string_less> m_usedVars;
+#endif
+	};
+
+	/// @brief The programs kept for literal hoisting, by their expressions' shapes.
+	std::unordered_map<std::string, literal_template> m_literalTemplates;
+
+	bool m_subtreeCaching{false};
+	/// @brief The values of the compiled expression's cached subtrees.
+	std::vector<te_program::cached_value> m_subtreeCache;
+	/// @brief The program that m_subtreeCache belongs to.
+	const te_program *m_subtreeCacheProgram{nullptr};
+
+	bool m_reassociation{false};
+	bool m_approximateBatchMath{false};
 
 	bool        m_parseSuccess{false};
 	int64_t     m_errorPos{0};
@@ -1102,13 +2957,196 @@ class te_parser
 	te_type     m_result{te_nan};
 
 	std::set<te_variable::name_type> m_resolvedVariables;
+	/// @brief The custom variables read while parsing (see record_variable_slots()).
+	std::vector<const te_variable *> m_readVariables;
 
-	std::set<te_variable>::const_iterator m_currentVar;
-	bool                                  m_varFound{false};
+	/// @brief The type of the last variable or function that was read.
+	te_variable_flags m_currentVarType{TE_DEFAULT};
+	bool              m_varFound{false};
 #ifndef TE_NO_BOOKKEEPING
 	std::set<te_variable::name_type, te_string_less> m_usedFunctions;
 	std::set<te_variable::name_type, te_string_less> m_usedVars;
 #endif
+
+	// compile cache
+	struct compile_cache_entry
+	{
+		/// @brief The expression's text (before removing comments).
+		std::string                                   m_expression;
+		uint64_t                                      m_symbolVersion{0};
+		std::shared_ptr<const te_compiled_expression> m_compiledExpression;
+#ifndef TE_NO_BOOKKEEPING
+		std::set<te_variable::name_type, te_string_less> m_usedFunctions;
+		std::set<te_variable::name_type, te_string_less> m_usedVars;
+#endif
+	};
+
+	/// @brief Bumped whenever the variables and functions or parse settings change.
+	uint64_t m_symbolVersion{0};
+	size_t   m_compileCacheSize{0};
+	size_t   m_compileCacheHits{0};
+	size_t   m_compileCacheMisses{0};
+	size_t   m_maxDepth{DEFAULT_MAX_DEPTH};
+	/// @brief The cached expressions, the most recently used first.
+	std::list<compile_cache_entry> m_compileCache;
+	/// @brief The cached expressions, by their text (which is viewed from the entries).
+	std::unordered_map<std::string_view, std::list<compile_cache_entry>::iterator>
+	    m_compileCacheIndex;
+};
+
+#ifndef TE_NO_BOOKKEEPING
+/// @brief A set of named formulas that can refer to each other (and to inputs),
+///     like the cells of a spreadsheet.
+/// @details Each formula is compiled once, and the inputs and formulas that it uses
+///     (as reported by the parser's bookkeeping) become its precedents. Changing an input
+///     or a formula marks everything downstream of it as dirty, and recalculate() then
+///     re-evaluates only the dirty formulas, each one after the formulas that it uses.
+/// @note This relies on the parser's bookkeeping, so it is not available
+///     if @c TE_NO_BOOKKEEPING is defined.
+class te_formula_graph
+{
+  public:
+	te_formula_graph();
+
+	/// @private
+	~te_formula_graph();
+
+	te_formula_graph(const te_formula_graph &)            = delete;
+	te_formula_graph &operator=(const te_formula_graph &) = delete;
+
+	/** @brief Sets an input's value, adding the input if necessary.
+	    @param name The name of the input.
+	    @param value The value.
+	    @throws std::runtime_error Throws an exception if @c name is a formula,
+	        is already used by a custom variable or function, or is not a valid name.*/
+	void set_input(const std::string_view name, const te_type value);
+
+	/** @brief Sets a formula, adding it if necessary.
+	    @param name The name of the formula, which other formulas can refer to it by.
+	    @param expression The formula, which can use inputs, other formulas, and
+	        the functions and variables added with add_variable_or_function().
+	    @returns @c true if the formula compiled. If it did not (e.g., because of a syntax
+	        error, a name that does not exist yet, or a circular reference), its value
+	        will be NaN and get_error() will say why; it will be compiled again whenever
+	        new names are added.
+	    @note An input can be changed into a formula this way.
+	    @throws std::runtime_error Throws an exception if @c name is already used by
+	        a custom variable or function, or is not a valid name.*/
+	bool set_formula(const std::string_view name, const std::string_view expression);
+
+	/** @brief Removes an input or formula.
+	    @details Formulas that used it will fail to compile (until it is added again).
+	    @param name The name of the input or formula.*/
+	void remove(const std::string_view name);
+
+	/** @brief Adds a custom function or variable that formulas can use.
+	    @details Changes to the values of custom variables are not tracked,
+	        so values that change should be inputs instead.
+	    @param var The function or variable.*/
+	void add_variable_or_function(te_variable var);
+
+	/** @brief Re-evaluates the formulas that are dirty, in dependency order.
+	    @returns The number of formulas that were evaluated.*/
+	size_t recalculate();
+
+	/** @brief Re-evaluates the formulas that are dirty on multiple threads.
+	    @details The dirty formulas are grouped into levels, where every formula's
+	        precedents are in earlier levels, so the formulas within a level can be
+	        evaluated in parallel. Each thread takes a chunk of the level at a time until
+	        the level is finished, and then waits for the others before starting the next one.
+	        (Small levels are evaluated by the calling thread alone, since they
+	        are not worth synchronizing the threads for.)\n
+	        The worker threads are started the first time that they are needed, and are
+	        kept (idle) for later calls until the graph is destroyed.\n
+	        Custom functions that the formulas use must be safe to call concurrently.
+	    @param threadCount The number of threads to use (including the calling thread).
+	        The default of @c 0 uses one per hardware thread.
+	    @returns The number of formulas that were evaluated.*/
+	size_t recalculate_parallel(size_t threadCount = 0);
+
+	/// @returns @c true if any formulas need to be recalculated.
+	[[nodiscard]]
+	bool is_dirty() const noexcept
+	{
+		return !m_dirtyCells.empty();
+	}
+
+	/// @returns An input's value, or a formula's value as of the last recalculate()
+	///     (or NaN if @c name is not found).
+	/// @param name The name of the input or formula.
+	[[nodiscard]]
+	te_type get_value(const std::string_view name) const;
+
+	/// @returns Why a formula failed to compile or evaluate, or an empty string
+	///     if it succeeded (or @c name is not found).
+	/// @param name The name of the formula.
+	[[nodiscard]]
+	const std::string &get_error(const std::string_view name) const;
+
+	/// @returns The number of inputs and formulas.
+	[[nodiscard]]
+	size_t get_cell_count() const noexcept
+	{
+		return m_cellIndices.size();
+	}
+
+  private:
+	/// @brief The number of formulas that a thread takes from a level at a time.
+	constexpr static size_t PARALLEL_CHUNK_SIZE{64};
+
+	/// @brief The threads that help recalculate_parallel() (defined in the source file).
+	class worker_pool;
+
+	/// @brief An input or formula.
+	struct cell
+	{
+		/// @brief The value, which formulas that use this cell are bound to.
+		std::unique_ptr<te_type> m_value{std::make_unique<te_type>(te_parser::te_nan)};
+		std::string              m_expression;
+		std::string              m_error;
+		/// @brief The compiled formula, or null if it failed to compile.
+		std::shared_ptr<const te_compiled_expression> m_compiled;
+		/// @brief The cells that this formula uses.
+		std::vector<size_t> m_precedents;
+		/// @brief The formulas that use this cell.
+		std::vector<size_t> m_dependents;
+		/// @brief While recalculating, the number of dirty precedents not yet evaluated.
+		size_t   m_pendingPrecedents{0};
+		uint64_t m_visitMark{0};
+		bool     m_isFormula{false};
+		bool     m_dirty{false};
+		bool     m_removed{false};
+	};
+
+	/* Returns the index of the cell with the given name, adding it if necessary. */
+	[[nodiscard]]
+	size_t find_or_add_cell(const std::string_view name);
+	/* Compiles a formula and links it to its precedents. */
+	void compile_cell(const size_t index);
+	/* Removes a formula from its precedents' dependents. */
+	void unlink_cell(const size_t index);
+	/* Returns true if any of the precedents is the cell or downstream of it. */
+	[[nodiscard]]
+	bool creates_cycle(const size_t index, const std::vector<size_t> &precedents);
+	/* Marks a cell and everything downstream of it as dirty. */
+	void mark_dirty(const size_t index);
+	/* Sorts the dirty formulas into levels that only depend on earlier levels,
+	   and clears the dirty list. levelStarts ends with the size of order. */
+	void schedule_dirty_cells(std::vector<size_t> &order, std::vector<size_t> &levelStarts);
+	/* Evaluates a formula into its value. */
+	void evaluate_cell(const size_t index);
+	/* Compiles the formulas that failed again, after names were added. */
+	void retry_failed_formulas();
+
+	te_parser                                                m_parser;
+	std::vector<cell>                                        m_cells;
+	std::map<te_variable::name_type, size_t, te_string_less> m_cellIndices;
+	std::vector<size_t>                                      m_dirtyCells;
+	std::vector<size_t>                                      m_failedFormulas;
+	uint64_t                                                 m_visitGeneration{0};
+	/// @brief The worker threads, or null until recalculate_parallel() first needs them.
+	std::unique_ptr<worker_pool> m_workers;
 };
+#endif
 
 #endif        // __TINYEXPR_PLUS_PLUS_H__